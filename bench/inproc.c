@@ -0,0 +1,278 @@
+/*
+    In-process benchmark of common.h
+
+    Runs the operations of bench/main.go calling the same functions as the cli-socket server,
+    on the emulated secure module and without any transport, and reports them in the same format:
+    a table on stdout and a JSON line per operation appended to the results file.
+    Comparing both tells how much every front-end adds to the cost of the signatures.
+
+    Usage: inproc [-c concurrency] [-n requests] [-b batch] [-o results] [-l label] [operations...]
+    The label names the run in the results, build_bench.sh sets it to the blst build profile.
+*/
+
+#define EMU
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../blst/bindings/blst.h"
+#include "../cli/include/common.h"
+
+#include "../secure_module/zephyr/spm/src/main.c"
+
+#define MAX 1024
+#define MAXBatch 64
+#define warmupRequests 10
+
+int concurrency = 1;
+int requests = 1000;
+int batchSize = 8;
+const char* label = "inproc";
+
+char publicKey[99];
+char signatureHex[195];
+
+struct benchRun{
+    int (*request)(int64_t i);
+    atomic_int_fast64_t next;
+    atomic_int_fast64_t errors;
+    uint64_t* latencies;
+};
+
+uint64_t nowNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+    Every request signs a different message, so that the hash to curve cache isn't measured
+*/
+void message(int64_t i, char* msg){
+    snprintf(msg, 65, "%064llx", (unsigned long long) i);
+}
+
+/*
+    Calls a command like the cli-socket server does, with a reply buffer that fits its output
+    Returns the reply, which has to be freed, or NULL if it couldn't be allocated
+*/
+char* command(void (*fn)(int, char**, char*), int argc, char** argv){
+    size_t replySize = MAX + ((size_t) get_keystore_size() + argc) * 200;
+    char* reply = calloc(replySize, 1);
+    if(reply != NULL){
+        fn(argc, argv, reply);
+    }
+    return reply;
+}
+
+/*
+    Each request returns 0 on success and -1 on error
+*/
+int checkReply(char* reply, const char* expected){
+    int ret = (reply != NULL && strstr(reply, expected) != NULL) ? 0 : -1;
+    free(reply);
+    return ret;
+}
+
+int keygenRequest(int64_t i){
+    char* argv[] = {"keygen"};
+    return checkReply(command(keygen, 1, argv), "0x");
+}
+
+int signRequest(int64_t i){
+    char msg[65];
+    message(i, msg);
+    char* argv[] = {"signature", publicKey, msg};
+    return checkReply(command(signature, 3, argv), "0x");
+}
+
+int verifyRequest(int64_t i){
+    char msg[65];
+    message(0, msg);
+    char* argv[] = {"verify", publicKey, msg, signatureHex};
+    return checkReply(command(verify, 4, argv), "Success");
+}
+
+int signBatchRequest(int64_t i){
+    char msgs[MAXBatch][65];
+    char* argv[1 + 2*MAXBatch];
+    argv[0] = "signbatch";
+    for(int j = 0; j < batchSize; ++j){
+        message(i * batchSize + j, msgs[j]);
+        argv[1 + 2*j] = publicKey;
+        argv[2 + 2*j] = msgs[j];
+    }
+    return checkReply(command(signature_batch, 1 + 2*batchSize, argv), "Signatures");
+}
+
+int getKeysRequest(int64_t i){
+    char* argv[] = {"getkeys"};
+    return checkReply(command(get_keys, 1, argv), "{\"keys\"");
+}
+
+void* worker(void* arg){
+    struct benchRun* run = arg;
+    for(;;){
+        int64_t i = atomic_fetch_add(&run->next, 1);
+        if(i >= requests){
+            return NULL;
+        }
+        uint64_t begin = nowNs();
+        if(run->request(i) == -1){
+            atomic_fetch_add(&run->errors, 1);
+        }
+        run->latencies[i] = nowNs() - begin;
+    }
+}
+
+int compareLatencies(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+double percentile(uint64_t* sorted, double p){
+    return sorted[(size_t) (p * (requests - 1))] / 1e3;
+}
+
+/*
+    On success returns 0
+    On error returns -1
+*/
+int runOp(const char* op, int (*request)(int64_t), FILE* results){
+    struct benchRun run = {.request = request};
+    pthread_t threads[concurrency];
+
+    run.latencies = malloc(requests * sizeof(uint64_t));
+    if(run.latencies == NULL){
+        return -1;
+    }
+    for(int i = 0; i < warmupRequests; ++i){
+        request(requests + i);
+    }
+
+    time_t startTime = time(NULL);
+    uint64_t start = nowNs();
+    for(int t = 0; t < concurrency; ++t){
+        pthread_create(&threads[t], NULL, worker, &run);
+    }
+    for(int t = 0; t < concurrency; ++t){
+        pthread_join(threads[t], NULL);
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    qsort(run.latencies, requests, sizeof(uint64_t), compareLatencies);
+    long long errors = atomic_load(&run.errors);
+    double p50 = percentile(run.latencies, 0.50), p90 = percentile(run.latencies, 0.90);
+    double p99 = percentile(run.latencies, 0.99), max = percentile(run.latencies, 1);
+
+    printf("%-10s %8d %8lld %12.1f %10.0f %10.0f %10.0f %10.0f\n", op, requests, errors, requests / seconds, p50, p90, p99, max);
+
+    char timeStr[32];
+    strftime(timeStr, sizeof(timeStr), "%Y-%m-%dT%H:%M:%SZ", gmtime(&startTime));
+    fprintf(results, "{\"frontend\":\"%s\",\"op\":\"%s\",\"concurrency\":%d,\"requests\":%d,\"errors\":%lld,", label, op, concurrency, requests, errors);
+    if(request == signBatchRequest){
+        fprintf(results, "\"batch\":%d,", batchSize);
+    }
+    fprintf(results, "\"seconds\":%g,\"ops_per_sec\":%g,\"p50_us\":%g,\"p90_us\":%g,\"p99_us\":%g,\"max_us\":%g,\"time\":\"%s\"}\n",
+        seconds, requests / seconds, p50, p90, p99, max, timeStr);
+
+    free(run.latencies);
+    return 0;
+}
+
+int main(int argc, char** argv){
+    const char* output = "bench.jsonl";
+    int opt;
+
+    while((opt = getopt(argc, argv, "c:n:b:o:l:")) != -1){
+        switch(opt){
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'n':
+                requests = atoi(optarg);
+                break;
+            case 'b':
+                batchSize = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c concurrency] [-n requests] [-b batch] [-o results] [-l label] [keygen|sign|verify|signbatch|getkeys...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(concurrency < 1 || requests < 1 || batchSize < 1 || batchSize > MAXBatch){
+        fprintf(stderr, "-c and -n must be at least 1 and -b between 1 and %d\n", MAXBatch);
+        return 1;
+    }
+
+    if(keystore_load() == -1){
+        fprintf(stderr, "The keystore file couldn't be loaded\n");
+        return 1;
+    }
+
+    //A key to sign with and a signature to verify
+    char* keygenArgv[] = {"keygen"};
+    char* reply = command(keygen, 1, keygenArgv);
+    char* found = (reply != NULL) ? strstr(reply, "0x") : NULL;
+    if(found == NULL){
+        fprintf(stderr, "keygen failed\n");
+        return 1;
+    }
+    snprintf(publicKey, sizeof(publicKey), "%.98s", found);
+    free(reply);
+
+    char msg[65];
+    message(0, msg);
+    char* signArgv[] = {"signature", publicKey, msg};
+    reply = command(signature, 3, signArgv);
+    found = (reply != NULL) ? strstr(reply, "0x") : NULL;
+    if(found == NULL){
+        fprintf(stderr, "signature failed\n");
+        return 1;
+    }
+    snprintf(signatureHex, sizeof(signatureHex), "%.194s", found);
+    free(reply);
+
+    FILE* results = fopen(output, "a");
+    if(results == NULL){
+        perror(output);
+        return 1;
+    }
+
+    const char* opNames[] = {"keygen", "sign", "verify", "signbatch", "getkeys"};
+    int (*opRequests[])(int64_t) = {keygenRequest, signRequest, verifyRequest, signBatchRequest, getKeysRequest};
+    int nOps = sizeof(opNames) / sizeof(opNames[0]);
+
+    //The operations in the command line, or all of them
+    const char** ops = (optind < argc) ? (const char**) argv + optind : opNames;
+    int nSelected = (optind < argc) ? argc - optind : nOps;
+
+    printf("%-10s %8s %8s %12s %10s %10s %10s %10s\n", "op", "requests", "errors", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+    for(int i = 0; i < nSelected; ++i){
+        int j = 0;
+        while(j < nOps && strcmp(ops[i], opNames[j]) != 0){
+            ++j;
+        }
+        if(j == nOps){
+            fprintf(stderr, "Unknown operation %s\n", ops[i]);
+        }else if(runOp(opNames[j], opRequests[j], results) == -1){
+            fprintf(stderr, "%s failed\n", ops[i]);
+        }
+    }
+
+    fclose(results);
+    return 0;
+}
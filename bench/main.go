@@ -0,0 +1,365 @@
+package main
+
+//Benchmark of the signer front-ends
+//The same operations are sent to the cli-socket server (text commands over TCP) or to an HTTP signer,
+//remote-c or remote-go, at a given concurrency, and their throughput and latency percentiles are printed
+//and appended as JSON lines to the results file. bench/inproc.c measures the same operations calling
+//common.h in-process, with the same output, so every front-end can be compared with what it adds.
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/json"
+	"errors"
+	"flag"
+	"fmt"
+	"io/ioutil"
+	"log"
+	"net"
+	"net/http"
+	"os"
+	"regexp"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+var (
+	targetName  = flag.String("target", "socket", "front-end to benchmark: socket (cli-socket) or http (remote-c, remote-go)")
+	addr        = flag.String("addr", "127.0.0.1:8080", "address of the front-end")
+	label       = flag.String("label", "", "name of the front-end in the results, the target by default")
+	opsFlag     = flag.String("ops", "keygen,sign,verify,signbatch,getkeys", "operations to run, in order")
+	concurrency = flag.Int("c", 1, "requests in flight")
+	requests    = flag.Int("n", 1000, "requests per operation")
+	warmup      = flag.Int("warmup", 10, "requests per operation that aren't measured")
+	batchSize   = flag.Int("batch", 8, "signatures per signbatch request")
+	output      = flag.String("o", "bench.jsonl", "file the results are appended to")
+)
+
+//Every request signs a different message, so that the hash to curve cache of common.h isn't measured
+func message(i int64) string {
+	return fmt.Sprintf("%064x", i)
+}
+
+var keyPattern = regexp.MustCompile(`[0-9a-fA-F]{96}`)
+
+type target interface {
+	//Called once before the operations, it finds or generates the keys to sign with
+	setup() error
+	supports(op string) bool
+	do(op string, i int64) error
+}
+
+//Results of an operation, one JSON line each
+type result struct {
+	Frontend    string  `json:"frontend"`
+	Op          string  `json:"op"`
+	Concurrency int     `json:"concurrency"`
+	Requests    int     `json:"requests"`
+	Errors      int64   `json:"errors"`
+	Batch       int     `json:"batch,omitempty"`
+	Seconds     float64 `json:"seconds"`
+	OpsPerSec   float64 `json:"ops_per_sec"`
+	P50Us       float64 `json:"p50_us"`
+	P90Us       float64 `json:"p90_us"`
+	P99Us       float64 `json:"p99_us"`
+	MaxUs       float64 `json:"max_us"`
+	Time        string  `json:"time"`
+}
+
+//cli-socket serves a single connection and answers its commands in order, so requests take turns on it
+//and a concurrency above 1 only measures how long they queue
+type socketTarget struct {
+	lock   sync.Mutex
+	conn   net.Conn
+	reader *bufio.Reader
+	pk     string
+	sig    string
+}
+
+func (t *socketTarget) command(command string, done func(line string) (bool, error)) error {
+	t.lock.Lock()
+	defer t.lock.Unlock()
+
+	_, err := t.conn.Write([]byte(command + "\n"))
+	if err != nil {
+		return err
+	}
+	for {
+		line, err := t.reader.ReadString('\n')
+		if err != nil {
+			return err
+		}
+		finished, err := done(strings.TrimRight(line, "\r\n"))
+		if finished {
+			return err
+		}
+	}
+}
+
+//Waits for n lines starting with 0x, the headers that come before them are skipped
+//and any other line is an error that ends the response
+func hexLines(n int, out *string) func(line string) (bool, error) {
+	return func(line string) (bool, error) {
+		if strings.HasPrefix(line, "0x") {
+			n--
+			if out != nil {
+				*out = line
+			}
+			return n == 0, nil
+		}
+		if strings.HasSuffix(strings.TrimSpace(line), ":") {
+			return false, nil
+		}
+		return true, errors.New(line)
+	}
+}
+
+func (t *socketTarget) setup() error {
+	conn, err := net.Dial("tcp", *addr)
+	if err != nil {
+		return err
+	}
+	t.conn = conn
+	t.reader = bufio.NewReader(conn)
+
+	err = t.command("keygen", hexLines(1, &t.pk))
+	if err != nil {
+		return err
+	}
+	return t.command("signature "+t.pk+" "+message(0), hexLines(1, &t.sig))
+}
+
+func (t *socketTarget) supports(op string) bool {
+	return true
+}
+
+func (t *socketTarget) do(op string, i int64) error {
+	switch op {
+	case "keygen":
+		return t.command("keygen", hexLines(1, nil))
+	case "sign":
+		return t.command("signature "+t.pk+" "+message(i), hexLines(1, nil))
+	case "verify":
+		return t.command("verify "+t.pk+" "+message(0)+" "+t.sig, func(line string) (bool, error) {
+			if line == "Success" {
+				return true, nil
+			}
+			return true, errors.New(line)
+		})
+	case "signbatch":
+		var command strings.Builder
+		command.WriteString("signbatch")
+		for j := 0; j < *batchSize; j++ {
+			command.WriteString(" " + t.pk + " " + message(i*int64(*batchSize)+int64(j)))
+		}
+		return t.command(command.String(), hexLines(*batchSize, nil))
+	case "getkeys":
+		return t.command("getkeys", func(line string) (bool, error) {
+			if strings.HasSuffix(line, "]}") {
+				return true, nil
+			}
+			if strings.HasPrefix(line, "{") || strings.HasPrefix(line, "\"") {
+				return false, nil
+			}
+			return true, errors.New(line)
+		})
+	}
+	return errors.New("Unknown operation " + op)
+}
+
+//remote-c and remote-go serve the Web3Signer API, which has no keygen or verify,
+//and only remote-c serves sign/batch, which setup probes for
+type httpTarget struct {
+	client *http.Client
+	base   string
+	keys   []string
+	batch  bool
+}
+
+//An AGGREGATION_SLOT request is the cheapest object to derive a signing root for. It carries no signingRoot,
+//both signers derive it, and remote-go and a remote-c with a slashing database refuse one that isn't the derived root
+const signBody = `{"type":"AGGREGATION_SLOT","fork_info":{"fork":{"previous_version":"0x00000001","current_version":"0x00000001","epoch":"0"},` +
+	`"genesis_validators_root":"0x04700007fabc8282644aed6d1c7c9e21d38a03a0c4ba193f3afe428824b3a673"},` +
+	`"aggregation_slot":{"slot":"%d"}}`
+
+func (t *httpTarget) request(method string, path string, body string) ([]byte, error) {
+	req, err := http.NewRequest(method, t.base+path, strings.NewReader(body))
+	if err != nil {
+		return nil, err
+	}
+	if body != "" {
+		req.Header.Set("Content-Type", "application/json")
+	}
+	resp, err := t.client.Do(req)
+	if err != nil {
+		return nil, err
+	}
+	defer resp.Body.Close()
+	reply, err := ioutil.ReadAll(resp.Body)
+	if err != nil {
+		return nil, err
+	}
+	if resp.StatusCode != http.StatusOK {
+		return nil, fmt.Errorf("%s %s: %s", method, path, resp.Status)
+	}
+	return reply, nil
+}
+
+func (t *httpTarget) setup() error {
+	t.base = "http://" + *addr
+	t.client = &http.Client{
+		Transport: &http.Transport{MaxIdleConnsPerHost: *concurrency},
+		Timeout:   30 * time.Second,
+	}
+	reply, err := t.request(http.MethodGet, "/api/v1/eth2/publicKeys", "")
+	if err != nil {
+		return err
+	}
+	for _, key := range keyPattern.FindAllString(string(reply), -1) {
+		t.keys = append(t.keys, "0x"+strings.ToLower(key))
+	}
+	if len(t.keys) == 0 {
+		return errors.New("The signer has no keys")
+	}
+	//remote-go takes "batch" for a public key, and remote-c refuses batches with a slashing database
+	_, err = t.request(http.MethodPost, "/api/v1/eth2/sign/batch", fmt.Sprintf(`[{"pubkey":"%s","signingRoot":"0x%s"}]`, t.keys[0], message(0)))
+	t.batch = err == nil
+	return nil
+}
+
+func (t *httpTarget) supports(op string) bool {
+	return op == "sign" || (op == "signbatch" && t.batch) || op == "getkeys"
+}
+
+func (t *httpTarget) do(op string, i int64) error {
+	switch op {
+	case "sign":
+		_, err := t.request(http.MethodPost, "/api/v1/eth2/sign/"+t.keys[i%int64(len(t.keys))], fmt.Sprintf(signBody, i))
+		return err
+	case "signbatch":
+		var body bytes.Buffer
+		body.WriteString("[")
+		for j := 0; j < *batchSize; j++ {
+			if j > 0 {
+				body.WriteString(",")
+			}
+			n := i*int64(*batchSize) + int64(j)
+			fmt.Fprintf(&body, `{"pubkey":"%s","signingRoot":"0x%s"}`, t.keys[n%int64(len(t.keys))], message(n))
+		}
+		body.WriteString("]")
+		_, err := t.request(http.MethodPost, "/api/v1/eth2/sign/batch", body.String())
+		return err
+	case "getkeys":
+		_, err := t.request(http.MethodGet, "/api/v1/eth2/publicKeys", "")
+		return err
+	}
+	return errors.New("Unknown operation " + op)
+}
+
+func percentile(sorted []time.Duration, p float64) float64 {
+	i := int(p * float64(len(sorted)-1))
+	return float64(sorted[i]) / float64(time.Microsecond)
+}
+
+//Runs warmup and then n requests of op, each worker takes the next request number until none is left
+func run(t target, op string) result {
+	for i := 0; i < *warmup; i++ {
+		t.do(op, int64(*requests+i))
+	}
+
+	latencies := make([]time.Duration, *requests)
+	var next int64 = -1
+	var errs int64
+	var wg sync.WaitGroup
+
+	start := time.Now()
+	for w := 0; w < *concurrency; w++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for {
+				i := atomic.AddInt64(&next, 1)
+				if i >= int64(*requests) {
+					return
+				}
+				begin := time.Now()
+				err := t.do(op, i)
+				latencies[i] = time.Since(begin)
+				if err != nil {
+					if atomic.AddInt64(&errs, 1) == 1 {
+						log.Printf("%s: %v", op, err)
+					}
+				}
+			}
+		}()
+	}
+	wg.Wait()
+	elapsed := time.Since(start)
+
+	sort.Slice(latencies, func(a, b int) bool { return latencies[a] < latencies[b] })
+	res := result{
+		Frontend:    *label,
+		Op:          op,
+		Concurrency: *concurrency,
+		Requests:    *requests,
+		Errors:      errs,
+		Seconds:     elapsed.Seconds(),
+		OpsPerSec:   float64(*requests) / elapsed.Seconds(),
+		P50Us:       percentile(latencies, 0.50),
+		P90Us:       percentile(latencies, 0.90),
+		P99Us:       percentile(latencies, 0.99),
+		MaxUs:       percentile(latencies, 1),
+		Time:        start.UTC().Format(time.RFC3339),
+	}
+	if op == "signbatch" {
+		res.Batch = *batchSize
+	}
+	return res
+}
+
+func main() {
+	flag.Parse()
+	if *concurrency < 1 || *requests < 1 || *batchSize < 1 {
+		log.Fatal("-c, -n and -batch must be at least 1")
+	}
+	if *label == "" {
+		*label = *targetName
+	}
+
+	var t target
+	switch *targetName {
+	case "socket":
+		t = &socketTarget{}
+	case "http":
+		t = &httpTarget{}
+	default:
+		log.Fatal("Unknown target " + *targetName)
+	}
+	err := t.setup()
+	if err != nil {
+		log.Fatal(err)
+	}
+
+	out, err := os.OpenFile(*output, os.O_APPEND|os.O_CREATE|os.O_WRONLY, 0644)
+	if err != nil {
+		log.Fatal(err)
+	}
+	defer out.Close()
+
+	fmt.Printf("%-10s %8s %8s %12s %10s %10s %10s %10s\n", "op", "requests", "errors", "ops/s", "p50 us", "p90 us", "p99 us", "max us")
+	for _, op := range strings.Split(*opsFlag, ",") {
+		if !t.supports(op) {
+			fmt.Printf("%-10s not served by %s\n", op, *targetName)
+			continue
+		}
+		res := run(t, op)
+		fmt.Printf("%-10s %8d %8d %12.1f %10.0f %10.0f %10.0f %10.0f\n", res.Op, res.Requests, res.Errors,
+			res.OpsPerSec, res.P50Us, res.P90Us, res.P99Us, res.MaxUs)
+
+		line, _ := json.Marshal(res)
+		out.Write(append(line, '\n'))
+	}
+}
@@ -0,0 +1,62 @@
+#!/usr/bin/bash
+
+#Build profiles of the blst library, sourced by the build scripts
+#blst_profile <name> sets:
+#  blst_target: board (linked in cli and secure_module, see cli/blst.cmake) or host (emulators and bench)
+#  blst_cc: compiler of blst and of the emulators, empty for the default one
+#  blst_flags: arguments of blst/build.sh, appended to its default flags (-O -fno-builtin -fPIC -Wall -Wextra -Werror)
+#Field arithmetic is most of the cost of a signature, and these flags decide how it's compiled:
+#  m33: the original build, cortex-m33 with its DSP extension, which gives the UMAAL and SMLAL multiply-accumulates
+#  m33-speed, m33-size: the same at -O2 and at -Os, speed against secure flash
+#  m33-nodsp: without the DSP extension, the baseline to measure it against
+#  host: what blst/build.sh picks by itself, the ADX assembly if the CPU that builds it has ADX
+#  x86_64-adx: always the ADX (mulx, adcx, adox) assembly, for a host that has it but isn't detected (containers, cross builds)
+#  x86_64-portable: both the ADX and the plain assembly, chosen when the library starts
+#  aarch64: the armv8 assembly, cross compiled with $AARCH64_CC (aarch64-linux-gnu-gcc) unless the host is aarch64
+
+blst_profiles="m33 m33-speed m33-size m33-nodsp host x86_64-adx x86_64-portable aarch64"
+
+blst_profile(){
+  blst_cc=""
+  blst_flags=""
+  case $1 in
+    m33) blst_target=board
+    blst_flags="-mcpu=cortex-m33 flavour=elf -fno-pie"
+    ;;
+    m33-speed) blst_target=board
+    blst_flags="-O2 -mcpu=cortex-m33 flavour=elf -fno-pie"
+    ;;
+    m33-size) blst_target=board
+    blst_flags="-Os -mcpu=cortex-m33 flavour=elf -fno-pie"
+    ;;
+    m33-nodsp) blst_target=board
+    blst_flags="-mcpu=cortex-m33+nodsp flavour=elf -fno-pie"
+    ;;
+    host) blst_target=host
+    ;;
+    x86_64-adx) blst_target=host
+    blst_flags="-D__ADX__"
+    ;;
+    x86_64-portable) blst_target=host
+    blst_flags="-D__BLST_PORTABLE__"
+    ;;
+    aarch64) blst_target=host
+    if [ `uname -m` != "aarch64" ]; then
+      blst_cc=${AARCH64_CC:-aarch64-linux-gnu-gcc}
+    fi
+    ;;
+    *) echo "Unknown blst profile $1, the profiles are: $blst_profiles"
+    return 1
+    ;;
+  esac
+  return 0
+}
+
+#Builds ./libblst.a with the profile selected by blst_profile
+blst_build(){
+  if [ -n "$blst_cc" ]; then
+    ./blst/build.sh CC=$blst_cc $blst_flags
+  else
+    ./blst/build.sh $blst_flags
+  fi
+}
@@ -1,20 +1,28 @@
 #!/usr/bin/bash
 
 usage(){
-  echo "Usage: $0 -c \"compiler path\" -b \"board identifier\"
+  echo "Usage: $0 -c \"compiler path\" -b \"board identifier\" [-p profile] [-f config]
   -c \"compiler path\": define path of the arm compiler (arm-none-eabi-gcc file)
-  -b: \"board identifier\""
+  -b: \"board identifier\"
+  -p profile: blst profile linked, built before by build_blst.sh (m33 by default)
+  -f config: Kconfig file of cli used instead of prj.conf, prj_prod.conf for the production build"
   exit 1;
 }
 
 bls=`pwd`
+profile=m33
+conf=prj.conf
 
-while getopts ":c::b:" opt; do
+while getopts ":c::b::p::f:" opt; do
   case $opt in
     c) comp="$OPTARG"
     ;;
     b) board="$OPTARG"
     ;;
+    p) profile="$OPTARG"
+    ;;
+    f) conf="$OPTARG"
+    ;;
   esac
 done
 
@@ -28,4 +36,5 @@ echo "export GNUARMEMB_TOOLCHAIN_PATH=${comp%bin*}" >> ~/.zephyrrc
 source ~/ncs/zephyr/zephyr-env.sh
 
 cd $bls/cli
-west build -p -b $board
\ No newline at end of file
+#spm_ passes the profile to the SPM child image, which links blst too
+west build -p -b $board -- -DBLST_PROFILE=$profile -Dspm_BLST_PROFILE=$profile -DCONF_FILE=$conf
@@ -0,0 +1,41 @@
+#!/usr/bin/bash
+
+#Usage: ./build_bench.sh [-p profile] [-n requests], where profile is one of the host profiles of blst_profile.sh (host by default)
+source ./blst_profile.sh
+
+profile=host
+requests=200
+while getopts ":p:n:" opt; do
+  case $opt in
+    p) profile="$OPTARG"
+    ;;
+    n) requests="$OPTARG"
+    ;;
+  esac
+done
+
+blst_profile $profile || exit 1
+if [ $blst_target != "host" ]; then
+  echo "$profile is a board profile, use it with build_blst.sh"
+  exit 1
+fi
+cc=${blst_cc:-gcc}
+
+git submodule init
+git submodule update
+blst_build || exit 1
+cp blst/bindings/blst.h blst/bindings/blst_aux.h cli/include/
+mkdir -p bench/lib
+mkdir -p bench/build
+mv libblst.a bench/lib/
+$cc -O2 bench/inproc.c bench/lib/libblst.a -lpthread -o bench/build/inproc -Wno-implicit-function-declaration || exit 1
+
+#Benchmark report of the profile, -n 0 skips it
+if [ $requests -gt 0 ]; then
+  mkdir -p bench/reports
+  rm -f bench/reports/$profile.jsonl
+  ./bench/build/inproc -n $requests -l $profile -o bench/reports/$profile.jsonl | tee bench/reports/$profile.txt
+  if [ ${PIPESTATUS[0]} -ne 0 ]; then
+    echo "bench/build/inproc couldn't run on this host, copy it to a $profile machine to get the report"
+  fi
+fi
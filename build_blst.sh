@@ -1,15 +1,22 @@
 #!/usr/bin/bash
 
 usage(){
-  echo "Usage: $0 -c \"compiler path\"
-  -c \"compiler path\": define path of the arm compiler (arm-none-eabi-gcc file)"
+  echo "Usage: $0 -c \"compiler path\" [-p profile]
+  -c \"compiler path\": define path of the arm compiler (arm-none-eabi-gcc file)
+  -p profile: build profile of the library (m33, m33-speed, m33-size or m33-nodsp, see blst_profile.sh), m33 by default"
   exit 1;
 }
 
-while getopts ":c:" opt; do
+source ./blst_profile.sh
+
+profile=m33
+
+while getopts ":c:p:" opt; do
   case $opt in
     c) comp="$OPTARG"
     ;;
+    p) profile="$OPTARG"
+    ;;
   esac
 done
 
@@ -17,23 +24,41 @@ if [ -z $comp ]; then
 	usage
 fi
 
+blst_profile $profile || exit 1
+if [ $blst_target != "board" ]; then
+  echo "$profile is a host profile, use it with build_emu.sh, build_cli-socket.sh or build_bench.sh"
+  exit 1
+fi
+blst_cc=$comp
+
 #Use working version of blst module
 cd ./blst
 git checkout master
 cd ..
 
-./blst/build.sh CC=$comp -mcpu=cortex-m33 flavour=elf -fno-pie
+blst_build
 ret=$?
 
 if [ $ret -eq 0 ]; then
-  echo "Blst library built"
+  echo "Blst library built ($profile)"
+  #Every profile keeps its own library, cli/blst.cmake links the one selected by BLST_PROFILE
   sudo rm -f ./cli/include/blst.h
   sudo rm -f ./cli/include/blst_aux.h
-  sudo rm -f ./cli/lib/libblst.a
-  sudo mkdir -p ./cli/lib
-  sudo mv ./libblst.a ./cli/lib/
+  sudo rm -f ./cli/lib/$profile/libblst.a
+  sudo mkdir -p ./cli/lib/$profile
+  sudo mv ./libblst.a ./cli/lib/$profile/
   sudo mkdir -p ./cli/include
   sudo cp ./blst/bindings/blst.h ./blst/bindings/blst_aux.h ./cli/include/
+
+  #Code size report of the profile, its speed is measured on the board with bench/main.go
+  mkdir -p ./bench/reports
+  {
+    echo "profile: $profile"
+    echo "flags: $blst_flags"
+    ${comp%gcc}size -t ./cli/lib/$profile/libblst.a | sed -n '1p;$p'
+  } > ./bench/reports/$profile.txt
+  cat ./bench/reports/$profile.txt
 else
   echo "Error building blst library"
-fi
\ No newline at end of file
+  exit 1
+fi
@@ -1,9 +1,29 @@
+#!/usr/bin/bash
+
+#Usage: ./build_cli-socket.sh [-p profile], where profile is one of the host profiles of blst_profile.sh (host by default)
+source ./blst_profile.sh
+
+profile=host
+while getopts ":p:" opt; do
+  case $opt in
+    p) profile="$OPTARG"
+    ;;
+  esac
+done
+
+blst_profile $profile || exit 1
+if [ $blst_target != "host" ]; then
+  echo "$profile is a board profile, use it with build_blst.sh"
+  exit 1
+fi
+cc=${blst_cc:-gcc}
+
 git submodule init
 git submodule update
-blst/build.sh
+blst_build || exit 1
 cp blst/bindings/blst.h blst/bindings/blst_aux.h cli/include/
-mkdir cli-socket/lib
-mkdir cli-socket/build
+mkdir -p cli-socket/lib
+mkdir -p cli-socket/build
 mv libblst.a cli-socket/lib/
-gcc cli-socket/main.c cli-socket/lib/libblst.a -o cli-socket/build/server -Wno-implicit-function-declaration
-gcc cli-socket/client.c -o cli-socket/build/client -Wno-implicit-function-declaration
+$cc cli-socket/main.c cli-socket/lib/libblst.a -lpthread -o cli-socket/build/server -Wno-implicit-function-declaration
+$cc cli-socket/client.c -o cli-socket/build/client -Wno-implicit-function-declaration
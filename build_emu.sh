@@ -1,10 +1,30 @@
+#!/usr/bin/bash
+
+#Usage: ./build_emu.sh [-p profile], where profile is one of the host profiles of blst_profile.sh (host by default)
+source ./blst_profile.sh
+
+profile=host
+while getopts ":p:" opt; do
+  case $opt in
+    p) profile="$OPTARG"
+    ;;
+  esac
+done
+
+blst_profile $profile || exit 1
+if [ $blst_target != "host" ]; then
+  echo "$profile is a board profile, use it with build_blst.sh"
+  exit 1
+fi
+cc=${blst_cc:-gcc}
+
 git submodule init
 git submodule update
-blst/build.sh
+blst_build || exit 1
 cp blst/bindings/blst.h blst/bindings/blst_aux.h cli/include/
-mkdir remote-c/lib
-mkdir remote-c/build
+mkdir -p remote-c/lib
+mkdir -p remote-c/build
 mv libblst.a remote-c/lib/
 #gcc json.c
-gcc remote-c/main.c remote-c/picohttpparser.c remote-c/cJSON.c remote-c/lib/libblst.a -o remote-c/build/server -Wno-implicit-function-declaration
-gcc remote-c/client.c -o remote-c/build/client -Wno-implicit-function-declaration
+$cc remote-c/main.c remote-c/picohttpparser.c remote-c/lib/libblst.a -lpthread -o remote-c/build/server -Wno-implicit-function-declaration
+$cc remote-c/client.c -o remote-c/build/client -Wno-implicit-function-declaration
@@ -16,74 +16,220 @@
 
 #include "../blst/bindings/blst.h"
 #include "../cli/include/common.h"
+#include "../cli/include/frame.h"
+#include "../cli/include/arena.h"
 
 #include "../secure_module/zephyr/spm/src/main.c"
 
 #define MAX 1024
+#define MAXCommand 65536 //signbatch lines and frames carry many public key and message pairs
 #define PORT 8080
 #define SA struct sockaddr
 
-void func(int sockfd)
+/*
+    Returns the size of the command at the start of buff once it has been received completely, 0 otherwise
+    Frames are complete once their payload has arrived and text commands once their \n has
+    Returns -1 for frames that don't fit in MAXCommand bytes
+*/
+ssize_t commandSize(char* buff, size_t received)
+{
+    if(received == 0){
+        return 0;
+    }
+    if((uint8_t) buff[0] == FRAME_MAGIC){
+        struct frame_header header;
+        if(received < FRAME_HEADER_SIZE){
+            return 0;
+        }
+        frame_header_parse((uint8_t*) buff, &header);
+        if(header.len > MAXCommand - 1 - FRAME_HEADER_SIZE){
+            return -1;
+        }
+        return (received >= FRAME_HEADER_SIZE + header.len) ? FRAME_HEADER_SIZE + header.len : 0;
+    }
+
+    char* end = memchr(buff, '\n', received);
+    if(end == NULL){
+        return (received == MAXCommand - 1) ? (ssize_t) received : 0;//Too long, it's handled as it is
+    }
+    return end - buff + 1;
+}
+
+/*
+    Answers a binary frame, see frame.h
+    The reply is taken from arena, which the caller resets
+*/
+void frameCommand(int sockfd, char* buff, struct arena* arena)
+{
+    struct frame_header header;
+
+    frame_header_parse((uint8_t*) buff, &header);
+    size_t replySize = frame_response_size(&header);
+    uint8_t* reply = arena_alloc(arena, replySize);
+    if(reply == NULL){
+        return;
+    }
+    size_t replyLen = frame_handle(&header, (uint8_t*) buff + FRAME_HEADER_SIZE, reply, replySize);
+    printf("Frame %u: opcode %u, status %u\n", header.reqid, header.opcode, reply[2]);
+    write(sockfd, reply, replyLen);
+}
+
+/*
+    Answers a text command, the same ones as the cli shell
+    The command, its arguments and the reply are taken from arena, which the caller resets
+    Returns -1 when the client asks to exit
+*/
+int textCommand(int sockfd, char* buff, size_t size, struct arena* arena)
 {
-    char buff[MAX];
-    char* argv[4];
+    char** argv;
     int argc;
-    // infinite loop for chat
-    for (;;) {
-        bzero(buff, MAX);
-   
-        // read the message from client and copy it in buffer
-        read(sockfd, buff, sizeof(buff));
-        // print buffer which contains the client contents
-        printf("%s", buff);
-        // if msg contains "Exit" then server exit and chat ended.
-        if (strncmp("exit", buff, 4) == 0) {
-            printf("Server Exit...\n");
-            break;
+    char* reply;
+
+    char* cmd = arena_strndup(arena, buff, size);
+    if(cmd == NULL){
+        return 0;
+    }
+    // print buffer which contains the client contents
+    printf("%s", cmd);
+    // if msg contains "Exit" then server exit and chat ended.
+    if (strncmp("exit", cmd, 4) == 0) {
+        printf("Server Exit...\n");
+        return -1;
+    }
+
+    char* token;                  //split command into separate strings
+    argv = arena_alloc(arena, (size / 2 + 2) * sizeof(char*));//Tokens are separated by at least one space
+    if(argv == NULL){
+        return 0;
+    }
+    token = strtok(cmd," ");
+    argc = 0;
+    while(token!=NULL){
+        char* c = strchr(token, '\n');
+        if(c != NULL){
+            *c = '\0';
+        }
+        argv[argc] = token;
+        printf("%s\n", token);
+        token = strtok(NULL," ");
+        argc++;
+    }
+    //getkeys answers with every stored key and signbatch with a signature per pair, so the reply grows with both
+    size_t replySize = MAX + ((size_t) get_keystore_size() + argc) * 200;
+    if(argc > 0 && strstr(argv[0], "keygen") != NULL && keygen_count(argc, argv) > 0){
+        replySize += (size_t) keygen_count(argc, argv) * 100;
+    }else if(argc > 1 && strstr(argv[0], "derive") != NULL && derive_count(argc, argv) > 0){
+        replySize += (size_t) derive_count(argc, argv) * 100;
+    }
+    reply = arena_calloc(arena, replySize, 1);
+    if(reply == NULL){
+        return 0;
+    }
+    if(argc == 0){
+        strcat(reply, "Command not found\n");
+    }else if(strstr(argv[0], "keygen") != NULL){
+        keygen(argc, argv, reply);
+    }else if(strstr(argv[0], "signature") != NULL){
+        if(argc != 3){
+            strcat(reply, "Incorrect arguments\n");
+        }else{
+            signature(argc, argv, reply);
+        }
+    }else if(strstr(argv[0], "signbatch") != NULL){
+        signature_batch(argc, argv, reply);
+    }else if(strstr(argv[0], "verifybatch") != NULL){
+        verify_batch(argc, argv, reply);
+    }else if(strstr(argv[0], "verify") != NULL){
+        if(argc != 4){
+            strcat(reply, "Incorrect arguments\n");
+        }else{
+            verify(argc, argv, reply);
+        }
+    }else if(strstr(argv[0], "getkeys") != NULL){
+        get_keys(argc, argv, reply);
+    }else if(strstr(argv[0], "reset") != NULL){
+        resetc(argc, argv, reply);
+    }else if(strstr(argv[0], "import") != NULL){
+        import(argc, argv, reply);
+    }else if(strstr(argv[0], "seed") != NULL){
+        if(argc != 2){
+            strcat(reply, "Incorrect arguments\n");
+        }else{
+            seed(argc, argv, reply);
         }
+    }else if(strstr(argv[0], "derive") != NULL){
+        if(argc != 2 && argc != 3){
+            strcat(reply, "Incorrect arguments\n");
+        }else{
+            derive(argc, argv, reply);
+        }
+    }else if(strstr(argv[0], "delete") != NULL){
+        if(argc != 2){
+            strcat(reply, "Incorrect arguments\n");
+        }else{
+            remove_key(argc, argv, reply);
+        }
+    }else{
+        strcat(reply, "Command not found\n");
+    }
+    printf("%s", reply);
+    write(sockfd, reply, strlen(reply));
+
+    return 0;
+}
 
-        char* token;                  //split command into separate strings
-        char* cmd = strdup(buff);
-        token = strtok(cmd," ");
-        argc = 0;
-        while(token!=NULL){
-            char* c = strchr(token, '\n');
-            if(c != NULL){
-                *c = '\0';
+/*
+    Serves text commands and binary frames, a frame is told apart by its first byte
+*/
+void func(int sockfd)
+{
+    static char buff[MAXCommand];
+    size_t received = 0;//Bytes in buff, several commands may arrive at once
+    //getkeys replies grow with the keystore, so the arena has no limit
+    struct arena arena = {NULL, 0, SIZE_MAX};
+    // infinite loop for chat
+    for (;;) {
+        ssize_t size;
+        for(;;){
+            //The client pads its text commands with zeros, skip the padding left from the previous command
+            size_t skip = 0;
+            while(skip < received && buff[skip] == '\0'){
+                skip++;
             }
-            argv[argc] = token;
-            printf("%s\n", token);
-            token = strtok(NULL," ");
-            argc++;
-        }
-        bzero(buff, MAX);
-        if(strstr(argv[0], "keygen") != NULL){
-            keygen(argc, argv, buff);
-        }else if(strstr(argv[0], "signature") != NULL){
-            if(argc != 3){
-                strcat(buff, "Incorrect arguments\n");
-            }else{
-                signature(argc, argv, buff);
+            memmove(buff, buff + skip, received - skip);
+            received -= skip;
+
+            if((size = commandSize(buff, received)) != 0){
+                break;
             }
-        }else if(strstr(argv[0], "verify") != NULL){
-            if(argc != 4){
-                strcat(buff, "Incorrect arguments\n");
-            }else{
-                verify(argc, argv, buff);
+            // read the message from client and copy it in buffer
+            ssize_t n = read(sockfd, buff + received, sizeof(buff) - 1 - received);
+            if(n <= 0){
+                printf("Client disconnected...\n");
+                arena_free(&arena);
+                return;
             }
-        }else if(strstr(argv[0], "getkeys") != NULL){
-            get_keys(argc, argv, buff);
-        }else if(strstr(argv[0], "reset") != NULL){
-            resetc(argc, argv, buff);
-        }else if(strstr(argv[0], "import") != NULL){
-            import(argc, argv, buff);
+            received += n;
+        }
+        if(size == -1){
+            printf("Frame too long...\n");
+            arena_free(&arena);
+            return;
+        }
+
+        int ret = 0;
+        if((uint8_t) buff[0] == FRAME_MAGIC){
+            frameCommand(sockfd, buff, &arena);
         }else{
-            strcat(buff, "Command not found\n");
+            ret = textCommand(sockfd, buff, size, &arena);
+        }
+        arena_reset(&arena);
+        if(ret == -1){
+            arena_free(&arena);
+            return;
         }
-        char* end = strrchr(buff, '\n');
-        bzero(end+1, MAX-(end-buff));
-        printf("%s", buff);
-        write(sockfd, buff, strlen(buff));
+        memmove(buff, buff + size, received - size);
+        received -= size;
     }
 }
 
@@ -92,6 +238,12 @@ void main(void)
     int sockfd, connfd, len;
     struct sockaddr_in servaddr, cli;
    
+    // keys stored by a previous run, when HSM_KEYSTORE names the keystore file
+    if (keystore_load() == -1) {
+        printf("the keystore file couldn't be loaded...\n");
+        exit(0);
+    }
+
     // socket create and verification
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1) {
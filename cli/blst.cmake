@@ -0,0 +1,18 @@
+# blst library linked by cli and secure_module, built by build_blst.sh
+# BLST_PROFILE selects one of the board profiles of blst_profile.sh, e.g.
+# west build -b <board> -- -DBLST_PROFILE=m33-speed -Dspm_BLST_PROFILE=m33-speed
+# (spm_ passes it to the SPM child image, both must link the same profile)
+set(BLST_PROFILES m33 m33-speed m33-size m33-nodsp)
+set(BLST_PROFILE m33 CACHE STRING "Build profile of the blst library, one of ${BLST_PROFILES}")
+set_property(CACHE BLST_PROFILE PROPERTY STRINGS ${BLST_PROFILES})
+
+get_filename_component(BLST_ROOT ${CMAKE_CURRENT_LIST_DIR}/.. ABSOLUTE)
+set(BLST_LIBRARY ${CMAKE_CURRENT_LIST_DIR}/lib/${BLST_PROFILE}/libblst.a)
+
+if(NOT BLST_PROFILE IN_LIST BLST_PROFILES)
+  message(FATAL_ERROR "Unknown BLST_PROFILE ${BLST_PROFILE}, the profiles are ${BLST_PROFILES}")
+endif()
+if(NOT EXISTS ${BLST_LIBRARY})
+  message(FATAL_ERROR "${BLST_LIBRARY} not found, run ./build_blst.sh -c <compiler> -p ${BLST_PROFILE}")
+endif()
+message(STATUS "blst profile: ${BLST_PROFILE}")
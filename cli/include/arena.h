@@ -0,0 +1,126 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * Scratch memory of the requests of a connection, in the emulators
+ *
+ * Everything a request needs until it's answered (parsed headers, decoded
+ * messages, sign items, the reply of a command) is taken from the arena of
+ * its connection with a pointer bump, and it's all given back at once by
+ * arena_reset after the response. Nothing is freed on its own, so nothing
+ * leaks, and the worker stacks only hold fixed size locals.
+ *
+ * The arena starts empty and takes a new block when a request doesn't fit.
+ * arena_reset merges the blocks of the request into a single one as large as
+ * all of them, so once the connection has seen its largest request it never
+ * allocates again. A request can't take more than the limit of its arena,
+ * ARENA_MAX bytes unless it's set.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 4096 //First block of a connection
+#define ARENA_MAX (1 << 20)
+#define ARENA_ALIGN 16
+
+struct arena_block{
+        struct arena_block* next;       //Previous block, older blocks are smaller
+        size_t size;
+        size_t used;
+        _Alignas(ARENA_ALIGN) uint8_t data[];
+};
+
+struct arena{
+        struct arena_block* head;       //Block allocations are taken from, NULL until the first one
+        size_t total;                   //Bytes in every block
+        size_t limit;                   //Most bytes the blocks can take, ARENA_MAX if 0
+};
+
+//Returns NULL if size doesn't fit in what's left of the limit or memory runs out
+static inline void* arena_alloc(struct arena* arena, size_t size){
+        struct arena_block* block = arena->head;
+        size_t limit = (arena->limit == 0) ? ARENA_MAX : arena->limit;
+
+        if(size > limit){
+            return NULL;
+        }
+        size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+        if(block == NULL || block->size - block->used < size){
+            size_t block_size = (block == NULL) ? ARENA_BLOCK_SIZE : 2*block->size;
+            if(block_size < size){
+                block_size = size;
+            }
+            if(block_size > limit - arena->total){
+                block_size = limit - arena->total;
+                if(size == 0 || size > block_size){
+                    return NULL;
+                }
+            }
+            block = malloc(sizeof(struct arena_block) + block_size);
+            if(block == NULL){
+                return NULL;
+            }
+            block->next = arena->head;
+            block->size = block_size;
+            block->used = 0;
+            arena->head = block;
+            arena->total += block_size;
+        }
+
+        void* p = block->data + block->used;
+        block->used += size;
+        return p;
+}
+
+static inline void* arena_calloc(struct arena* arena, size_t n, size_t size){
+        if(size != 0 && n > SIZE_MAX / size){
+            return NULL;
+        }
+        void* p = arena_alloc(arena, n * size);
+        if(p != NULL){
+            memset(p, 0, n * size);
+        }
+        return p;
+}
+
+//Copies len characters of s and a terminator
+static inline char* arena_strndup(struct arena* arena, const char* s, size_t len){
+        char* copy = arena_alloc(arena, len + 1);
+        if(copy != NULL){
+            memcpy(copy, s, len);
+            copy[len] = '\0';
+        }
+        return copy;
+}
+
+static inline void arena_free(struct arena* arena){
+        while(arena->head != NULL){
+            struct arena_block* next = arena->head->next;
+            free(arena->head);
+            arena->head = next;
+        }
+        arena->total = 0;
+}
+
+//Gives back everything allocated since the last reset
+static inline void arena_reset(struct arena* arena){
+        if(arena->head != NULL && arena->head->next != NULL){
+            size_t total = arena->total;
+            arena_free(arena);
+            struct arena_block* block = malloc(sizeof(struct arena_block) + total);
+            if(block != NULL){
+                block->next = NULL;
+                block->size = total;
+                arena->head = block;
+                arena->total = total;
+            }
+        }
+        if(arena->head != NULL){
+            arena->head->used = 0;
+        }
+}
+
+#endif
@@ -2,117 +2,52 @@
 #define COMMON_H
 
 #include "blst.h"
+#include "hex.h"
+#include "secure_cmd.h"
 #include <stdlib.h>
-
-#ifdef EMU
-
-int char2hex(char c, uint8_t *x)
-{
-	if (c >= '0' && c <= '9') {
-		*x = c - '0';
-	} else if (c >= 'a' && c <= 'f') {
-		*x = c - 'a' + 10;
-	} else if (c >= 'A' && c <= 'F') {
-		*x = c - 'A' + 10;
-	} else {
-		return -22;
-	}
-
-	return 0;
-}
-
-int hex2char(uint8_t x, char *c)
-{
-	if (x <= 9) {
-		*c = x + '0';
-	} else  if (x <= 15) {
-		*c = x - 10 + 'a';
-	} else {
-		return -22;
-	}
-
-	return 0;
-}
-
-size_t bin2hex(const uint8_t *buf, size_t buflen, char *hex, size_t hexlen)
-{
-	if ((hexlen + 1) < buflen * 2) {
-		return 0;
-	}
-
-	for (size_t i = 0; i < buflen; i++) {
-		if (hex2char(buf[i] >> 4, &hex[2 * i]) < 0) {
-			return 0;
-		}
-		if (hex2char(buf[i] & 0xf, &hex[2 * i + 1]) < 0) {
-			return 0;
-		}
-	}
-
-	hex[2 * buflen] = '\0';
-	return 2 * buflen;
-}
-
-size_t hex2bin(const char *hex, size_t hexlen, uint8_t *buf, size_t buflen)
-{
-	uint8_t dec;
-
-	if (buflen < hexlen / 2 + hexlen % 2) {
-		return 0;
-	}
-
-	/* if hexlen is uneven, insert leading zero nibble */
-	if (hexlen % 2) {
-		if (char2hex(hex[0], &dec) < 0) {
-			return 0;
-		}
-		buf[0] = dec;
-		hex++;
-		buf++;
-	}
-
-	/* regular hex conversion */
-	for (size_t i = 0; i < hexlen / 2; i++) {
-		if (char2hex(hex[2 * i], &dec) < 0) {
-			return 0;
-		}
-		buf[i] = dec << 4;
-
-		if (char2hex(hex[2 * i + 1], &dec) < 0) {
-			return 0;
-		}
-		buf[i] += dec;
-	}
-
-	return hexlen / 2 + hexlen % 2;
-}
-
+#include <string.h>
+#include <stdint.h>
+#ifndef EMU
+#include <secure_services.h>
+#else
+#include <pthread.h>
+#include <errno.h>
+#include <sys/random.h>
 #endif
 
-int pk_in_keystore(char * public_key_hex, int offset);
-void ikm_sk(char* info);
-void sk_to_pk(blst_p1* pk);
-void sign_pk(blst_p2* sig, blst_p2* hash);
+//Secure functions. Keys are selected with their public key or with the key handle
+//returned by pk_in_keystore and import_sk, so that several requests can run at once
+//Signatures, key generation and key listing run whole in a single call of
+//secure_dispatch (see secure_cmd.h), the other functions are single steps
+//The secure module derives and caches the public key of every key when it's stored,
+//public keys are read back already encoded with secure_dispatch, get_pk and pk_affine
+int secure_dispatch(struct secure_cmd* cmd);
+int pk_in_keystore(byte* public_key);
+int pk_affine(byte* public_key, blst_p1_affine* pk);
+int get_pk(int key, char* public_key_hex);
 void reset();
-void store_pk(char* public_key_hex);
 int get_keystore_size();
-void getkeys(char* public_keys_hex_store_ns);
 int import_sk(blst_scalar* sk_imp);
+int delete_key(byte* public_key);
+int seed_import(byte* seed, int len);
+int derive_sk(uint32_t index);
+
+//Profiling hooks around the stages of a command, the remote signer and the perf command define them to time each stage
+#ifndef PROFILE_BEGIN
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#endif
 
-void pk_serialize(byte* out, blst_p1 pk){
-        blst_p1_compress(out, &pk);
-}
+#define GETKEYS_PAGE 8 //Public keys copied from the keystore per secure call of the shell
+#define SIGN_BATCH_CHUNK 8 //Messages hashed at once by the secure module before they are signed
+#define KEYGEN_BATCH_CHUNK 16 //Keys generated per request to the RNG
+#define KEYGEN_MAX 10000 //Keys generated by a single keygen command
+#define VERIFY_BATCH_BITS 64 //Size of the random scalars that weight every signature of a batch verification
 
 void sig_serialize(byte* out2, blst_p2 sig){
         blst_p2_compress(out2, &sig);
 }
 
-void get_point_from_msg(blst_p2* hash, uint8_t* msg_bin, int len){
-        char dst[] = "BLS_SIG_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_"; //IETF BLS Signature V4
-        //Obtain the point from a message
-        blst_hash_to_g2(hash, msg_bin, len, dst, sizeof(dst)-1, NULL, 0);
-}
-
 int parse(char* str, int len){
         int offset;
 
@@ -135,55 +70,25 @@ int parse(char* str, int len){
         return offset;
 }
 
-int char_chk(char* aux, int len){
-        int error = 0;
-
-        for(int i = 0; (i < len) && (error == 0); i++){
-            if(!((aux[i] >= '0' && aux[i] <= '9') || (aux[i] >= 'a' && aux[i] <= 'f') || (aux[i] >= 'A' && aux[i] <= 'F'))){
-                error = 1;
-            }
-        }
-
-        return error;
-}
-
+//Keys and signatures are printed as a whole line, not a character at a time
 void print_pk(char* public_key_hex, char* buff){
 #ifdef EMU
-        strcat(buff, "0x");
-		for(int i = 0; i < 96; i++) {
-			char str[2] = {public_key_hex[i], '\0'};
-        	strcat(buff, str);
-		}
-        strcat(buff, "\n");
-#else
-		printf("0x");
-		for(int i = 0; i < 96; i++) {
-			printf("%c", public_key_hex[i]);
-		}
-		printf("\n");
-#endif  
+        sprintf(buff + strlen(buff), "0x%.96s\n", public_key_hex);
+#else
+        printf("0x%.96s\n", public_key_hex);
+#endif
 }
 
 void print_sig(char* sig_hex, char* buff){
 #ifdef EMU
-        
-        strcat(buff, "0x");
-        for(int i = 0; i < 192; i++) {
-          char str[2] = {sig_hex[i], '\0'};
-          strcat(buff, str);
-        }
-        strcat(buff, "\n");
+        sprintf(buff + strlen(buff), "0x%.192s\n", sig_hex);
 #else
-		printf("0x");
-		for(int i = 0; i < 192; i++) {
-          printf("%c", sig_hex[i]);
-        }
-        printf("\n");
+        printf("0x%.192s\n", sig_hex);
 #endif
 }
 
-int pk_parse(char* pk_hex, blst_p1_affine* pk, char* buff){
-        byte pk_bin[48];
+//Decodes a 96 characters hex public key (optionally prefixed by 0x) into its 48 bytes
+int pk_decode(char* pk_hex, byte* pk_bin, char* buff){
         int offset = parse(pk_hex, 96);
         int error = 0;
 
@@ -195,30 +100,31 @@ int pk_parse(char* pk_hex, blst_p1_affine* pk, char* buff){
 #endif
             error = 1;
         }else{
-            if(char_chk(pk_hex + offset, 96)){
+            if(hex_decode(pk_hex + offset, 96, pk_bin)){
 #ifndef EMU
                 printf("Public key contains incorrect characters.\n");
 #else
                 strcat(buff, "Public key contains incorrect characters.\n");
 #endif
                 error = 1;
-            }else{
-                if(hex2bin(pk_hex + offset, 96, pk_bin, 48) == 0) {
-#ifndef EMU
-                    printf("Failed converting public key to binary array\n");
-#else
-                    strcat(buff, "Failed converting public key to binary array\n");
-#endif
-                    error = 1;
-                }else{
-                    blst_p1_uncompress(pk, pk_bin);
-                }
             }
         }
         
         return error;
 }
 
+int pk_parse(char* pk_hex, blst_p1_affine* pk, char* buff){
+        byte pk_bin[48];
+        int error = pk_decode(pk_hex, pk_bin, buff);
+
+        //Stored keys already have their decompressed point cached in the keystore
+        if(!error && pk_affine(pk_bin, pk) == -1){
+            blst_p1_uncompress(pk, pk_bin);
+        }
+
+        return error;
+}
+
 int msg_parse(char* msg, uint8_t* msg_bin, int len, char* buff){
 
         int offset;
@@ -229,25 +135,15 @@ int msg_parse(char* msg, uint8_t* msg_bin, int len, char* buff){
         }
         int error = 0;
 
-        if(char_chk(msg + offset, len)){
+        if(hex_decode(msg + offset, len, msg_bin)){
 #ifndef EMU
             printf("Message contains incorrect characters.\n");
 #else
             strcat(buff, "Message contains incorrect characters.\n");
 #endif
             error = 1;
-        }else{
-            if(hex2bin(msg + offset, len, msg_bin, len/2 + len%2) == 0) {
-#ifndef EMU
-                printf("Failed converting message to binary array\n");
-#else
-                strcat(buff, "Failed converting message to binary array\n");
-#endif
-                error = 1;
-            }
         }
 
-
         return error;
 }
 
@@ -264,7 +160,7 @@ int sig_parse(char* sig_hex, blst_p2_affine* sig, char* buff){
 #endif
             error = 1;
         }else{
-            if(char_chk(sig_hex + offset, 192)){
+            if(hex_decode(sig_hex + offset, 192, sig_bin)){
 #ifndef EMU
                 printf("Signature contains incorrect characters.\n");
 #else
@@ -272,16 +168,7 @@ int sig_parse(char* sig_hex, blst_p2_affine* sig, char* buff){
 #endif
                 error = 1;
             }else{
-                if(hex2bin(sig_hex + offset, 192, sig_bin, 96) == 0) {
-#ifndef EMU
-                    printf("Failed converting signature to binary array\n");
-#else
-                    strcat(buff, "Failed converting signature to binary array\n");
-#endif
-                    error = 1;
-                }else{
-                    blst_p2_uncompress(sig, sig_bin);
-                }
+                blst_p2_uncompress(sig, sig_bin);
             }
         }
         return error;
@@ -297,59 +184,205 @@ int msg_len(char* msg){
     return len;
 }
 
-void keygen(int argc, char** argv, char* buff){
-    int keystore_size = get_keystore_size();
-
-    if(keystore_size < 10){
-        // key_info is an optional parameter.  This parameter MAY be used to derive
-        // multiple independent keys from the same IKM.  By default, key_info is the empty string.
-        char info[] = {
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-    
-        if(argc == 2){
-                if(strlen(argv[1]) <= strlen(info)){
-                        strcpy(info, argv[1]);
-                }else{
-                        strncpy(info, argv[1], sizeof(info));
+//Signs the message of every item with its key, SECURE_CMD_MAX items per secure call
+//Returns 0, or -1 if a key isn't stored and then nothing is signed
+int sign_items(struct secure_sign_item* items, int n){
+        struct secure_cmd cmd = {SECURE_CMD_SIGN};
+
+        if(n > SECURE_CMD_MAX){
+            //Longer batches are looked up first, so that they are still signed all or nothing
+            for(int i = 0; i < n; i++){
+                if(items[i].pk != NULL){
+                    items[i].key = pk_in_keystore((byte*) items[i].pk);
+                    items[i].pk = NULL;
+                }
+                if(items[i].key == -1){
+                    return -1;
+                }
+            }
+        }
+
+        for(int first = 0; first < n; first += SECURE_CMD_MAX){
+            cmd.n = (n - first < SECURE_CMD_MAX) ? n - first : SECURE_CMD_MAX;
+            cmd.sign_args.items = items + first;
+            PROFILE_BEGIN(secure_sign);
+            int ret = secure_dispatch(&cmd);
+            PROFILE_END(secure_sign);
+            if(ret < 0){
+                return -1;
+            }
+        }
+        return 0;
+}
+
+//Fills out with random bytes for the scalars of a batch verification
+//The scalars must be unpredictable, or signatures can be chosen to cancel each other out
+//Returns 0 on success or -1 if the RNG failed
+int batch_random(byte* out, size_t len){
+#ifndef EMU
+        //The secure RNG service hands out 144 bytes per request
+        uint8_t random_number[144];
+        size_t olen;
+
+        while(len > 0){
+            size_t n = (len < sizeof(random_number)) ? len : sizeof(random_number);
+            if(spm_request_random_number(random_number, sizeof(random_number), &olen) != 0 || olen != sizeof(random_number)){
+                memset(random_number, 0, sizeof(random_number));
+                return -1;
+            }
+            memcpy(out, random_number, n);
+            out += n;
+            len -= n;
+        }
+        memset(random_number, 0, sizeof(random_number));
+#else
+        while(len > 0){
+            ssize_t n = getrandom(out, len, 0);
+            if(n < 0){
+                if(errno == EINTR){
+                    continue;
                 }
+                return -1;
+            }
+            out += n;
+            len -= n;
         }
+#endif
+        return 0;
+}
 
-        ikm_sk(info);
-    
-        //The secret key allow us to generate the associated public key
-        blst_p1 pk;
-        byte out[48];
-        char public_key_hex[96];
-        sk_to_pk(&pk);
-        pk_serialize(out, pk);
+//Checks n signatures with a single final exponentiation: sigs[i] of msgs[i] under pks[i]
+//Every signature is weighted with a random scalar so that invalid ones can't cancel each other out
+//Returns 1 if all of them are valid, 0 otherwise or if there are no random scalars
+int verify_aggregate(int n, blst_p1_affine* pks, blst_p2_affine* sigs, uint8_t** msgs, int* lens){
+        char dst[] = "BLS_SIG_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_"; //IETF BLS Signature V4
+        byte scalars[n * VERIFY_BATCH_BITS/8];
+        int valid = 1;
+
+        if(batch_random(scalars, sizeof(scalars)) != 0){
+            return 0;
+        }
+        blst_pairing* ctx = malloc(blst_pairing_sizeof());
+        if(ctx == NULL){
+            return 0;
+        }
+        blst_pairing_init(ctx, true, (byte*) dst, sizeof(dst)-1);
+
+        for(int i = 0; (i < n) && valid; i++){
+            valid = (blst_pairing_mul_n_aggregate_pk_in_g1(ctx, &pks[i], &sigs[i], scalars + i*VERIFY_BATCH_BITS/8,
+                VERIFY_BATCH_BITS, msgs[i], lens[i], NULL, 0) == BLST_SUCCESS);
+        }
+        if(valid){
+            blst_pairing_commit(ctx);
+            valid = blst_pairing_finalverify(ctx, NULL);
+        }
+        free(ctx);
+
+        return valid;
+}
+
+//Number of keys asked by keygen [n] [info]: 0 without n, -1 if n is out of range
+//The first argument is n when it only has digits
+int keygen_count(int argc, char** argv){
+    if(argc < 2 || argv[1][0] == '\0' || strspn(argv[1], "0123456789") != strlen(argv[1])){
+        return 0;
+    }
+    if(strlen(argv[1]) > 5){
+        return -1;
+    }
+    int n = atoi(argv[1]);
+    return (n >= 1 && n <= KEYGEN_MAX) ? n : -1;
+}
+
+//Public key of a new key handle
+void print_new_pk(int key, char* buff){
+    //The public key was derived by the secure module when the key was generated
+    char public_key_hex[97];
+    get_pk(key, public_key_hex);
+    public_key_hex[96] = '\0';
+#ifndef EMU
+    print_pk(public_key_hex, NULL);
+#else
+    print_pk(public_key_hex, buff);
+#endif
+}
+
+void keygen(int argc, char** argv, char* buff){
+    // key_info is an optional parameter.  This parameter MAY be used to derive
+    // multiple independent keys from the same IKM.  By default, key_info is the empty string.
+    char info[] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+    int n = keygen_count(argc, argv);
+    if(n == -1){
 #ifndef EMU
-        printf("Public key: \n");
+        printf("Incorrect number of keys. It must be between 1 and %d.\n", KEYGEN_MAX);
 #else
-        strcat(buff, "Public key: \n");
+        sprintf(buff + strlen(buff), "Incorrect number of keys. It must be between 1 and %d.\n", KEYGEN_MAX);
 #endif
-        if(bin2hex(out, sizeof(out), public_key_hex, sizeof(public_key_hex)) == 0) {
+        return;
+    }
+    int info_arg = (n == 0) ? 1 : 2;
+    if(n == 0){
+        n = 1;
+    }
+    
+    if(argc > info_arg){
+            if(strlen(argv[info_arg]) <= strlen(info)){
+                    strcpy(info, argv[info_arg]);
+            }else{
+                    strncpy(info, argv[info_arg], sizeof(info));
+            }
+    }
+
+    //The secure module generates the keys and writes their public keys, SECURE_CMD_MAX per call
+    char pks_hex[SECURE_CMD_MAX*96];
+    struct secure_cmd cmd = {SECURE_CMD_KEYGEN};
+    cmd.keygen_args.info = info;
+    cmd.keygen_args.out.pks_hex = pks_hex;
+    for(int generated = 0; generated < n;){
+        cmd.n = (n - generated < SECURE_CMD_MAX) ? n - generated : SECURE_CMD_MAX;
+        PROFILE_BEGIN(ikm_sk);
+        int got = secure_dispatch(&cmd);
+        PROFILE_END(ikm_sk);
+        if(got < 0){
+            got = 0;
+        }
+
+        if(generated == 0 && got > 0){
 #ifndef EMU
-            printf("Failed converting binary key to string\n");
+            printf((n == 1) ? "Public key: \n" : "Public keys: \n");
 #else
-            strcat(buff, "Failed converting binary key to string\n");
+            strcat(buff, (n == 1) ? "Public key: \n" : "Public keys: \n");
 #endif
         }
-    
-        store_pk(public_key_hex);
+        for(int i = 0; i < got; i++){
 #ifndef EMU
-        print_pk(public_key_hex, NULL);
+            printf("0x%.96s\n", pks_hex + 96*i);
 #else
-        print_pk(public_key_hex, buff);
+            sprintf(buff + strlen(buff), "0x%.96s\n", pks_hex + 96*i);
 #endif
-    }else{
+        }
+        generated += got;
+        if(got < (int) cmd.n){
 #ifndef EMU
-        printf("Can't generate more keys. Limit reached.\n");
+            if(generated == 0){
+                printf("Can't generate more keys. Limit reached.\n");
+            }else{
+                printf("Can't generate more keys. Limit reached, %d generated.\n", generated);
+            }
 #else
-        strcat(buff, "Can't generate more keys. Limit reached.\n");
+            if(generated == 0){
+                strcat(buff, "Can't generate more keys. Limit reached.\n");
+            }else{
+                sprintf(buff + strlen(buff), "Can't generate more keys. Limit reached, %d generated.\n", generated);
+            }
 #endif
+            break;
+        }
     }
 }
 
@@ -358,56 +391,109 @@ void signature(int argc, char** argv, char* buff){
     //char * msg_hex = "5656565656565656565656565656565656565656565656565656565656565656";
     //char * msg_hex = "b6bb8f3765f93f4f1e7c7348479289c9261399a3c6906685e320071a1a13955c";
 
-    int offset = parse(argv[1], 96);
+    byte pk_bin[48];
 
-    if(offset != -1){
-        if(pk_in_keystore(argv[1], offset) != -1){
-            int len = msg_len(argv[2]);
-            uint8_t msg_bin[len/2 + len%2];
 #ifndef EMU
-            if(msg_parse(argv[2], msg_bin, len, NULL) != 1){
+    if(pk_decode(argv[1], pk_bin, NULL) != 1){
 #else
-            if(msg_parse(argv[2], msg_bin, len, buff) != 1){
+    if(pk_decode(argv[1], pk_bin, buff) != 1){
 #endif
-                blst_p2 hash;
-                get_point_from_msg(&hash, msg_bin, len/2 + len%2);
-
-                blst_p2 sig;
-                byte sig_bin[96];
-                char sig_hex[192];
+        int len = msg_len(argv[2]);
+        uint8_t msg_bin[len/2 + len%2];
+#ifndef EMU
+        if(msg_parse(argv[2], msg_bin, len, NULL) != 1){
+#else
+        if(msg_parse(argv[2], msg_bin, len, buff) != 1){
+#endif
+            //The key is looked up, the message hashed and signed in a single secure call
+            char sig_hex[193];
+            struct secure_sign_item item = {pk_bin, msg_bin, len/2 + len%2, -1, NULL, sig_hex};
 
-                sign_pk(&sig, &hash);
-                sig_serialize(sig_bin, sig);
+            if(sign_items(&item, 1) == 0){
+                sig_hex[192] = '\0';
 #ifndef EMU
                 printf("Signature: \n");
+                print_sig(sig_hex, NULL);
 #else
                 strcat(buff, "Signature: \n");
+                print_sig(sig_hex, buff);
 #endif
-                if(bin2hex(sig_bin, sizeof(sig_bin), sig_hex, sizeof(sig_hex)) == 0) {
+            }else{
 #ifndef EMU
-                    printf("Failed converting binary signature to string\n");
+                printf("Public key isn't stored\n");
 #else
-                    strcat(buff, "Failed converting binary signature to string\n");
+                strcat(buff, "Public key isn't stored\n");
 #endif
-                }
+            }
+        }
+    }
+}
+
+void signature_batch(int argc, char** argv, char* buff){
+    //argv holds "publickey" "message" pairs, every pair is checked before anything is signed
+    if((argc < 3) || ((argc - 1) % 2 != 0)){
 #ifndef EMU
-                print_sig(sig_hex, NULL);
+        printf("Incorrect arguments\n");
 #else
-                print_sig(sig_hex, buff);
+        strcat(buff, "Incorrect arguments\n");
 #endif
-            }
-        }else{
+        return;
+    }
+
+    int n = (argc - 1) / 2;
+    struct secure_sign_item items[n];
+    byte pk_bins[48*n];
+    char sig_hexes[192*n];
+    int total = 0;
+
+    for(int i = 0; i < n; i++){
 #ifndef EMU
-            printf("Public key isn't stored\n");
+        if(pk_decode(argv[1 + 2*i], pk_bins + 48*i, NULL)){
 #else
-            strcat(buff, "Public key isn't stored\n");
+        if(pk_decode(argv[1 + 2*i], pk_bins + 48*i, buff)){
 #endif
+            return;
         }
-    }else{
+        int len = msg_len(argv[2 + 2*i]);
+        items[i] = (struct secure_sign_item) {pk_bins + 48*i, NULL, len/2 + len%2, -1, NULL, sig_hexes + 192*i};
+        total += items[i].len;
+    }
+
+    uint8_t msg_bins[total];
+    total = 0;
+    for(int i = 0; i < n; i++){
+        items[i].msg = msg_bins + total;
 #ifndef EMU
-        printf("Incorrect public key length. It must be 96 characters long\n");
+        if(msg_parse(argv[2 + 2*i], msg_bins + total, msg_len(argv[2 + 2*i]), NULL)){
 #else
-        strcat(buff, "Incorrect public key length. It must be 96 characters long\n");
+        if(msg_parse(argv[2 + 2*i], msg_bins + total, msg_len(argv[2 + 2*i]), buff)){
+#endif
+            return;
+        }
+        total += items[i].len;
+    }
+
+    //Nothing is signed if any key isn't stored
+    if(sign_items(items, n) != 0){
+#ifndef EMU
+        printf("Public key isn't stored\n");
+#else
+        strcat(buff, "Public key isn't stored\n");
+#endif
+        return;
+    }
+
+#ifndef EMU
+    printf("Signatures: \n");
+#else
+    strcat(buff, "Signatures: \n");
+    char* end = buff + strlen(buff);//Appending at the end avoids rescanning buff for every signature
+#endif
+    for(int i = 0; i < n; i++){
+#ifndef EMU
+        printf("0x%.192s\n", sig_hexes + 192*i);
+#else
+        end += sprintf(end, "0x%.192s\n", sig_hexes + 192*i);
 #endif
     }
 }
@@ -421,7 +507,10 @@ void verify(int argc, char** argv, char* buff){
     uint8_t msg_bin[len/2 + len%2];
 #ifndef EMU
     if((pk_parse(argv[1], &pk, NULL) || msg_parse(argv[2], msg_bin, len, NULL) || sig_parse(argv[3], &sig, NULL)) != 1){
-        if(blst_core_verify_pk_in_g1(&pk, &sig, 1, msg_bin, len/2 + len%2, dst, sizeof(dst)-1, NULL, 0) != BLST_SUCCESS){
+        PROFILE_BEGIN(core_verify);
+        BLST_ERROR err = blst_core_verify_pk_in_g1(&pk, &sig, 1, msg_bin, len/2 + len%2, dst, sizeof(dst)-1, NULL, 0);
+        PROFILE_END(core_verify);
+        if(err != BLST_SUCCESS){
             printf("Error\n");
         }
         else {
@@ -430,7 +519,10 @@ void verify(int argc, char** argv, char* buff){
     }
 #else
     if((pk_parse(argv[1], &pk, buff) || msg_parse(argv[2], msg_bin, len, buff) || sig_parse(argv[3], &sig, buff)) != 1){
-        if(blst_core_verify_pk_in_g1(&pk, &sig, 1, msg_bin, len/2 + len%2, dst, sizeof(dst)-1, NULL, 0) != BLST_SUCCESS){
+        PROFILE_BEGIN(core_verify);
+        BLST_ERROR err = blst_core_verify_pk_in_g1(&pk, &sig, 1, msg_bin, len/2 + len%2, dst, sizeof(dst)-1, NULL, 0);
+        PROFILE_END(core_verify);
+        if(err != BLST_SUCCESS){
             strcat(buff, "Error\n");
         }
         else {
@@ -440,54 +532,171 @@ void verify(int argc, char** argv, char* buff){
 #endif
 }
 
+void verify_batch(int argc, char** argv, char* buff){
+    //argv holds "public_key" "message" "signature" triples, every triple is parsed before anything is verified
+    if((argc < 4) || ((argc - 1) % 3 != 0)){
+#ifndef EMU
+        printf("Incorrect arguments\n");
+#else
+        strcat(buff, "Incorrect arguments\n");
+#endif
+        return;
+    }
+
+    int n = (argc - 1) / 3;
+    blst_p1_affine pks[n];
+    blst_p2_affine sigs[n];
+    uint8_t* msgs[n];
+    int lens[n];
+    int total = 0;
+
+    for(int i = 0; i < n; i++){
+        int len = msg_len(argv[2 + 3*i]);
+        lens[i] = len/2 + len%2;
+        total += lens[i];
+    }
+
+    uint8_t msg_bins[total];
+    total = 0;
+    for(int i = 0; i < n; i++){
+        msgs[i] = msg_bins + total;
+        total += lens[i];
+#ifndef EMU
+        if((pk_parse(argv[1 + 3*i], &pks[i], NULL) || msg_parse(argv[2 + 3*i], msgs[i], msg_len(argv[2 + 3*i]), NULL)
+            || sig_parse(argv[3 + 3*i], &sigs[i], NULL)) != 0){
+#else
+        if((pk_parse(argv[1 + 3*i], &pks[i], buff) || msg_parse(argv[2 + 3*i], msgs[i], msg_len(argv[2 + 3*i]), buff)
+            || sig_parse(argv[3 + 3*i], &sigs[i], buff)) != 0){
+#endif
+            return;
+        }
+    }
+
+    //One line per triple. Only when the batch fails every signature is checked on its own to find the wrong ones
+    int all_valid = verify_aggregate(n, pks, sigs, msgs, lens);
+    char dst[] = "BLS_SIG_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_"; //IETF BLS Signature V4
+#ifdef EMU
+    char* end = buff + strlen(buff);
+#endif
+    for(int i = 0; i < n; i++){
+        int valid = all_valid ||
+            (blst_core_verify_pk_in_g1(&pks[i], &sigs[i], 1, msgs[i], lens[i], dst, sizeof(dst)-1, NULL, 0) == BLST_SUCCESS);
+#ifndef EMU
+        printf(valid ? "Success\n" : "Error\n");
+#else
+        end += sprintf(end, valid ? "Success\n" : "Error\n");
+#endif
+    }
+}
+
 void get_keys(int argc, char** argv, char* buff){
-    int keystore_size = get_keystore_size();
-    char public_keys_hex_store[96*keystore_size];
-    getkeys(public_keys_hex_store);
-    if(keystore_size != 0){
-        int j = 0;
-        int cont = keystore_size - 1;
-        int counter = keystore_size;
-#ifndef EMU
-        printf("{\"keys\":[\"");
-        for(int i = 0; i < 96 * cont + 96; i++){
-            printf("%c", public_keys_hex_store[i]);
-            j++;
-            if (j == 96){
-                if(counter > 1) {
-                    printf("\", \n\"");
-                } else {
-                    printf("\"]}\n");
-                }               
-                j = 0;
-                counter--;
-            }           
+    char public_keys[GETKEYS_PAGE*96];
+    int32_t cursor = 0;
+    int nKeys = 0;
+    int n;
+    struct secure_cmd cmd = {SECURE_CMD_GETKEYS, GETKEYS_PAGE};
+    cmd.getkeys_args.cursor = &cursor;
+    cmd.getkeys_args.out.pks_hex = public_keys;
+#ifdef EMU
+    char* end = buff + strlen(buff);//Appending at the end avoids rescanning buff for every key
+#endif
+
+    while((n = secure_dispatch(&cmd)) > 0){
+        for(int i = 0; i < n; i++, nKeys++){
+#ifndef EMU
+            printf((nKeys == 0) ? "{\"keys\":[\"%.96s" : "\", \n\"%.96s", public_keys + 96*i);
+#else
+            end += sprintf(end, (nKeys == 0) ? "{\"keys\":[\"%.96s" : "\", \n\"%.96s", public_keys + 96*i);
+#endif
         }
+    }
+
+#ifndef EMU
+    if(nKeys != 0){
+        printf("\"]}\n");
     }else{
         printf("There are no keys stored\n");
     }
 #else
-        strcat(buff, "{'keys':['");
-        for(int i = 0; i < 96 * cont + 96; i++){
-            char str[2] = {public_keys_hex_store[i], '\0'};
-            strcat(buff, str);
-            j++;
-            if (j == 96){
-                if(counter > 1) {
-                    strcat(buff, "'\n'");
-                } else {
-                    strcat(buff, "']}\n");
-                }               
-                j = 0;
-                counter--;
-            }           
-        }
+    if(nKeys != 0){
+        strcpy(end, "\"]}\n");
     }else{
-        strcat(buff, "There are no keys stored\n");
+        strcpy(end, "There are no keys stored\n");
     }
 #endif
 }
 
+//seed "seed": stores the seed of the EIP-2333 keys, 32 to 64 bytes in hex
+void seed(int argc, char** argv, char* buff){
+    char* hex = argv[1];
+    if(hex[0] == '0' && hex[1] == 'x'){
+        hex += 2;
+    }
+    size_t len = strlen(hex);
+    byte seed_bin[64];
+
+    if(len < 64 || len > 128 || len % 2){
+#ifndef EMU
+        printf("Incorrect seed length. It must be between 32 and 64 bytes.\n");
+#else
+        strcat(buff, "Incorrect seed length. It must be between 32 and 64 bytes.\n");
+#endif
+    }else if(hex_decode(hex, len, seed_bin)){
+#ifndef EMU
+        printf("Incorrect characters\n");
+#else
+        strcat(buff, "Incorrect characters\n");
+#endif
+    }else{
+        seed_import(seed_bin, len/2);
+#ifndef EMU
+        printf("Seed stored\n");
+#else
+        strcat(buff, "Seed stored\n");
+#endif
+    }
+    memset(seed_bin, 0, sizeof(seed_bin));
+}
+
+//Number of keys asked by derive index [n], 1 without n, -1 if n is out of range
+int derive_count(int argc, char** argv){
+    if(argc < 3){
+        return 1;
+    }
+    int n = (strlen(argv[2]) <= 5 && strspn(argv[2], "0123456789") == strlen(argv[2])) ? atoi(argv[2]) : -1;
+    return (n >= 1 && n <= KEYGEN_MAX) ? n : -1;
+}
+
+//derive index [n]: public keys m/12381/3600/i/0/0 of the stored seed, for i from index to index + n - 1
+void derive(int argc, char** argv, char* buff){
+    int n = derive_count(argc, argv);
+    size_t digits = strlen(argv[1]);
+    unsigned long long index = (digits >= 1 && digits <= 10 && strspn(argv[1], "0123456789") == digits) ? strtoull(argv[1], NULL, 10) : UINT64_MAX;
+
+    if(n == -1 || index > UINT32_MAX || (uint32_t) (n - 1) > UINT32_MAX - index){
+#ifndef EMU
+        printf("Incorrect arguments. Usage: derive index [n], n between 1 and %d\n", KEYGEN_MAX);
+#else
+        sprintf(buff + strlen(buff), "Incorrect arguments. Usage: derive index [n], n between 1 and %d\n", KEYGEN_MAX);
+#endif
+        return;
+    }
+
+    for(int i = 0; i < n; i++){
+        int key = derive_sk(index + i);
+        if(key >= 0){
+            print_new_pk(key, buff);
+        }else{
+#ifndef EMU
+            printf((key == -1) ? "There is no seed stored\n" : "Can't store more keys. Limit reached.\n");
+#else
+            strcat(buff, (key == -1) ? "There is no seed stored\n" : "Can't store more keys. Limit reached.\n");
+#endif
+            return;
+        }
+    }
+}
+
 void resetc(int argc, char** argv, char* buff){
     reset();
 #ifndef EMU
@@ -498,71 +707,74 @@ void resetc(int argc, char** argv, char* buff){
 }
 
 void import(int argc, char** argv, char* buff){
-    if(get_keystore_size() < 10){
-        int offset = parse(argv[1], 64);
-
-        if(offset != -1){
-            if(!char_chk(argv[1] + offset, 64)){
-                byte sk_bin[32];
-                if(hex2bin(argv[1] + offset, 64, sk_bin, 32) == 0){
-    #ifndef EMU
-                    printf("Failed converting hex to bin\n");
-    #else
-                    strcat(buff, "Failed converting hex to bin\n");
-    #endif
-                }else{
-                    blst_scalar sk_imp;
-                    blst_scalar_from_bendian(&sk_imp, sk_bin);
-                    if(import_sk(&sk_imp) == 0){
-
-                        blst_p1 pk;
-                        sk_to_pk(&pk);
-                        byte pk_bin[48];
-                        pk_serialize(pk_bin, pk);
-                        char pk_hex[96];
-                        if(bin2hex(pk_bin, 48, pk_hex, 96) == 0){
-    #ifndef EMU
-                            printf("Failed converting bin to hex\n");
-    #else
-                            strcat(buff, "Failed converting bin to hex\n");
-    #endif
-                        }else{
-                            store_pk(pk_hex);
-    #ifndef EMU
-                            print_pk(pk_hex, NULL);
-    #else
-                            print_pk(pk_hex, buff);
-    #endif
-                        }
-                    }else{
-    #ifndef EMU
-                            printf("Key already imported\n");
-    #else
-                            strcat(buff, "Key already imported\n");
-    #endif
-                    }
-                }
+    int offset = parse(argv[1], 64);
+
+    if(offset != -1){
+        byte sk_bin[32];
+        if(!hex_decode(argv[1] + offset, 64, sk_bin)){
+            blst_scalar sk_imp;
+            blst_scalar_from_bendian(&sk_imp, sk_bin);
+            PROFILE_BEGIN(import_sk);
+            int key = import_sk(&sk_imp);
+            PROFILE_END(import_sk);
+            if(key >= 0){
+                char pk_hex[97];
+                get_pk(key, pk_hex);
+                pk_hex[96] = '\0';
+#ifndef EMU
+                print_pk(pk_hex, NULL);
+#else
+                print_pk(pk_hex, buff);
+#endif
+            }else if(key == -2){
+#ifndef EMU
+                    printf("Limit reached\n");
+#else
+                    strcat(buff, "Limit reached\n");
+#endif
             }else{
-    #ifndef EMU
-                printf("Incorrect characters\n");
-    #else
-                strcat(buff, "Incorrect characters\n");
-    #endif
+#ifndef EMU
+                    printf("Key already imported\n");
+#else
+                    strcat(buff, "Key already imported\n");
+#endif
             }
         }else{
-    #ifndef EMU
-            printf("Incorrect secret key length\n");
-    #else
-            strcat(buff, "Incorrect secret key length\n");
-    #endif
+#ifndef EMU
+            printf("Incorrect characters\n");
+#else
+            strcat(buff, "Incorrect characters\n");
+#endif
         }
     }else{
 #ifndef EMU
-            printf("Limit reached\n");
+        printf("Incorrect secret key length\n");
 #else
-            strcat(buff, "Limit reached\n");
+        strcat(buff, "Incorrect secret key length\n");
 #endif
     }
 }
 
+void remove_key(int argc, char** argv, char* buff){
+    byte pk_bin[48];
+
+#ifndef EMU
+    if(pk_decode(argv[1], pk_bin, NULL) != 1){
+        if(delete_key(pk_bin) == 0){
+            printf("Key deleted\n");
+        }else{
+            printf("Public key isn't stored\n");
+        }
+    }
+#else
+    if(pk_decode(argv[1], pk_bin, buff) != 1){
+        if(delete_key(pk_bin) == 0){
+            strcat(buff, "Key deleted\n");
+        }else{
+            strcat(buff, "Public key isn't stored\n");
+        }
+    }
+#endif
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,309 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+/*
+ * Binary frames
+ *
+ * A compact alternative to the text commands: fields travel as raw bytes
+ * (48 bytes public keys, 96 bytes signatures, 32 bytes secret keys) instead
+ * of hex strings, so nothing is parsed or encoded on the way, and every
+ * request carries an id that is echoed in its response.
+ *
+ * Header, FRAME_HEADER_SIZE bytes, integers are little endian:
+ *   magic   1 byte   FRAME_MAGIC, it's never the first byte of a text command
+ *   opcode  1 byte   FRAME_KEYGEN...
+ *   status  1 byte   0 in requests, FRAME_OK... in responses
+ *   flags   1 byte   Reserved, 0
+ *   reqid   4 bytes  Chosen by the client, copied to the response
+ *   len     4 bytes  Length of the payload that follows
+ *
+ * Payloads, request -> response:
+ *   FRAME_KEYGEN      [info, up to 32 bytes]                -> pk
+ *   FRAME_SIGN        pk, msg                               -> sig
+ *   FRAME_SIGN_BATCH  n * (pk, msg length (2 bytes), msg)   -> n * sig
+ *   FRAME_VERIFY      pk, sig, msg                          -> nothing, FRAME_OK or FRAME_INVALID
+ *   FRAME_GETKEYS     nothing                               -> n * pk
+ *   FRAME_IMPORT      sk (big endian)                       -> pk
+ *   FRAME_DELETE      pk                                    -> nothing
+ *   FRAME_RESET       nothing                               -> nothing
+ * Responses with a status other than FRAME_OK have no payload.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+
+#define FRAME_MAGIC 0xB5
+#define FRAME_HEADER_SIZE 12
+
+#define FRAME_PK_SIZE 48
+#define FRAME_SIG_SIZE 96
+#define FRAME_SK_SIZE 32
+
+#define FRAME_KEYGEN 0x01
+#define FRAME_SIGN 0x02
+#define FRAME_SIGN_BATCH 0x03
+#define FRAME_VERIFY 0x04
+#define FRAME_GETKEYS 0x05
+#define FRAME_IMPORT 0x06
+#define FRAME_DELETE 0x07
+#define FRAME_RESET 0x08
+
+#define FRAME_OK 0x00
+#define FRAME_BAD_REQUEST 0x01 //Malformed payload
+#define FRAME_UNKNOWN_OPCODE 0x02
+#define FRAME_UNKNOWN_KEY 0x03 //Public key isn't stored
+#define FRAME_KEYSTORE_FULL 0x04
+#define FRAME_DUPLICATE 0x05 //Key already imported
+#define FRAME_INVALID 0x06 //Signature verification failed
+#define FRAME_OVERRUN 0x07 //Bytes were lost while the board was busy, requests sent until this answer were dropped
+
+#ifndef FRAME_SIGN_BATCH_MAX
+#define FRAME_SIGN_BATCH_MAX 64 //Signatures per FRAME_SIGN_BATCH request
+#endif
+
+struct frame_header{
+        uint8_t opcode;
+        uint8_t status;
+        uint32_t reqid;
+        uint32_t len;
+};
+
+static inline uint32_t frame_get32(const uint8_t* p){
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void frame_put32(uint8_t* p, uint32_t v){
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
+}
+
+//Reads the header from the first FRAME_HEADER_SIZE bytes of buf
+//Returns 0 on success or -1 if they aren't a frame header
+int frame_header_parse(const uint8_t* buf, struct frame_header* header){
+        if(buf[0] != FRAME_MAGIC){
+            return -1;
+        }
+        header->opcode = buf[1];
+        header->status = buf[2];
+        header->reqid = frame_get32(buf + 4);
+        header->len = frame_get32(buf + 8);
+
+        return 0;
+}
+
+void frame_header_write(uint8_t* buf, const struct frame_header* header){
+        buf[0] = FRAME_MAGIC;
+        buf[1] = header->opcode;
+        buf[2] = header->status;
+        buf[3] = 0;
+        frame_put32(buf + 4, header->reqid);
+        frame_put32(buf + 8, header->len);
+}
+
+//Size of the buffer needed by frame_handle to answer the request
+size_t frame_response_size(const struct frame_header* request){
+        switch(request->opcode){
+            case FRAME_GETKEYS:
+                return FRAME_HEADER_SIZE + (size_t) get_keystore_size() * FRAME_PK_SIZE;
+            case FRAME_SIGN_BATCH:
+                return FRAME_HEADER_SIZE + FRAME_SIGN_BATCH_MAX * FRAME_SIG_SIZE;
+            default:
+                return FRAME_HEADER_SIZE + FRAME_SIG_SIZE;
+        }
+}
+
+//Public keys are cached in hex by the keystore
+static void frame_pk_from_hex(uint8_t* pk, const char* pk_hex){
+        hex_decode(pk_hex, 2*FRAME_PK_SIZE, pk);
+}
+
+//Each handler writes its payload in out and returns its status, setting *len to the payload length
+static uint8_t frame_keygen(const uint8_t* payload, uint32_t len, uint8_t* out, uint32_t* out_len){
+        char info[32] = {0};
+
+        if(len > sizeof(info)){
+            return FRAME_BAD_REQUEST;
+        }
+        memcpy(info, payload, len);
+
+        //The secure module writes the new public key straight to out
+        struct secure_cmd cmd = {SECURE_CMD_KEYGEN, 1};
+        cmd.keygen_args.info = info;
+        cmd.keygen_args.out.pks = out;
+        if(secure_dispatch(&cmd) != 1){
+            return FRAME_KEYSTORE_FULL;
+        }
+        *out_len = FRAME_PK_SIZE;
+
+        return FRAME_OK;
+}
+
+static uint8_t frame_sign(const uint8_t* payload, uint32_t len, uint8_t* out, uint32_t* out_len){
+        if(len < FRAME_PK_SIZE){
+            return FRAME_BAD_REQUEST;
+        }
+
+        struct secure_sign_item item = {payload, payload + FRAME_PK_SIZE, len - FRAME_PK_SIZE, -1, out, NULL};
+        if(sign_items(&item, 1) != 0){
+            return FRAME_UNKNOWN_KEY;
+        }
+        *out_len = FRAME_SIG_SIZE;
+
+        return FRAME_OK;
+}
+
+static uint8_t frame_sign_batch(const uint8_t* payload, uint32_t len, uint8_t* out, uint32_t* out_len){
+        struct secure_sign_item items[FRAME_SIGN_BATCH_MAX];
+        int n = 0;
+        uint32_t pos = 0;
+
+        //Every pair is checked before anything is signed, messages are signed in place
+        while(pos < len){
+            if((n == FRAME_SIGN_BATCH_MAX) || (len - pos < FRAME_PK_SIZE + 2)){
+                return FRAME_BAD_REQUEST;
+            }
+            uint32_t msg_len = payload[pos + FRAME_PK_SIZE] | (payload[pos + FRAME_PK_SIZE + 1] << 8);
+            if(len - pos - FRAME_PK_SIZE - 2 < msg_len){
+                return FRAME_BAD_REQUEST;
+            }
+            items[n] = (struct secure_sign_item) {payload + pos, payload + pos + FRAME_PK_SIZE + 2, msg_len, -1, out + n * FRAME_SIG_SIZE, NULL};
+            pos += FRAME_PK_SIZE + 2 + msg_len;
+            n++;
+        }
+        if(n == 0){
+            return FRAME_BAD_REQUEST;
+        }
+
+        //The keys are looked up by the secure module, nothing is signed if one isn't stored
+        if(sign_items(items, n) != 0){
+            return FRAME_UNKNOWN_KEY;
+        }
+        *out_len = n * FRAME_SIG_SIZE;
+
+        return FRAME_OK;
+}
+
+static uint8_t frame_verify(const uint8_t* payload, uint32_t len){
+        char dst[] = "BLS_SIG_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_"; //IETF BLS Signature V4
+        blst_p1_affine pk;
+        blst_p2_affine sig;
+
+        if(len < FRAME_PK_SIZE + FRAME_SIG_SIZE){
+            return FRAME_BAD_REQUEST;
+        }
+        if((pk_affine((byte*) payload, &pk) == -1) && (blst_p1_uncompress(&pk, payload) != BLST_SUCCESS)){
+            return FRAME_BAD_REQUEST;
+        }
+        if(blst_p2_uncompress(&sig, payload + FRAME_PK_SIZE) != BLST_SUCCESS){
+            return FRAME_BAD_REQUEST;
+        }
+
+        const uint8_t* msg = payload + FRAME_PK_SIZE + FRAME_SIG_SIZE;
+        size_t msg_len = len - FRAME_PK_SIZE - FRAME_SIG_SIZE;
+        if(blst_core_verify_pk_in_g1(&pk, &sig, 1, msg, msg_len, (byte*) dst, sizeof(dst)-1, NULL, 0) != BLST_SUCCESS){
+            return FRAME_INVALID;
+        }
+
+        return FRAME_OK;
+}
+
+static uint8_t frame_getkeys(uint8_t* out, size_t out_size, uint32_t* out_len){
+        int32_t cursor = 0;
+        int n;
+        struct secure_cmd cmd = {SECURE_CMD_GETKEYS};
+        cmd.getkeys_args.cursor = &cursor;
+
+        //The secure module copies the keys straight to out, keys stored after out was sized are left out
+        *out_len = 0;
+        while((cmd.n = (out_size - *out_len) / FRAME_PK_SIZE) > 0){
+            if(cmd.n > SECURE_CMD_MAX){
+                cmd.n = SECURE_CMD_MAX;
+            }
+            cmd.getkeys_args.out.pks = out + *out_len;
+            if((n = secure_dispatch(&cmd)) <= 0){
+                break;
+            }
+            *out_len += n * FRAME_PK_SIZE;
+        }
+
+        return FRAME_OK;
+}
+
+static uint8_t frame_import(const uint8_t* payload, uint32_t len, uint8_t* out, uint32_t* out_len){
+        blst_scalar sk_imp;
+        char pk_hex[2*FRAME_PK_SIZE];
+
+        if(len != FRAME_SK_SIZE){
+            return FRAME_BAD_REQUEST;
+        }
+        blst_scalar_from_bendian(&sk_imp, payload);
+
+        int key = import_sk(&sk_imp);
+        memset(&sk_imp, 0, sizeof(sk_imp));
+        if(key == -1){
+            return FRAME_DUPLICATE;
+        }else if(key == -2){
+            return FRAME_KEYSTORE_FULL;
+        }else if(key < 0){
+            return FRAME_BAD_REQUEST;
+        }
+        if(get_pk(key, pk_hex) != 0){
+            return FRAME_BAD_REQUEST;
+        }
+        frame_pk_from_hex(out, pk_hex);
+        *out_len = FRAME_PK_SIZE;
+
+        return FRAME_OK;
+}
+
+//Handles a request and writes its response frame in out, out_size must be at least frame_response_size(request)
+//Returns the size of the response
+size_t frame_handle(const struct frame_header* request, const uint8_t* payload, uint8_t* out, size_t out_size){
+        struct frame_header response = {request->opcode, FRAME_OK, request->reqid, 0};
+        uint8_t* out_payload = out + FRAME_HEADER_SIZE;
+
+        switch(request->opcode){
+            case FRAME_KEYGEN:
+                response.status = frame_keygen(payload, request->len, out_payload, &response.len);
+                break;
+            case FRAME_SIGN:
+                response.status = frame_sign(payload, request->len, out_payload, &response.len);
+                break;
+            case FRAME_SIGN_BATCH:
+                response.status = frame_sign_batch(payload, request->len, out_payload, &response.len);
+                break;
+            case FRAME_VERIFY:
+                response.status = frame_verify(payload, request->len);
+                break;
+            case FRAME_GETKEYS:
+                response.status = frame_getkeys(out_payload, out_size - FRAME_HEADER_SIZE, &response.len);
+                break;
+            case FRAME_IMPORT:
+                response.status = frame_import(payload, request->len, out_payload, &response.len);
+                break;
+            case FRAME_DELETE:
+                if(request->len != FRAME_PK_SIZE){
+                    response.status = FRAME_BAD_REQUEST;
+                }else if(delete_key((byte*) payload) != 0){
+                    response.status = FRAME_UNKNOWN_KEY;
+                }
+                break;
+            case FRAME_RESET:
+                reset();
+                break;
+            default:
+                response.status = FRAME_UNKNOWN_OPCODE;
+        }
+
+        if(response.status != FRAME_OK){
+            response.len = 0;
+        }
+        frame_header_write(out, &response);
+
+        return FRAME_HEADER_SIZE + response.len;
+}
+
+#endif
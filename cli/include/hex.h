@@ -0,0 +1,149 @@
+#ifndef HEX_H
+#define HEX_H
+
+/*
+ * Hex codec for keys, signatures and messages
+ *
+ * hex_decode validates and decodes in a single pass, a character that isn't
+ * hex fails the whole string. Both directions go through lookup tables on
+ * the boards; the emulators decode and encode 16 bytes at a time with SSE2
+ * on x86-64 and NEON on AArch64, and finish with the tables.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(EMU) && defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_SSE2
+#elif defined(EMU) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HEX_NEON
+#endif
+
+//Value of every hex character plus one, 0 for the rest
+static const uint8_t hex_values[256] = {
+        ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+        ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+        ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+        ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#ifdef HEX_SSE2
+//Nibbles of 16 hex characters, *valid is cleared if any of them isn't hex
+static inline __m128i hex_nibbles_sse2(__m128i c, __m128i* valid){
+        __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+        __m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+        __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+        __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+        *valid = _mm_and_si128(*valid, _mm_or_si128(is_digit, is_letter));
+        letter = _mm_add_epi8(letter, _mm_set1_epi8(10));
+        return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, letter));
+}
+
+//Bytes of 8 pairs of nibbles, in the low byte of every 16 bits lane
+static inline __m128i hex_pairs_sse2(__m128i nibbles){
+        __m128i pairs = _mm_or_si128(_mm_slli_epi16(nibbles, 4), _mm_srli_epi16(nibbles, 8));
+        return _mm_and_si128(pairs, _mm_set1_epi16(0x00ff));
+}
+
+static inline __m128i hex_chars_sse2(__m128i nibbles){
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+        return _mm_add_epi8(nibbles, _mm_add_epi8(letter, _mm_set1_epi8('0')));
+}
+#endif
+
+#ifdef HEX_NEON
+static inline uint8x16_t hex_nibbles_neon(uint8x16_t c, uint8x16_t* valid){
+        uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+        uint8x16_t letter = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+        uint8x16_t is_digit = vcleq_u8(digit, vdupq_n_u8(9));
+        uint8x16_t is_letter = vcleq_u8(letter, vdupq_n_u8(5));
+
+        *valid = vandq_u8(*valid, vorrq_u8(is_digit, is_letter));
+        letter = vaddq_u8(letter, vdupq_n_u8(10));
+        return vorrq_u8(vandq_u8(is_digit, digit), vandq_u8(is_letter, letter));
+}
+
+static inline uint8x16_t hex_chars_neon(uint8x16_t nibbles){
+        uint8x16_t letter = vandq_u8(vcgtq_u8(nibbles, vdupq_n_u8(9)), vdupq_n_u8('a' - '0' - 10));
+        return vaddq_u8(nibbles, vaddq_u8(letter, vdupq_n_u8('0')));
+}
+#endif
+
+//Decodes hex_len characters into hex_len/2 + hex_len%2 bytes, an odd length gets a leading zero nibble
+//Returns 0 on success or -1 if hex contains a character that isn't hex
+int hex_decode(const char* hex, size_t hex_len, uint8_t* bin){
+        const uint8_t* in = (const uint8_t*) hex;
+        uint8_t valid = 1;
+
+        if(hex_len % 2){
+            uint8_t low = hex_values[in[0]];
+            valid = (low != 0);
+            *bin++ = (low - 1) & 0x0f;
+            in++;
+            hex_len--;
+        }
+
+#ifdef HEX_SSE2
+        __m128i valid_vec = _mm_set1_epi8(-1);
+        for(; hex_len >= 32; hex_len -= 32, in += 32, bin += 16){
+            __m128i low = hex_pairs_sse2(hex_nibbles_sse2(_mm_loadu_si128((const __m128i*) in), &valid_vec));
+            __m128i high = hex_pairs_sse2(hex_nibbles_sse2(_mm_loadu_si128((const __m128i*) (in + 16)), &valid_vec));
+            _mm_storeu_si128((__m128i*) bin, _mm_packus_epi16(low, high));
+        }
+        if(_mm_movemask_epi8(valid_vec) != 0xffff){
+            return -1;
+        }
+#elif defined(HEX_NEON)
+        uint8x16_t valid_vec = vdupq_n_u8(0xff);
+        for(; hex_len >= 32; hex_len -= 32, in += 32, bin += 16){
+            uint8x16x2_t c = vld2q_u8(in);//Even characters are high nibbles, odd ones low nibbles
+            uint8x16_t high = hex_nibbles_neon(c.val[0], &valid_vec);
+            uint8x16_t low = hex_nibbles_neon(c.val[1], &valid_vec);
+            vst1q_u8(bin, vorrq_u8(vshlq_n_u8(high, 4), low));
+        }
+        if(vminvq_u8(valid_vec) != 0xff){
+            return -1;
+        }
+#endif
+
+        for(size_t i = 0; i < hex_len / 2; i++){
+            uint8_t high = hex_values[in[2*i]];
+            uint8_t low = hex_values[in[2*i + 1]];
+            valid &= (high != 0) & (low != 0);
+            bin[i] = (uint8_t) ((high - 1) & 0x0f) << 4 | ((low - 1) & 0x0f);
+        }
+
+        return valid ? 0 : -1;
+}
+
+//Encodes len bytes into 2*len lowercase characters followed by \0
+void hex_encode(const uint8_t* bin, size_t len, char* hex){
+#ifdef HEX_SSE2
+        for(; len >= 16; len -= 16, bin += 16, hex += 32){
+            __m128i b = _mm_loadu_si128((const __m128i*) bin);
+            __m128i high = _mm_and_si128(_mm_srli_epi16(b, 4), _mm_set1_epi8(0x0f));
+            __m128i low = _mm_and_si128(b, _mm_set1_epi8(0x0f));
+            _mm_storeu_si128((__m128i*) hex, hex_chars_sse2(_mm_unpacklo_epi8(high, low)));
+            _mm_storeu_si128((__m128i*) (hex + 16), hex_chars_sse2(_mm_unpackhi_epi8(high, low)));
+        }
+#elif defined(HEX_NEON)
+        for(; len >= 16; len -= 16, bin += 16, hex += 32){
+            uint8x16_t b = vld1q_u8(bin);
+            uint8x16x2_t c = {{hex_chars_neon(vshrq_n_u8(b, 4)), hex_chars_neon(vandq_u8(b, vdupq_n_u8(0x0f)))}};
+            vst2q_u8((uint8_t*) hex, c);
+        }
+#endif
+
+        for(size_t i = 0; i < len; i++){
+            hex[2*i] = hex_digits[bin[i] >> 4];
+            hex[2*i + 1] = hex_digits[bin[i] & 0x0f];
+        }
+        hex[2*len] = '\0';
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PERF_H
+#define PERF_H
+
+/*
+ * Cycle counts of the shell commands, read from the DWT cycle counter
+ *
+ * Every command is timed as a whole and so are its phases in common.h,
+ * through the PROFILE_BEGIN and PROFILE_END hooks, so this header has to be
+ * included before common.h. Phases that run in the secure module include
+ * the round trip through its NSC veneers, which the perf command measures
+ * on its own as "nsc". A signature is a single secure call, secure_sign,
+ * that looks up the key, hashes the message and signs it. What a command
+ * spends outside its phases is parsing its arguments and printing its output.
+ * A single measure wraps after 2^32 cycles, 67 s at 64 MHz.
+ */
+
+#ifdef CONFIG_PERF
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arch/arm/aarch32/cortex_m/cmsis.h>
+
+enum perf_phase {
+        perf_cmd_keygen,
+        perf_ikm_sk,
+        perf_cmd_signature,
+        perf_secure_sign,
+        perf_cmd_verify,
+        perf_core_verify,
+        perf_cmd_import,
+        perf_import_sk,
+        perf_nsc,
+        PERF_PHASES
+};
+
+//Phases are indented under the command that runs them
+static const char* perf_names[PERF_PHASES] = {
+        "keygen", "  ikm_sk",
+        "signature", "  secure_sign",
+        "verify", "  core_verify",
+        "import", "  import_sk",
+        "nsc",
+};
+
+struct perf_stat {
+        uint32_t count;
+        uint32_t min;
+        uint32_t max;
+        uint64_t total;
+};
+
+static struct perf_stat perf_stats[PERF_PHASES];
+
+#define PERF_NSC_CALLS 16 //Secure calls timed by every perf command
+
+static int perf_enabled;
+
+//Starts the cycle counter, returns 0 on success or -1 if the core has none
+static inline int perf_init(void){
+        if(DWT->CTRL & DWT_CTRL_NOCYCCNT_Msk){
+            return -1;
+        }
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        perf_enabled = 1;
+        return 0;
+}
+
+static inline void perf_record(enum perf_phase phase, uint32_t cycles){
+        struct perf_stat* stat = &perf_stats[phase];
+        if(stat->count == 0 || cycles < stat->min){
+            stat->min = cycles;
+        }
+        if(cycles > stat->max){
+            stat->max = cycles;
+        }
+        stat->total += cycles;
+        stat->count++;
+}
+
+void perf_reset(void){
+        memset(perf_stats, 0, sizeof(perf_stats));
+}
+
+void perf_print(void){
+        printf("%-14s %8s %10s %10s %10s\n", "cycles", "count", "min", "mean", "max");
+        for(int i = 0; i < PERF_PHASES; i++){
+            struct perf_stat* stat = &perf_stats[i];
+            uint32_t mean = stat->count ? (uint32_t) (stat->total / stat->count) : 0;
+            printf("%-14s %8u %10u %10u %10u\n", perf_names[i], (unsigned) stat->count,
+                   (unsigned) stat->min, (unsigned) mean, (unsigned) stat->max);
+        }
+}
+
+//Unsigned subtraction keeps the measure right across a wrap of CYCCNT
+#define PROFILE_BEGIN(stage) uint32_t perf_start_##stage = DWT->CYCCNT
+#define PROFILE_END(stage) perf_record(perf_##stage, DWT->CYCCNT - perf_start_##stage)
+
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef POWER_H
+#define POWER_H
+
+/*
+ * Power modes of the board, chosen at run time with the mode command
+ *
+ *   performance  the CPU stays at its fastest clock
+ *   balanced     the CPU runs at its fastest clock only while a command or a
+ *                frame is served, 128 MHz instead of 64 MHz on the nRF5340
+ *                application core, where hashing to the curve and signing
+ *                take about half the time
+ *   lowpower     balanced, and the console UART is suspended once it has
+ *                gone CONFIG_POWER_IDLE_MS without a command. A GPIO
+ *                interrupt on its RX pin resumes it: the byte that wakes it
+ *                is lost, so a client sends a newline and waits a few
+ *                milliseconds before its first command (remote-go does)
+ *
+ * The CPU sleeps in the idle thread between commands in every mode, and the
+ * UART of the binary frames stays on. The nRF9160 has a single 64 MHz clock,
+ * so only lowpower changes anything there. power_busy and power_idle wrap
+ * every command, which takes the keystore lock first.
+ */
+
+#ifdef CONFIG_POWER_MODE
+
+#include <zephyr.h>
+#include <device.h>
+#include <string.h>
+#include <drivers/gpio.h>
+#include <pm/device.h>
+#include <nrfx_clock.h>
+
+enum power_mode {
+        POWER_PERFORMANCE,
+        POWER_BALANCED,
+        POWER_LOWPOWER,
+        POWER_MODES
+};
+
+static const char* power_names[POWER_MODES] = {"performance", "balanced", "lowpower"};
+
+//Console UART, the shell, and its RX pin, which wakes it
+#define POWER_UART DT_CHOSEN(zephyr_shell_uart)
+#define POWER_RX_PIN DT_PROP(POWER_UART, rx_pin)
+#if POWER_RX_PIN >= 32
+#define POWER_RX_PORT DT_LABEL(DT_NODELABEL(gpio1))
+#else
+#define POWER_RX_PORT DT_LABEL(DT_NODELABEL(gpio0))
+#endif
+
+//Device power management before and after Zephyr 2.7
+#ifdef PM_DEVICE_SUSPEND_STATE
+#define power_uart_set(dev, on) pm_device_state_set(dev, (on) ? PM_DEVICE_ACTIVE_STATE : PM_DEVICE_SUSPEND_STATE, NULL, NULL)
+#else
+#define power_uart_set(dev, on) pm_device_action_run(dev, (on) ? PM_DEVICE_ACTION_RESUME : PM_DEVICE_ACTION_SUSPEND)
+#endif
+
+static enum power_mode power_mode;
+static const struct device* power_uart;
+static const struct device* power_rx_port;
+static struct gpio_callback power_rx_callback;
+static bool power_suspended;
+
+//Taken by a command from power_busy to power_idle and by the work items
+K_MUTEX_DEFINE(power_lock);
+
+static void power_clock(bool fast){
+#if NRF_CLOCK_HAS_HFCLK_DIV
+        nrfx_clock_divider_set(NRF_CLOCK_DOMAIN_HFCLK, fast ? NRF_CLOCK_HFCLK_DIV_1 : NRF_CLOCK_HFCLK_DIV_2);
+        SystemCoreClockUpdate();
+#else
+        ARG_UNUSED(fast);
+#endif
+}
+
+static void power_suspend_handler(struct k_work* work);
+static K_WORK_DELAYABLE_DEFINE(power_suspend_work, power_suspend_handler);
+
+//Called with power_lock held
+static void power_resume_uart(void){
+        if(power_suspended){
+            gpio_pin_interrupt_configure(power_rx_port, POWER_RX_PIN % 32, GPIO_INT_DISABLE);
+            power_uart_set(power_uart, true);
+            power_suspended = false;
+        }
+}
+
+static void power_suspend_handler(struct k_work* work){
+        ARG_UNUSED(work);
+
+        k_mutex_lock(&power_lock, K_FOREVER);
+        //A command may have come while this work waited for the lock, it has rescheduled it
+        if(power_mode == POWER_LOWPOWER && !power_suspended && !k_work_delayable_is_pending(&power_suspend_work)){
+            if(power_uart_set(power_uart, false) == 0){
+                //The line idles high, the start bit of the next byte pulls it low
+                gpio_pin_configure(power_rx_port, POWER_RX_PIN % 32, GPIO_INPUT | GPIO_PULL_UP);
+                gpio_pin_interrupt_configure(power_rx_port, POWER_RX_PIN % 32, GPIO_INT_LEVEL_LOW);
+                power_suspended = true;
+            }
+        }
+        k_mutex_unlock(&power_lock);
+}
+
+static void power_resume_handler(struct k_work* work){
+        ARG_UNUSED(work);
+
+        k_mutex_lock(&power_lock, K_FOREVER);
+        power_resume_uart();
+        if(power_mode == POWER_LOWPOWER){
+            k_work_reschedule(&power_suspend_work, K_MSEC(CONFIG_POWER_IDLE_MS));
+        }
+        k_mutex_unlock(&power_lock);
+}
+
+static K_WORK_DEFINE(power_resume_work, power_resume_handler);
+
+//A level interrupt fires as long as the line is low, so it's disabled until the UART is suspended again
+static void power_rx_handler(const struct device* port, struct gpio_callback* cb, uint32_t pins){
+        ARG_UNUSED(cb);
+        ARG_UNUSED(pins);
+
+        gpio_pin_interrupt_configure(port, POWER_RX_PIN % 32, GPIO_INT_DISABLE);
+        k_work_submit(&power_resume_work);
+}
+
+//Returns 0 on success or -1 if name isn't a mode
+int power_set_mode(const char* name){
+        int mode;
+
+        for(mode = 0; mode < POWER_MODES && strcmp(name, power_names[mode]) != 0; mode++){}
+        if(mode == POWER_MODES){
+            return -1;
+        }
+
+        k_mutex_lock(&power_lock, K_FOREVER);
+        power_mode = mode;
+        power_clock(mode == POWER_PERFORMANCE);
+        if(mode == POWER_LOWPOWER){
+            k_work_reschedule(&power_suspend_work, K_MSEC(CONFIG_POWER_IDLE_MS));
+        }else{
+            k_work_cancel_delayable(&power_suspend_work);
+            power_resume_uart();
+        }
+        k_mutex_unlock(&power_lock);
+
+        return 0;
+}
+
+const char* power_get_mode(void){
+        return power_names[power_mode];
+}
+
+//Starts in CONFIG_POWER_MODE_DEFAULT, returns 0 on success or -1 if the UART can't be woken up
+static inline int power_init(void){
+        power_uart = DEVICE_DT_GET(POWER_UART);
+        power_rx_port = device_get_binding(POWER_RX_PORT);
+        if(power_rx_port == NULL){
+            return -1;
+        }
+        gpio_init_callback(&power_rx_callback, power_rx_handler, BIT(POWER_RX_PIN % 32));
+        if(gpio_add_callback(power_rx_port, &power_rx_callback)){
+            return -1;
+        }
+        if(power_set_mode(CONFIG_POWER_MODE_DEFAULT)){
+            power_set_mode("balanced");
+        }
+        return 0;
+}
+
+//The fast clock while a command is served
+static inline void power_busy(void){
+        k_mutex_lock(&power_lock, K_FOREVER);
+        if(power_mode != POWER_PERFORMANCE){
+            power_clock(true);
+        }
+}
+
+//Back to the slow clock, and to sleep after CONFIG_POWER_IDLE_MS in lowpower
+static inline void power_idle(void){
+        if(power_mode != POWER_PERFORMANCE){
+            power_clock(false);
+        }
+        if(power_mode == POWER_LOWPOWER){
+            k_work_reschedule(&power_suspend_work, K_MSEC(CONFIG_POWER_IDLE_MS));
+        }
+        k_mutex_unlock(&power_lock);
+}
+
+#else
+
+static inline void power_busy(void){
+}
+
+static inline void power_idle(void){
+}
+
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef SECURE_CMD_H
+#define SECURE_CMD_H
+
+/*
+ * Commands of secure_dispatch
+ *
+ * A command descriptor carries a whole operation into the secure module, so
+ * that it crosses the NSC veneers once instead of once per step: the keys are
+ * looked up, the messages hashed, signed and the results serialized in the
+ * secure world, and written straight to the buffers of the caller. Items are
+ * handled in order and every operation takes up to SECURE_CMD_MAX of them.
+ *
+ *   SECURE_CMD_SIGN     sign_args.items[n]: the key of every item is found first,
+ *                       nothing is signed if one isn't stored
+ *   SECURE_CMD_KEYGEN   n new keys from the RNG, derived with keygen_args.info
+ *   SECURE_CMD_GETKEYS  up to n stored keys from *getkeys_args.cursor, which is
+ *                       moved past them, 0 once there are no more keys
+ *
+ * Public keys and signatures are written to whichever of their outputs isn't
+ * NULL: compressed bytes, contiguous, or hex characters without terminator,
+ * every one hex_stride characters after the previous one so that a caller can
+ * leave room for its separators (0 means contiguous).
+ *
+ * secure_dispatch returns the number of items done, -1 if a key isn't stored
+ * (its item has key -1) or -2 if the command is malformed. The board checks
+ * that the descriptor and every buffer it points to are nonsecure memory, as
+ * the single step entries do with their arguments.
+ */
+
+#include <stdint.h>
+
+#define SECURE_CMD_SIGN 1
+#define SECURE_CMD_KEYGEN 2
+#define SECURE_CMD_GETKEYS 3
+
+#define SECURE_CMD_MAX 64 //Items per command
+
+struct secure_sign_item{
+        const uint8_t* pk;      //48 bytes compressed public key, NULL to sign with key
+        const uint8_t* msg;
+        uint32_t len;
+        int32_t key;            //Key handle, set by the secure module when pk is given
+        uint8_t* sig;           //96 bytes compressed signature, or NULL
+        char* sig_hex;          //192 hex characters, or NULL
+};
+
+//Where the public keys of keygen and getkeys are written
+struct secure_pk_out{
+        uint8_t* pks;           //48 bytes each, or NULL
+        char* pks_hex;          //96 hex characters each, or NULL
+        uint32_t hex_stride;    //0, or between 96 and SECURE_CMD_MAX_STRIDE
+};
+
+#define SECURE_CMD_MAX_STRIDE 256
+
+struct secure_cmd{
+        uint32_t op;
+        uint32_t n;
+        union{
+            struct{
+                struct secure_sign_item* items;
+            } sign_args;
+            struct{
+                const char* info;       //32 bytes
+                int32_t* keys;          //Key handles of the new keys, or NULL
+                struct secure_pk_out out;
+            } keygen_args;
+            struct{
+                int32_t* cursor;
+                struct secure_pk_out out;
+            } getkeys_args;
+        };
+};
+
+#endif
@@ -20,39 +20,93 @@
 #endif
 
 #include <blst.h>
+#include <perf.h>
+#include <power.h>
 #include <common.h>
+#include <frame.h>
+#ifdef CONFIG_FRAME_UART
+#include <sys/ring_buffer.h>
+#endif
 
 
 #define CONFIG_SPM_SERVICE_RNG
 
 LOG_MODULE_REGISTER(app);
 
+//The keystore isn't locked in the secure module, so text commands and binary frames take turns
+K_MUTEX_DEFINE(hsm_mutex);
+
+//Every command holds the keystore and, in the power modes of power.h, runs at the fast clock
+static void hsm_lock(void)
+{
+    k_mutex_lock(&hsm_mutex, K_FOREVER);
+    power_busy();
+}
+
+static void hsm_unlock(void)
+{
+    power_idle();
+    k_mutex_unlock(&hsm_mutex);
+}
+
 static int cmd_keygen(const struct shell *shell, size_t argc, char **argv)
 {
+    hsm_lock();
+    PROFILE_BEGIN(cmd_keygen);
     keygen(argc, argv, NULL);
+    PROFILE_END(cmd_keygen);
+    hsm_unlock();
     return 0;
 }
 
 static int cmd_signature_message(const struct shell *shell, size_t argc, char **argv, char* buff)
 {
+    hsm_lock();
+    PROFILE_BEGIN(cmd_signature);
     signature(argc, argv, NULL);
+    PROFILE_END(cmd_signature);
+    hsm_unlock();
+	return 0;
+}
+
+static int cmd_signature_batch(const struct shell *shell, size_t argc, char **argv)
+{
+    hsm_lock();
+    signature_batch(argc, argv, NULL);
+    hsm_unlock();
 	return 0;
 }
 
 static int cmd_signature_verification(const struct shell *shell, size_t argc, char **argv, char* buff)
 {
+    hsm_lock();
+    PROFILE_BEGIN(cmd_verify);
     verify(argc, argv, NULL);
+    PROFILE_END(cmd_verify);
+    hsm_unlock();
+	return 0;
+}
+
+static int cmd_signature_verification_batch(const struct shell *shell, size_t argc, char **argv)
+{
+    hsm_lock();
+    verify_batch(argc, argv, NULL);
+    hsm_unlock();
 	return 0;
 }
 
 static int cmd_get_keys(const struct shell *shell, size_t argc, char **argv, char* buff)
 {
+    hsm_lock();
     get_keys(argc, argv, NULL);
+    hsm_unlock();
 	return 0;
 }
 
 static int cmd_reset(const struct shell *shell, size_t argc, char **argv, char* buff){
+    hsm_lock();
     resetc(argc, argv, NULL);
+    hsm_unlock();
     return 0;
 }
 
@@ -70,16 +124,82 @@ static int cmd_prompt(const struct shell *shell, size_t argc, char **argv){
 }
 
 static int cmd_import(const struct shell *shell, size_t argc, char **argv){
+    hsm_lock();
+    PROFILE_BEGIN(cmd_import);
     import(argc, argv, NULL);
+    PROFILE_END(cmd_import);
+    hsm_unlock();
+    return 0;
+}
+
+static int cmd_delete(const struct shell *shell, size_t argc, char **argv){
+    hsm_lock();
+    remove_key(argc, argv, NULL);
+    hsm_unlock();
+    return 0;
+}
+
+static int cmd_seed(const struct shell *shell, size_t argc, char **argv){
+    hsm_lock();
+    seed(argc, argv, NULL);
+    hsm_unlock();
+    return 0;
+}
+
+static int cmd_derive(const struct shell *shell, size_t argc, char **argv){
+    hsm_lock();
+    derive(argc, argv, NULL);
+    hsm_unlock();
+    return 0;
+}
+
+#ifdef CONFIG_PERF
+static int cmd_perf(const struct shell *shell, size_t argc, char **argv){
+    if(!perf_enabled){
+        printf("No cycle counter on this core\n");
+        return 0;
+    }
+
+    hsm_lock();
+    if(argc == 2 && strcmp(argv[1], "reset") == 0){
+        perf_reset();
+    }else if(argc == 1){
+        //Cost of entering and leaving the secure module, for the secure phases
+        for(int i = 0; i < PERF_NSC_CALLS; i++){
+            PROFILE_BEGIN(nsc);
+            get_keystore_size();
+            PROFILE_END(nsc);
+        }
+        perf_print();
+    }else{
+        printf("Usage: perf [reset]\n");
+    }
+    hsm_unlock();
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_POWER_MODE
+static int cmd_mode(const struct shell *shell, size_t argc, char **argv){
+    if(argc == 1){
+        printf("%s\n", power_get_mode());
+    }else if(power_set_mode(argv[1]) != 0){
+        printf("Usage: mode [performance/balanced/lowpower]\n");
+    }
     return 0;
 }
+#endif
 
-SHELL_CMD_ARG_REGISTER(keygen, NULL, "Generates secret key and public key", cmd_keygen, 1, 1);
+SHELL_CMD_ARG_REGISTER(keygen, NULL, "Generates secret key and public key, or n of them with keygen n", cmd_keygen, 1, 2);
 
 SHELL_CMD_ARG_REGISTER(signature, NULL, "Signs a message with a specific public key", cmd_signature_message, 3, 0);
 
+SHELL_CMD_ARG_REGISTER(signbatch, NULL, "Signs several messages, each one with its public key", cmd_signature_batch, 3, SHELL_OPT_ARG_MAX);
+
 SHELL_CMD_ARG_REGISTER(verify, NULL, "Verifies the signature", cmd_signature_verification, 4, 0);
 
+SHELL_CMD_ARG_REGISTER(verifybatch, NULL, "Verifies several signatures at once", cmd_signature_verification_batch, 4, SHELL_OPT_ARG_MAX);
+
 SHELL_CMD_ARG_REGISTER(getkeys, NULL, "Returns the identifiers of the keys available to the signer", cmd_get_keys, 1, 0);
 
 SHELL_CMD_ARG_REGISTER(reset, NULL, "Deletes all generated keys", cmd_reset, 1, 0);
@@ -88,8 +208,234 @@ SHELL_CMD_ARG_REGISTER(prompt, NULL, "Toggle prompt", cmd_prompt, 2, 0);
 
 SHELL_CMD_ARG_REGISTER(import, NULL, "Import secret key", cmd_import, 2, 0);
 
+SHELL_CMD_ARG_REGISTER(delete, NULL, "Deletes the key of a public key", cmd_delete, 2, 0);
+
+SHELL_CMD_ARG_REGISTER(seed, NULL, "Stores the seed of the EIP-2333 keys", cmd_seed, 2, 0);
+
+SHELL_CMD_ARG_REGISTER(derive, NULL, "Derives the EIP-2334 signing keys of validators from the seed", cmd_derive, 2, 1);
+
+#ifdef CONFIG_POWER_MODE
+SHELL_CMD_ARG_REGISTER(mode, NULL, "Prints or sets the power mode: performance, balanced or lowpower", cmd_mode, 1, 1);
+#endif
+
+#ifdef CONFIG_PERF
+SHELL_CMD_ARG_REGISTER(perf, NULL, "Cycles of keygen, signature, verify and import since the last perf reset", cmd_perf, 1, 1);
+#endif
+
+#ifdef CONFIG_FRAME_UART
+//Binary frames are served on their own UART by a thread, the console UART keeps the text shell.
+//The UART driver only moves the received bytes to a ring buffer, which holds a whole request of
+//the largest size while the previous one is signed
+RING_BUF_DECLARE(frame_rx_ring, FRAME_HEADER_SIZE + CONFIG_FRAME_UART_MAX_PAYLOAD);
+K_SEM_DEFINE(frame_rx_sem, 0, 1);
+//Received bytes that didn't fit in the ring buffer, the frame thread answers FRAME_OVERRUN when it grows
+static atomic_t frame_rx_dropped;
+static const struct device *frame_dev;
+static uint8_t frame_request[FRAME_HEADER_SIZE + CONFIG_FRAME_UART_MAX_PAYLOAD];
+static uint8_t frame_response[FRAME_HEADER_SIZE + FRAME_SIGN_BATCH_MAX * FRAME_SIG_SIZE];
+
+//Called from the UART interrupt
+static void frame_rx_put(const uint8_t *data, size_t len)
+{
+    uint32_t put = ring_buf_put(&frame_rx_ring, data, len);
+    if(put < len){
+        atomic_add(&frame_rx_dropped, len - put);
+    }
+}
+
+#ifdef CONFIG_FRAME_UART_ASYNC
+//EasyDMA receives into one buffer while the other one is copied to the ring buffer
+//and sends frame_response while the next request is read
+#define FRAME_RX_CHUNK 128
+#ifdef SYS_FOREVER_US
+#define FRAME_RX_TIMEOUT 1000 //Microseconds without bytes before the received ones are handed over
+#define FRAME_TX_TIMEOUT SYS_FOREVER_US
+#else
+#define FRAME_RX_TIMEOUT 1 //Milliseconds before Zephyr 2.7
+#define FRAME_TX_TIMEOUT SYS_FOREVER_MS
+#endif
+
+static uint8_t frame_rx_bufs[2][FRAME_RX_CHUNK];
+static uint8_t frame_rx_next;
+K_SEM_DEFINE(frame_tx_sem, 1, 1);//Taken while frame_response is being sent
+
+static void frame_uart_callback(const struct device *dev, struct uart_event *evt, void *user_data)
+{
+    ARG_UNUSED(user_data);
+    switch(evt->type){
+    case UART_RX_RDY:
+        frame_rx_put(evt->data.rx.buf + evt->data.rx.offset, evt->data.rx.len);
+        k_sem_give(&frame_rx_sem);
+        break;
+    case UART_RX_BUF_REQUEST:
+        uart_rx_buf_rsp(dev, frame_rx_bufs[frame_rx_next], FRAME_RX_CHUNK);
+        frame_rx_next ^= 1;
+        break;
+    case UART_RX_DISABLED:
+        //After a line error, reception starts over
+        frame_rx_next = 1;
+        uart_rx_enable(dev, frame_rx_bufs[0], FRAME_RX_CHUNK, FRAME_RX_TIMEOUT);
+        break;
+    case UART_TX_DONE:
+    case UART_TX_ABORTED:
+        k_sem_give(&frame_tx_sem);
+        break;
+    default:
+        break;
+    }
+}
+
+static int frame_uart_init(void)
+{
+    frame_rx_next = 1;
+    if(uart_callback_set(frame_dev, frame_uart_callback, NULL)){
+        return -1;
+    }
+    return uart_rx_enable(frame_dev, frame_rx_bufs[0], FRAME_RX_CHUNK, FRAME_RX_TIMEOUT);
+}
+
+//Waits until frame_response can be written again
+static void frame_tx_wait(void)
+{
+    k_sem_take(&frame_tx_sem, K_FOREVER);
+    k_sem_give(&frame_tx_sem);
+}
+
+//Returns once the transfer has started, frame_tx_wait waits for it to finish
+static void frame_write(const uint8_t *buf, size_t len)
+{
+    k_sem_take(&frame_tx_sem, K_FOREVER);
+    if(uart_tx(frame_dev, buf, len, FRAME_TX_TIMEOUT)){
+        k_sem_give(&frame_tx_sem);
+    }
+}
+#else
+static void frame_uart_isr(const struct device *dev, void *user_data)
+{
+    uint8_t buf[64];
+
+    ARG_UNUSED(user_data);
+    uart_irq_update(dev);
+    while(uart_irq_rx_ready(dev)){
+        int n = uart_fifo_read(dev, buf, sizeof(buf));
+        frame_rx_put(buf, n);
+    }
+    k_sem_give(&frame_rx_sem);
+}
+
+static int frame_uart_init(void)
+{
+    uart_irq_callback_user_data_set(frame_dev, frame_uart_isr, NULL);
+    uart_irq_rx_enable(frame_dev);
+    return 0;
+}
+
+static void frame_tx_wait(void)
+{
+}
+
+static void frame_write(const uint8_t *buf, size_t len)
+{
+    for(size_t i = 0; i < len; i++){
+        uart_poll_out(frame_dev, buf[i]);
+    }
+}
+#endif
+
+//Blocks until len bytes have been received, or only until the first byte is a frame magic when sync is set
+static void frame_read(uint8_t *buf, size_t len, bool sync)
+{
+    size_t got = 0;
+
+    while(got < len){
+        got += ring_buf_get(&frame_rx_ring, buf + got, len - got);
+        if(sync && got == 1 && buf[0] != FRAME_MAGIC){
+            got = 0;//Skip anything between frames
+        }
+        if(got < len){
+            k_sem_take(&frame_rx_sem, K_FOREVER);
+        }
+    }
+}
+
+//Answers a request with a status and no payload
+static void frame_write_status(const struct frame_header *header, uint8_t status)
+{
+    struct frame_header response = {header->opcode, status, header->reqid, 0};
+    frame_tx_wait();
+    frame_header_write(frame_response, &response);
+    frame_write(frame_response, FRAME_HEADER_SIZE);
+}
+
+static void frame_thread(void *p1, void *p2, void *p3)
+{
+    struct frame_header header;
+    atomic_val_t dropped = 0;
+
+    frame_dev = device_get_binding(CONFIG_FRAME_UART_DEV_NAME);
+    if(frame_dev == NULL){
+        return;
+    }
+#if CONFIG_FRAME_UART_BAUDRATE > 0
+    struct uart_config config;
+    if(uart_config_get(frame_dev, &config) == 0){
+        config.baudrate = CONFIG_FRAME_UART_BAUDRATE;
+        uart_configure(frame_dev, &config);
+    }
+#endif
+    if(frame_uart_init()){
+        return;
+    }
+
+    for(;;){
+        frame_read(frame_request, 1, true);
+        frame_read(frame_request + 1, FRAME_HEADER_SIZE - 1, false);
+        frame_header_parse(frame_request, &header);
+
+        if(header.len > CONFIG_FRAME_UART_MAX_PAYLOAD){
+            //The payload is dropped so that the next frame is found
+            for(size_t left = header.len; left > 0;){
+                size_t n = (left < CONFIG_FRAME_UART_MAX_PAYLOAD) ? left : CONFIG_FRAME_UART_MAX_PAYLOAD;
+                frame_read(frame_request + FRAME_HEADER_SIZE, n, false);
+                left -= n;
+            }
+            frame_write_status(&header, FRAME_BAD_REQUEST);
+            continue;
+        }
+        frame_read(frame_request + FRAME_HEADER_SIZE, header.len, false);
+
+        //Bytes were lost since the last request, so this one and those queued behind it are dropped
+        //and the stream starts over at the next magic
+        if(atomic_get(&frame_rx_dropped) != dropped){
+            uint8_t skip[64];
+            while(ring_buf_get(&frame_rx_ring, skip, sizeof(skip)) > 0){
+            }
+            dropped = atomic_get(&frame_rx_dropped);
+            frame_write_status(&header, FRAME_OVERRUN);
+            continue;
+        }
+
+        frame_tx_wait();
+        hsm_lock();
+        size_t len = frame_handle(&header, frame_request + FRAME_HEADER_SIZE, frame_response, sizeof(frame_response));
+        hsm_unlock();
+        frame_write(frame_response, len);
+    }
+}
+
+K_THREAD_DEFINE(frame_tid, CONFIG_FRAME_UART_STACK_SIZE, frame_thread, NULL, NULL, NULL, 7, 0, 0);
+#endif
+
 void main(void)
 {
+#ifdef CONFIG_PERF
+	perf_init();
+#endif
+#ifdef CONFIG_POWER_MODE
+	if (power_init()) {
+		printk("The console UART can't be woken up, power modes disabled\n");
+	}
+#endif
 #if defined(CONFIG_USB_UART_CONSOLE)
 	const struct device *dev;
 	uint32_t dtr = 0;
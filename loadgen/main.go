@@ -0,0 +1,318 @@
+package main
+
+//Load generator that plays the signing duties of a validator client against a remote signer
+//Slots start every -slot and every validator has the duties of the beacon chain:
+//the proposer of the slot signs its block when the slot starts, a 32nd of the validators attest
+//and sign their selection proofs (AGGREGATION_SLOT) a third into the slot, and the aggregators among them
+//sign their AGGREGATE_AND_PROOF two thirds into it. Every duty is fired as a burst at once, as validator
+//clients do, and a signature that arrives after the next duty starts is counted as a missed deadline.
+
+import (
+	"crypto/rand"
+	"encoding/hex"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io/ioutil"
+	"log"
+	"net/http"
+	"os"
+	"regexp"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+)
+
+var (
+	addr        = flag.String("addr", "127.0.0.1:8080", "address of the remote signer, remote-c or remote-go")
+	slotTime    = flag.Duration("slot", 12*time.Second, "duration of a slot, shorter ones compress the traffic")
+	slots       = flag.Int("slots", 32, "slots to play")
+	validators  = flag.Int("validators", 0, "validators simulated, they share the keys of the signer; the number of keys by default")
+	attesters   = flag.Int("attesters", 0, "validators attesting every slot, a 32nd of them by default")
+	aggregators = flag.Float64("aggregators", 0.25, "fraction of the attesters that aggregate")
+	output      = flag.String("o", "", "file the results of every duty are appended to as JSON lines")
+)
+
+const genesisValidatorsRoot = "0x04700007fabc8282644aed6d1c7c9e21d38a03a0c4ba193f3afe428824b3a673"
+
+const forkInfo = `{"fork":{"previous_version":"0x00000001","current_version":"0x00000001","epoch":"0"},` +
+	`"genesis_validators_root":"` + genesisValidatorsRoot + `"}`
+
+//Duties, in the order they happen within a slot
+const (
+	dutyBlock = iota
+	dutyAttestation
+	dutyAggregationSlot
+	dutyAggregateAndProof
+	nDuties
+)
+
+var dutyNames = [nDuties]string{"block", "attestation", "aggregation_slot", "aggregate_and_proof"}
+
+//Start and deadline of every duty, in thirds of a slot
+var dutyStart = [nDuties]int{0, 1, 1, 2}
+var dutyDeadline = [nDuties]int{1, 2, 2, 3}
+
+var keyPattern = regexp.MustCompile(`[0-9a-fA-F]{96}`)
+
+func randomRoot() string {
+	var root [32]byte
+	rand.Read(root[:])
+	return "0x" + hex.EncodeToString(root[:])
+}
+
+//Objects of the same slot are the same for every validator, they get the same roots,
+//as the attestations of a committee do
+type slotData struct {
+	slot        int
+	blockRoot   string
+	parentRoot  string
+	stateRoot   string
+	sourceRoot  string
+	targetRoot  string
+	randao      string
+	attestation string
+}
+
+func newSlotData(slot int) *slotData {
+	d := &slotData{slot: slot, blockRoot: randomRoot(), parentRoot: randomRoot(), stateRoot: randomRoot(),
+		sourceRoot: randomRoot(), targetRoot: randomRoot()}
+	var randao [96]byte
+	rand.Read(randao[:])
+	d.randao = "0x" + hex.EncodeToString(randao[:])
+	epoch := slot / 32
+	sourceEpoch := epoch - 1
+	if sourceEpoch < 0 {
+		sourceEpoch = 0
+	}
+	d.attestation = fmt.Sprintf(`{"slot":"%d","index":"0","beacon_block_root":"%s","source":{"epoch":"%d","root":"%s"},"target":{"epoch":"%d","root":"%s"}}`,
+		slot, d.blockRoot, sourceEpoch, d.sourceRoot, epoch, d.targetRoot)
+	return d
+}
+
+//Web3Signer body of a duty. It carries no signingRoot, both signers derive it from the object,
+//and remote-go and a remote-c with a slashing database refuse one that isn't the derived root
+func (d *slotData) body(duty int, validator int) string {
+	var object string
+	switch duty {
+	case dutyBlock:
+		object = fmt.Sprintf(`{"slot":"%d","proposer_index":"%d","parent_root":"%s","state_root":"%s","body":{"randao_reveal":"%s",`+
+			`"eth1_data":{"deposit_root":"%s","deposit_count":"8","block_hash":"%s"},"graffiti":"0x%064x",`+
+			`"proposer_slashings":[],"attester_slashings":[],"attestations":[],"deposits":[],"voluntary_exits":[]}}`,
+			d.slot, validator, d.parentRoot, d.stateRoot, d.randao, d.stateRoot, d.parentRoot, 0)
+	case dutyAttestation:
+		object = d.attestation
+	case dutyAggregationSlot:
+		object = fmt.Sprintf(`{"slot":"%d"}`, d.slot)
+	case dutyAggregateAndProof:
+		object = fmt.Sprintf(`{"aggregator_index":"%d","aggregate":{"aggregation_bits":"0x01","data":%s,"signature":"%s"},"selection_proof":"%s"}`,
+			validator, d.attestation, d.randao, d.randao)
+	}
+	return fmt.Sprintf(`{"type":"%s","fork_info":%s,"%s":%s}`,
+		strings.ToUpper(dutyNames[duty]), forkInfo, dutyNames[duty], object)
+}
+
+//Results of every duty of a slot, one JSON line each
+type dutyResult struct {
+	Slot     int     `json:"slot"`
+	Duty     string  `json:"duty"`
+	Requests int     `json:"requests"`
+	Errors   int     `json:"errors"`
+	Missed   int     `json:"missed"`
+	P50Ms    float64 `json:"p50_ms"`
+	P99Ms    float64 `json:"p99_ms"`
+	MaxMs    float64 `json:"max_ms"`
+	LastMs   float64 `json:"last_ms"` //Since the start of the slot, when the burst was over
+}
+
+type loadgen struct {
+	client *http.Client
+	base   string
+	keys   []string
+	out    *os.File
+
+	lock      sync.Mutex
+	latencies [nDuties][]time.Duration
+	errors    [nDuties]int
+	missed    [nDuties]int
+}
+
+func (l *loadgen) sign(key string, body string) error {
+	resp, err := l.client.Post(l.base+"/api/v1/eth2/sign/"+key, "application/json", strings.NewReader(body))
+	if err != nil {
+		return err
+	}
+	defer resp.Body.Close()
+	ioutil.ReadAll(resp.Body)
+	if resp.StatusCode != http.StatusOK {
+		return fmt.Errorf("%s", resp.Status)
+	}
+	return nil
+}
+
+//Fires the requests of a duty at once, and waits for all of them
+func (l *loadgen) burst(d *slotData, duty int, vals []int, slotStart time.Time) dutyResult {
+	deadline := slotStart.Add(*slotTime * time.Duration(dutyDeadline[duty]) / 3)
+	res := dutyResult{Slot: d.slot, Duty: dutyNames[duty], Requests: len(vals)}
+	latencies := make([]time.Duration, len(vals))
+	var last time.Time
+	var wg sync.WaitGroup
+	var lock sync.Mutex
+
+	for i, v := range vals {
+		wg.Add(1)
+		go func(i int, v int) {
+			defer wg.Done()
+			begin := time.Now()
+			err := l.sign(l.keys[v%len(l.keys)], d.body(duty, v))
+			end := time.Now()
+			latencies[i] = end.Sub(begin)
+
+			lock.Lock()
+			defer lock.Unlock()
+			if err != nil {
+				if res.Errors == 0 {
+					log.Printf("slot %d %s: %v", d.slot, dutyNames[duty], err)
+				}
+				res.Errors++
+			} else if end.After(deadline) {
+				res.Missed++
+			}
+			if end.After(last) {
+				last = end
+			}
+		}(i, v)
+	}
+	wg.Wait()
+
+	sort.Slice(latencies, func(a, b int) bool { return latencies[a] < latencies[b] })
+	if len(latencies) > 0 {
+		res.P50Ms = ms(latencies[(len(latencies)-1)/2])
+		res.P99Ms = ms(latencies[(len(latencies)-1)*99/100])
+		res.MaxMs = ms(latencies[len(latencies)-1])
+		res.LastMs = ms(last.Sub(slotStart))
+	}
+
+	l.lock.Lock()
+	l.latencies[duty] = append(l.latencies[duty], latencies...)
+	l.errors[duty] += res.Errors
+	l.missed[duty] += res.Missed
+	if l.out != nil {
+		line, _ := json.Marshal(res)
+		l.out.Write(append(line, '\n'))
+	}
+	l.lock.Unlock()
+	return res
+}
+
+func ms(d time.Duration) float64 {
+	return float64(d) / float64(time.Millisecond)
+}
+
+//Plays the duties of a slot, each one when its third of the slot starts
+func (l *loadgen) playSlot(slot int, slotStart time.Time, nValidators int, nAttesters int) {
+	d := newSlotData(slot)
+
+	//Each validator attests once per epoch, the committees of consecutive slots take turns
+	attesting := make([]int, nAttesters)
+	for i := range attesting {
+		attesting[i] = (slot*nAttesters + i) % nValidators
+	}
+	nAggregators := int(float64(nAttesters)**aggregators + 0.5)
+	if nAggregators < 1 {
+		nAggregators = 1
+	}
+	if nAggregators > nAttesters {
+		nAggregators = nAttesters
+	}
+	duties := [nDuties][]int{{slot % nValidators}, attesting, attesting, attesting[:nAggregators]}
+
+	var wg sync.WaitGroup
+	results := make([]dutyResult, nDuties)
+	for duty := 0; duty < nDuties; duty++ {
+		time.Sleep(time.Until(slotStart.Add(*slotTime * time.Duration(dutyStart[duty]) / 3)))
+		wg.Add(1)
+		go func(duty int) {
+			defer wg.Done()
+			results[duty] = l.burst(d, duty, duties[duty], slotStart)
+		}(duty)
+	}
+	wg.Wait()
+
+	for _, res := range results {
+		fmt.Printf("%6d %-20s %8d %6d %6d %10.1f %10.1f %10.1f %10.1f\n", res.Slot, res.Duty, res.Requests, res.Errors,
+			res.Missed, res.P50Ms, res.P99Ms, res.MaxMs, res.LastMs)
+	}
+}
+
+func main() {
+	flag.Parse()
+
+	l := &loadgen{base: "http://" + *addr}
+	resp, err := http.Get(l.base + "/api/v1/eth2/publicKeys")
+	if err != nil {
+		log.Fatal(err)
+	}
+	reply, err := ioutil.ReadAll(resp.Body)
+	resp.Body.Close()
+	if err != nil {
+		log.Fatal(err)
+	}
+	for _, key := range keyPattern.FindAllString(string(reply), -1) {
+		l.keys = append(l.keys, "0x"+strings.ToLower(key))
+	}
+	if len(l.keys) == 0 {
+		log.Fatal("The signer has no keys")
+	}
+
+	nValidators := *validators
+	if nValidators <= 0 {
+		nValidators = len(l.keys)
+	}
+	nAttesters := *attesters
+	if nAttesters <= 0 {
+		nAttesters = (nValidators + 31) / 32
+	}
+	if nAttesters > nValidators {
+		nAttesters = nValidators
+	}
+	l.client = &http.Client{Transport: &http.Transport{MaxIdleConnsPerHost: nAttesters}, Timeout: *slotTime}
+
+	if *output != "" {
+		l.out, err = os.OpenFile(*output, os.O_APPEND|os.O_CREATE|os.O_WRONLY, 0644)
+		if err != nil {
+			log.Fatal(err)
+		}
+		defer l.out.Close()
+	}
+
+	fmt.Printf("%d validators on %d keys, %d attesters per slot, slots of %s\n", nValidators, len(l.keys), nAttesters, *slotTime)
+	fmt.Printf("%6s %-20s %8s %6s %6s %10s %10s %10s %10s\n", "slot", "duty", "requests", "errors", "missed", "p50 ms", "p99 ms", "max ms", "last ms")
+
+	//Slots overlap if one of them takes longer than a slot, as they would on the chain
+	start := time.Now()
+	var wg sync.WaitGroup
+	for slot := 0; slot < *slots; slot++ {
+		slotStart := start.Add(*slotTime * time.Duration(slot))
+		time.Sleep(time.Until(slotStart))
+		wg.Add(1)
+		go func(slot int) {
+			defer wg.Done()
+			l.playSlot(slot, slotStart, nValidators, nAttesters)
+		}(slot)
+	}
+	wg.Wait()
+
+	fmt.Printf("\n%-20s %8s %6s %6s %10s %10s\n", "duty", "requests", "errors", "missed", "p50 ms", "p99 ms")
+	for duty := 0; duty < nDuties; duty++ {
+		latencies := l.latencies[duty]
+		sort.Slice(latencies, func(a, b int) bool { return latencies[a] < latencies[b] })
+		var p50, p99 float64
+		if len(latencies) > 0 {
+			p50 = ms(latencies[(len(latencies)-1)/2])
+			p99 = ms(latencies[(len(latencies)-1)*99/100])
+		}
+		fmt.Printf("%-20s %8d %6d %6d %10.1f %10.1f\n", dutyNames[duty], len(latencies), l.errors[duty], l.missed[duty], p50, p99)
+	}
+}
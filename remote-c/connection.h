@@ -0,0 +1,70 @@
+/*
+    State of a connection of the remote signer
+
+    It lives as long as the connection and is reached from its epoll event,
+    so buffers are allocated once per connection instead of once per request
+*/
+
+#ifndef connection_h
+#define connection_h
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "./httpRemote.h"
+
+struct connection{
+    int fd;
+    struct inputBuffer in;//Requests not answered yet
+    struct outputBuffer out;//Bodies of the responses
+    struct arena arena;//Scratch memory of the request being answered, see arena.h
+};
+
+/*
+    On error returns NULL
+*/
+struct connection* newConnection(int fd){
+    struct connection* conn = calloc(1, sizeof(struct connection));
+    if(conn != NULL){
+        conn->fd = fd;
+    }
+    return conn;
+}
+
+/*
+    Makes room for at least one more byte in the input buffer, which grows up to MAX bytes
+    On success returns 0
+    On error, or if the buffer can't grow further, returns -1
+*/
+int growInput(struct inputBuffer* in){
+    if(in->len + 1 < in->size){
+        return 0;
+    }
+    size_t size = (in->size == 0) ? inputBufferSize : 2*in->size;
+    if(size > MAX){
+        if(in->size >= MAX){
+            return -1;
+        }
+        size = MAX;
+    }
+    char* data = realloc(in->data, size);
+    if(data == NULL){
+        return -1;
+    }
+    in->data = data;
+    in->size = size;
+
+    return 0;
+}
+
+/*
+    Closes the socket and frees the connection
+*/
+void freeConnection(struct connection* conn){
+    close(conn->fd);
+    free(conn->in.data);
+    free(conn->out.data);
+    arena_free(&conn->arena);
+    free(conn);
+}
+
+#endif
@@ -1,7 +1,7 @@
 /*
     A library to handle http requests to the remote signer
 
-    IMPORTANT comment about MAXHeaders and MAXKeys(maximum keystore)
+    IMPORTANT comment about MAXHeaders
 
     Ask about maximum size of an ethereum signature
 */
@@ -10,28 +10,44 @@
 #define httpRemote_h
 
 #include "./picohttpparser.h"
-#include "./cJSON.h"
+#include "./jsonScan.h"
+#include "./metrics.h"
+#include "./slashing.h"
+#include "./scheduler.h"
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include "../cli/include/common.h"
+#include "../cli/include/arena.h"
 
-#define signatureOffset 12//due to  Signature: \n
-
-#define MAXSizeEthereumSignature 205 //MAXSizeEthereumSignature + 12 (due to Signature: \n) + 1 (due to \0)
+#define MAXSizeEthereumSignature 208 //12 (due to Signature: \n) + 2 (due to 0x) + 192 + 1 (due to \n) + 1 (due to \0)
 #define MAX 65535
 #define MAXHeaders 100
-#define MAXKeys 10 //Maximum numbers of keys to store
 #define keySize 96
+#define MAXBatch 256 //Signatures per batch request
+#define signatureBodySize 195 //2 (due to 0x) + 192 + 1 (due to \n)
+#define getKeysEntrySize (keySize + 6) //,\n"0x + key + "
+#define signBatchEntrySize (2*96 + 6) //,\n"0x + signature + "
+#define inputBufferSize 4096 //Initial size of the input buffer of a connection, it grows up to MAX
+#define responseParts 3 //Headers, content-length and body
+#define metricsBufferSize 16384 //Room for the text of every metric
 
 #define sign 0
 #define upcheck 1
 #define getKeys 2
+#define signBatch 3
+#define getMetrics 4
+#define unsupported 5
 
 char upcheckStr[] = "/upcheck";
 char getKeysStr[] = "/api/v1/eth2/publicKeys";
 char signRequestStr[] = "/api/v1/eth2/sign/0x";
+char signBatchRequestStr[] = "/api/v1/eth2/sign/batch";
+char metricsStr[] = "/metrics";
 char contentLengthStr[] = "content-length";
 
 /*
@@ -46,7 +62,10 @@ char upcheckResponse[] = "HTTP/1.1 200 OK\r\n"
    "OK";
 
 /*
-We got to add later the size of the json in text, 2 \n and the json with the publick Keys
+Responses are sent with writev: these headers are sent as they are, followed by
+the value of content-length when it isn't known in advance, and the body
+
+We got to add later the size of the json in text, \r\n\r\n and the json with the publick Keys
 json format: ["0xkey", "0xkey", ....]
 keys are in hex
 */
@@ -57,15 +76,62 @@ char getKeysResponse[] = "HTTP/1.1 200 OK\r\n"
    "content-length: ";
 
 /*
-We got to add later the size of the signature, 2 \n and the signature
-signature format 0xsignature
+We got to add later the size of the json in text, \r\n\r\n and the json with the signatures
+json format: ["0xsignature", "0xsignature", ....]
+signatures are in hex and in the same order as the requested pairs
+*/
+char signBatchResponse[] = "HTTP/1.1 200 OK\r\n"
+   "content-type: applic"
+   "ation/json; charset="
+   "utf-8\r\n"
+   "content-length: ";
+
+/*
+We got to add later the size of the metrics in text, \r\n\r\n and the metrics
+in Prometheus text format, see metrics.h
+*/
+char metricsResponse[] = "HTTP/1.1 200 OK\r\n"
+   "content-type: text/p"
+   "lain; version=0.0.4"
+   "\r\n"
+   "content-length: ";
+
+/*
+We got to add later the signature, its size is always signatureBodySize
+signature format 0xsignature\n
 signature is in hex
 */
 char signResponse[] = "HTTP/1.1 200 OK\r\n"
    "content-type: text/p"
    "lain; charset=utf-8"
    "\r\n"
-   "content-length: ";
+   "content-length: 195"
+   "\r\n\r\n";
+
+/*
+Answers to requests that can't be served, so that pipelined requests still get their answers in order
+*/
+char notFoundResponse[] = "HTTP/1.1 404 Not Found\r\n"
+   "content-length: 0\r\n"
+   "\r\n";
+
+char badRequestResponse[] = "HTTP/1.1 400 Bad Request\r\n"
+   "content-length: 0\r\n"
+   "\r\n";
+
+/*
+Answer of Web3Signer to requests refused by its slashing protection
+*/
+char slashableResponse[] = "HTTP/1.1 412 Precondition Failed\r\n"
+   "content-length: 0\r\n"
+   "\r\n";
+
+/*
+Answer to sign requests refused by the scheduler, because its queue is full or they are past their deadline
+*/
+char unavailableResponse[] = "HTTP/1.1 503 Service Unavailable\r\n"
+   "content-length: 0\r\n"
+   "\r\n";
 
 /*
 ************************************************************************************************************************************
@@ -75,9 +141,37 @@ struct boardRequest{
     int method; //Board
     char* json;
     char* keyToSign;//Size is always of keySize bytes
-    char publicKeys[MAXKeys][keySize];//In hex
-    int nKeys;//number of keys
-    int jsonLen;//In fact we won't need this field because there will be a \0 at the end of the json, but just in case 
+    int key;//Key handle of keyToSign, set by checkKey
+    int jsonLen;//The body isn't \0 terminated, it's followed by the next pipelined request
+    struct arena* arena;//Scratch memory of the connection, reset once the request is answered
+};
+
+/*
+    Requests are read into a buffer owned by the connection. It may hold part of a request,
+    which is completed by the next reads, or several pipelined requests
+*/
+struct inputBuffer{
+    char* data;
+    size_t size;
+    size_t len;//Bytes received and not answered yet
+    size_t lastLen;//Bytes of the first request already scanned by phr_parse_request, 0 if none
+};
+
+/*
+    Bodies are written in a buffer owned by the connection, which is reused by all its responses
+*/
+struct outputBuffer{
+    char* data;
+    size_t size;
+    size_t pending;//Bytes of the last response the socket didn't take, from data + sent
+    size_t sent;
+};
+
+struct httpResponse{
+    struct iovec parts[responseParts];
+    int nParts;
+    size_t len;//Bytes in all the parts
+    char contentLength[24];//Value of content-length and the end of the headers
 };
 
 struct httpRequest{
@@ -94,207 +188,581 @@ struct httpRequest{
 };
 
 /*
-    On success returns 0
-    On error returns -1
+    The body follows the headersLen bytes of the headers
 */
-int copyKeys(struct boardRequest* request){
-    char buffer[MAXKeys * 99 + 12];
-    get_keys(0, NULL, buffer);
-    if((strlen(buffer) == 25) && (strncmp(buffer, "There are no keys stored\n", 25) == 0)){
-        return -1;
-    }else{
-        cJSON* json = cJSON_Parse(buffer);
-        cJSON* keys = json->child;
-
-        request->nKeys = 0;
-        do{
-            ++request->nKeys;
-
-            if(request->nKeys >= MAXKeys){
-                request->nKeys = 0;
-                return -1;
-            }
-            
-            strncpy(request->publicKeys[request->nKeys - 1], keys->valuestring, keySize);
-
-            keys = keys->next;
-        }while(keys != NULL);
-    }
-
-    return 0;
-}
-
-void getBody(char* buffer, size_t bufferSize, struct httpRequest* request){
+void getBody(char* buffer, size_t headersLen, struct httpRequest* request){
     int bodyLengthPosition;//Where is content-length in request->headers
     int contentLengthStrSize = strlen(contentLengthStr);
 
-    //14 is the size of content-length
+    request->body = NULL;
+    request->bodyLen = 0;
+
+    //14 is the size of content-length. Header names are case insensitive
     for(bodyLengthPosition = 0; 
     (bodyLengthPosition < (int) request->numHeaders) && (request->headers[bodyLengthPosition].name != NULL) &&
     !((request->headers[bodyLengthPosition].name_len == contentLengthStrSize) 
-    && (strncmp(contentLengthStr, request->headers[bodyLengthPosition].name, contentLengthStrSize))); 
+    && (strncasecmp(contentLengthStr, request->headers[bodyLengthPosition].name, contentLengthStrSize) == 0)); 
     ++bodyLengthPosition){}
 
     if(bodyLengthPosition < request->numHeaders){
-        char bodyLenChar[(int) request->headers[bodyLengthPosition].value_len + 1];
-        strncpy(bodyLenChar, request->headers[bodyLengthPosition].value, request->headers[bodyLengthPosition].value_len);
-        bodyLenChar[(int) request->headers[bodyLengthPosition].value_len] = '\0';
-
-        request->bodyLen = (size_t) atoi(bodyLenChar);
+        //The value is read where it is, it isn't \0 terminated. Lengths above MAX can't be served anyway
+        const char* value = request->headers[bodyLengthPosition].value;
+        size_t valueLen = request->headers[bodyLengthPosition].value_len;
+        size_t bodyLen = 0;
+        for(size_t i = 0; i < valueLen && value[i] >= '0' && value[i] <= '9' && bodyLen <= MAX; ++i){
+            bodyLen = 10*bodyLen + (value[i] - '0');
+        }
+        request->bodyLen = bodyLen;
 
         if((int) request->bodyLen > 0){
-            request->body = buffer + (int) bufferSize - (int) request->bodyLen;
-            printf("%s", request->body);
+            request->body = buffer + headersLen;
         }else{
             request->body = NULL;
         }
     }
 }
 
+/*
+    Returns the key handle of a public key of keySize hex characters
+    On error, or if the key isn't stored, returns -1
+*/
+int keyHandle(const char* keyHex){
+    byte publicKey[keySize/2];
+
+    //The key is decoded once here and looked up in the keystore index
+    if(hex_decode(keyHex, keySize, publicKey) == -1){
+        return -1;
+    }
+
+    return pk_in_keystore(publicKey);
+}
+
 /*
     On succes returns 0
     On error returns -1
 */
 int checkKey(struct boardRequest* request){
-    if(copyKeys(request) == -1){
-        return -1;
-    }else{
-        for(int i = 0; i < request->nKeys; ++i){
-            if(strncmp(request->keyToSign, request->publicKeys[i], keySize) == 0){ 
-                return 0;
-            }
-        }
-    }
+    request->key = keyHandle(request->keyToSign);
 
-    return -1;
+    return (request->key == -1) ? -1 : 0;
+}
+
+/*
+    Length of the hex string in span, without 0x
+*/
+int hexLen(const struct jsonSpan* span){
+    int prefix = (span->len >= 2) && (span->data[0] == '0') && (span->data[1] == 'x');
+    return span->len - (prefix ? 2 : 0);
 }
 
 /*   
-    On succes returns 0
+    Parses the first request of buffer, which may be followed by the next pipelined requests
+    lastLen must be 0 for a new request. It's updated so that the next call for the same request,
+    once more bytes have arrived, only scans the new ones
+    On succes returns the length of the request, headers and body
+    If the request is incomplete returns -2
     On error returns -1
-    We are only going to support GET and POST requests, so if we get another type of request we are going to handle it like an error.
+    We are only going to support GET and POST requests, any other request is answered as unsupported.
 */
-int parseRequest(char* buffer, size_t bufferSize, struct boardRequest* reply){//boardRequest out, buffer in
-    buffer[bufferSize] = '\0';
-    struct httpRequest request;
+int parseRequest(char* buffer, size_t bufferSize, size_t* lastLen, struct arena* arena, struct boardRequest* reply){//boardRequest out, buffer in
+    //The headers are parsed into the arena, it's reset by the caller once the request is answered or returns -2
+    struct httpRequest* request = arena_alloc(arena, sizeof(struct httpRequest));
+    if(request == NULL){
+        return -1;
+    }
+    request->numHeaders = MAXHeaders;//In: capacity of request->headers, out: number of parsed headers
 
-    request.requestLen = phr_parse_request(buffer, bufferSize, (const char**) &(request.method), &(request.methodLen), 
-    (const char**) &(request.path), &(request.pathLen), &(request.minorVersion), request.headers, &(request.numHeaders), 0);
+    int headersLen = phr_parse_request(buffer, bufferSize, (const char**) &(request->method), &(request->methodLen), 
+    (const char**) &(request->path), &(request->pathLen), &(request->minorVersion), request->headers, &(request->numHeaders), *lastLen);
 
-    if((int) request.requestLen < 0){
+    if(headersLen == -2){
+        *lastLen = bufferSize;
+        return -2;
+    }else if(headersLen < 0){
         return -1;
     }
 
-    getBody(buffer, bufferSize, &request);
+    getBody(buffer, headersLen, request);
+    if(bufferSize < headersLen + request->bodyLen){
+        //The headers are parsed again with the whole body, phr_parse_request only resumes unfinished headers
+        *lastLen = 0;
+        return -2;
+    }
+    *lastLen = 0;
+    reply->arena = arena;
+    request->requestLen = headersLen + request->bodyLen;
+    reply->method = unsupported;
 
-    if((request.methodLen == 3) && (strncmp(request.method, "GET", 3) == 0)){
-        if((request.pathLen == strlen(upcheckStr)) && (strncmp(request.path, upcheckStr, strlen(upcheckStr)) == 0)){
+    if((request->methodLen == 3) && (strncmp(request->method, "GET", 3) == 0)){
+        if((request->pathLen == strlen(upcheckStr)) && (strncmp(request->path, upcheckStr, strlen(upcheckStr)) == 0)){
             reply->method = upcheck;
-        }else if((request.pathLen == strlen(getKeysStr)) && (strncmp(request.path, getKeysStr, strlen(getKeysStr)) == 0)){
+        }else if((request->pathLen == strlen(getKeysStr)) && (strncmp(request->path, getKeysStr, strlen(getKeysStr)) == 0)){
             reply->method = getKeys;
-        }else{
-            return -1;
+        }else if((request->pathLen == strlen(metricsStr)) && (strncmp(request->path, metricsStr, strlen(metricsStr)) == 0)){
+            reply->method = getMetrics;
         }
-    }else if((request.methodLen == 4) && (strncmp(request.method, "POST", 4) == 0)){
-        if((request.pathLen == (strlen(signRequestStr) + keySize)) && (strncmp(request.path, signRequestStr, strlen(signRequestStr)) == 0)){
-            reply->keyToSign = request.path + strlen(signRequestStr);
+    }else if((request->methodLen == 4) && (strncmp(request->method, "POST", 4) == 0)){
+        if((request->pathLen == (strlen(signRequestStr) + keySize)) && (strncmp(request->path, signRequestStr, strlen(signRequestStr)) == 0)){
+            reply->keyToSign = request->path + strlen(signRequestStr);
                         
-            reply->json = request.body;
-            reply->jsonLen = request.bodyLen;
+            reply->json = request->body;
+            reply->jsonLen = request->bodyLen;
 
             reply->method = sign;        
-        }else{
-            return -1;
+        }else if((request->pathLen == strlen(signBatchRequestStr)) && (strncmp(request->path, signBatchRequestStr, strlen(signBatchRequestStr)) == 0)){
+            reply->json = request->body;
+            reply->jsonLen = request->bodyLen;
+
+            reply->method = signBatch;
         }
-    }else{
+    }
+
+    return request->requestLen;
+}
+
+/*
+    Makes room for size bytes in out. The buffer only grows, so most responses don't allocate
+    On success returns 0
+    On error returns -1
+*/
+int reserveOutput(struct outputBuffer* out, size_t size){
+    if(size <= out->size){
+        return 0;
+    }
+    char* data = malloc(size);
+    if(data == NULL){
         return -1;
     }
+    free(out->data);
+    out->data = data;
+    out->size = size;
 
     return 0;
 }
 
+void addPart(struct httpResponse* response, const char* data, size_t len){
+    response->parts[response->nParts].iov_base = (void*) data;
+    response->parts[response->nParts].iov_len = len;
+    response->nParts++;
+    response->len += len;
+}
+
+/*
+    Adds headers ending in "content-length: " and the value for a body of bodyLen bytes
+*/
+void addHeaders(struct httpResponse* response, const char* headers, size_t headersLen, size_t bodyLen){
+    addPart(response, headers, headersLen);
+    int n = snprintf(response->contentLength, sizeof(response->contentLength), "%zu\r\n\r\n", bodyLen);
+    addPart(response, response->contentLength, n);
+}
+
+/*
+    Returns size of response
+*/
+int upcheckResponseStr(struct httpResponse* response){
+    addPart(response, upcheckResponse, sizeof(upcheckResponse) - 1);
+    return response->len;
+}
+
+/*
+    Returns size of response
+*/
+int getKeysResponseStr(struct outputBuffer* out, struct httpResponse* response){
+    int32_t cursor = 0;
+    int n;
+    struct secure_cmd cmd = {SECURE_CMD_GETKEYS};
+    cmd.getkeys_args.cursor = &cursor;
+    cmd.getkeys_args.out.hex_stride = getKeysEntrySize;
+
+    if(reserveOutput(out, (size_t) get_keystore_size() * getKeysEntrySize + 8) == -1){
+        return -1;
+    }
+    char* end = out->data;
+    char* limit = out->data + out->size - 2;
+
+    /*
+        The secure module writes every key right into its entry, ,\n"0x<key>", and
+        the comma of the first one becomes the [ of the array
+    */
+    while((cmd.n = (limit - end) / getKeysEntrySize) > 0){
+        if(cmd.n > SECURE_CMD_MAX){
+            cmd.n = SECURE_CMD_MAX;
+        }
+        cmd.getkeys_args.out.pks_hex = end + 5;
+        if((n = secure_dispatch(&cmd)) <= 0){
+            break;
+        }
+        for(int i = 0; i < n; ++i){
+            memcpy(end, ",\n\"0x", 5);
+            end[getKeysEntrySize - 1] = '"';
+            end += getKeysEntrySize;
+        }
+    }
+    if(end == out->data){
+        *end++ = '[';
+    }else{
+        out->data[0] = '[';
+    }
+    memcpy(end, "\n]", 2);
+    end += 2;
+
+    addHeaders(response, getKeysResponse, sizeof(getKeysResponse) - 1, end - out->data);
+    addPart(response, out->data, end - out->data);
+
+    return response->len;
+}
+
 /*
-    Returns size of buffer
+    Signs the len bytes of msg_bin with the key of request
+    Returns size of response
 */
-int upcheckResponseStr(char* buffer){
-    strcpy(buffer, upcheckResponse);
-    return strlen(upcheckResponse);
+int signMessageResponseStr(struct boardRequest* request, uint8_t* msg_bin, int len, struct outputBuffer* out, struct httpResponse* response){
+    if(reserveOutput(out, signatureBodySize) == -1){
+        return -1;
+    }
+
+    //The secure module encodes the signature right where it's sent from
+    struct secure_sign_item item = {NULL, msg_bin, len, request->key, NULL, out->data + 2};
+    if(sign_items(&item, 1) != 0){
+        return -1;
+    }
+    PROFILE_BEGIN(serialize);
+    out->data[0] = '0';
+    out->data[1] = 'x';
+    out->data[signatureBodySize - 1] = '\n';
+
+    addPart(response, signResponse, sizeof(signResponse) - 1);
+    addPart(response, out->data, signatureBodySize);
+    PROFILE_END(serialize);
+
+    return response->len;
 }
 
 /*
-    Returns size of buffer
+    Signs the signingRoot of the request as it is, a request without one signs the root derived from its typed object
+    Returns size of response
 */
-int getKeysResponseStr(char* buffer, struct boardRequest* request){
-    int jsonKeysSize = 5*request->nKeys + request->nKeys*keySize + 3;
+int signResponseStr(struct boardRequest* request, struct outputBuffer* out, struct httpResponse* response){
+    struct jsonSpan signingRoot;
+    if(request->json == NULL){
+        return -1;
+    }
+    if(jsonGetString(request->json, request->jsonLen, "signingRoot", &signingRoot) == -1){
+        struct jsonSpan object;
+        uint8_t gvr[slashingRootSize];
+        uint64_t position;
+        uint8_t* root = arena_alloc(request->arena, sszChunkSize);
+        if(root == NULL || slashingDeriveRoot(request->json, request->jsonLen, &object, gvr, &position, root) == NULL){
+            return -1;
+        }
+        return signMessageResponseStr(request, root, sszChunkSize, out, response);
+    }
 
-    strcpy(buffer, getKeysResponse);
+    char errors[MAXSizeEthereumSignature];//msg_parse reports errors here
+    int len = hexLen(&signingRoot);
+    if(len == 0){
+        return -1;
+    }
+    uint8_t* msg_bin = arena_alloc(request->arena, len/2 + len%2);
+    if(msg_bin == NULL){
+        return -1;
+    }
+    errors[0] = '\0';
+    if(msg_parse((char*) signingRoot.data, msg_bin, len, errors)){
+        return -1;
+    }
 
-    char nKeysStr[100];
-    sprintf(nKeysStr, "%d", jsonKeysSize);
+    return signMessageResponseStr(request, msg_bin, len/2 + len%2, out, response);
+}
 
-    strcat(buffer, nKeysStr);
-    strcat(buffer, "\n\n[\n");
+/*
+    Body format: [{"pubkey": "0xkey", "signingRoot": "0xroot"}, ....]
+    Every pair is checked before anything is signed
+    Returns size of response
+    On error, or if any key isn't stored, returns -1
+*/
+int signBatchResponseStr(struct boardRequest* request, struct outputBuffer* out, struct httpResponse* response){
+    struct jsonSpan* pairs = arena_alloc(request->arena, MAXBatch * sizeof(struct jsonSpan));
+    int n;
+    if(pairs == NULL || request->json == NULL || (n = jsonArray(request->json, request->jsonLen, pairs, MAXBatch)) <= 0){
+        return -1;
+    }
 
-    for(int i = 0; i < request->nKeys; ++i){
-        strcat(buffer, "\"0x");
-        strncat(buffer, request->publicKeys[i], keySize);
-        strcat(buffer, "\"");
-        strcat(buffer, "\n");
+    struct secure_sign_item* items = arena_alloc(request->arena, n * sizeof(struct secure_sign_item));
+    struct jsonSpan* signingRoots = arena_alloc(request->arena, n * sizeof(struct jsonSpan));
+    if(items == NULL || signingRoots == NULL){
+        return -1;
     }
-    strcat(buffer, "]");
+    int total = 0;
+    int i;
 
-    return (strlen(buffer));
+    for(i = 0; i < n; ++i){
+        struct jsonSpan pubkey;
+        if(jsonGetString(pairs[i].data, pairs[i].len, "pubkey", &pubkey) == -1 ||
+        jsonGetString(pairs[i].data, pairs[i].len, "signingRoot", &signingRoots[i]) == -1){
+            return -1;
+        }
+        if(hexLen(&pubkey) != keySize || (items[i].key = keyHandle(pubkey.data + pubkey.len - keySize)) == -1){
+            return -1;
+        }
+        int len = hexLen(&signingRoots[i]);
+        if(len == 0){
+            return -1;
+        }
+        items[i].pk = NULL;
+        items[i].len = len/2 + len%2;
+        items[i].sig = NULL;
+        total += items[i].len;
+    }
+
+    char errors[MAXSizeEthereumSignature];//msg_parse reports errors here
+    uint8_t* msgBins = arena_alloc(request->arena, total);
+    total = 0;
+    if(msgBins == NULL || reserveOutput(out, (size_t) n * signBatchEntrySize + 4) == -1){
+        return -1;
+    }
+
+    /*
+        The secure module encodes every signature right into its entry, ,\n"0x<signature>",
+        and the comma of the first one becomes the [ of the array
+    */
+    for(i = 0; i < n; ++i){
+        items[i].msg = msgBins + total;
+        items[i].sig_hex = out->data + (size_t) i * signBatchEntrySize + 5;
+        errors[0] = '\0';
+        if(msg_parse((char*) signingRoots[i].data, msgBins + total, hexLen(&signingRoots[i]), errors)){
+            return -1;
+        }
+        total += items[i].len;
+    }
+
+    if(sign_items(items, n) != 0){
+        return -1;
+    }
+
+    PROFILE_BEGIN(serialize);
+    char* end = out->data;
+    for(i = 0; i < n; ++i){
+        memcpy(end, ",\n\"0x", 5);
+        end[signBatchEntrySize - 1] = '"';
+        end += signBatchEntrySize;
+    }
+    out->data[0] = '[';
+    memcpy(end, "\n]", 2);
+    end += 2;
+
+    addHeaders(response, signBatchResponse, sizeof(signBatchResponse) - 1, end - out->data);
+    addPart(response, out->data, end - out->data);
+    PROFILE_END(serialize);
+
+    return response->len;
 }
 
 /*
-    Returns size of buffer
+    Returns size of response
 */
-int signResponseStr(char* buffer, struct boardRequest* request){
-    cJSON* json = cJSON_Parse(request->json);
-    cJSON* signingroot = cJSON_GetObjectItemCaseSensitive(json, "signingRoot");
+int metricsResponseStr(struct outputBuffer* out, struct httpResponse* response){
+    if(reserveOutput(out, metricsBufferSize) == -1){
+        return -1;
+    }
+    int len = metricsText(out->data, out->size);
+    if(len == -1){
+        return -1;
+    }
 
-    char* argv[] = {NULL, request->keyToSign, signingroot->valuestring};
-    char responseSigned[MAXSizeEthereumSignature];//¿Maximum size of ethereum siganture?
-    responseSigned[0] = '\0';
-    signature(0, argv, responseSigned);
+    addHeaders(response, metricsResponse, sizeof(metricsResponse) - 1, len);
+    addPart(response, out->data, len);
 
-    strcpy(buffer, signResponse);
+    return response->len;
+}
 
-    int signatureLen = strlen(responseSigned + signatureOffset) + 2;//+2 due to 0x
-    char signatureLenStr[100];
-    sprintf(signatureLenStr, "%d", signatureLen);
+/*
+    Checks a sign request against the slashing protection, if it's enabled, and signs it
+    With the slashing protection the signed root is the one derived from the request, not its signingRoot
+    Returns size of response
+*/
+int slashingSignResponseStr(struct boardRequest* request, struct outputBuffer* out, struct httpResponse* response){
+    if(slashing == NULL){
+        return signResponseStr(request, out, response);
+    }
 
-    strcat(buffer, signatureLenStr);
-    strcat(buffer, "\n\n0x");
-    strcat(buffer, responseSigned + signatureOffset);
+    uint8_t* signingRoot = arena_alloc(request->arena, sszChunkSize);
+    if(signingRoot == NULL){
+        return -1;
+    }
+    PROFILE_BEGIN(slashing);
+    int safe = slashingCheckRequest(request->keyToSign, request->json, request->jsonLen, signingRoot);
+    PROFILE_END(slashing);
+    if(safe == slashingInvalid){
+        return -1;
+    }else if(safe == slashingRefused){
+        metricsCountError(errorSlashable);
+        addPart(response, slashableResponse, sizeof(slashableResponse) - 1);
+        return response->len;
+    }
+    return signMessageResponseStr(request, signingRoot, sszChunkSize, out, response);
+}
 
-    return strlen(buffer);
+/*
+    Waits for a signing token of the scheduler
+    On success returns 0, the token has to be released once the request is signed
+    On error returns -1, response is the 503 answer
+*/
+int scheduleResponse(int priority, uint64_t deadline, struct httpResponse* response){
+    PROFILE_BEGIN(queue);
+    int admitted = schedulerAdmit(priority, deadline);
+    PROFILE_END(queue);
+    if(admitted == schedulerAdmitted){
+        return 0;
+    }
+    metricsCountError((admitted == schedulerFull) ? errorOverloaded : errorLate);
+    addPart(response, unavailableResponse, sizeof(unavailableResponse) - 1);
+    return -1;
 }
 
 /*
-    On succes returns the number of bytes in buffer
-    On error retuns -1
+    Headers point to static strings and bodies to out, nothing is copied until writev
+    On succes returns the number of bytes in response
+    On error retuns -1, the request should be answered with badRequestResponse
 */
-int dumpHttpResponse(char* buffer, struct boardRequest* request){//boardRequest in, buffer out
+int dumpHttpResponse(struct boardRequest* request, struct outputBuffer* out, struct httpResponse* response){//boardRequest in, response out
+    response->nParts = 0;
+    response->len = 0;
+
     switch(request->method){
-        case sign:
-            if(checkKey(request) == -1){
-                return -1;
+        case sign:{
+            PROFILE_BEGIN(check_key);
+            int found = checkKey(request);
+            PROFILE_END(check_key);
+            if(found == -1){
+                metricsCountError(errorUnknownKey);
+                addPart(response, notFoundResponse, sizeof(notFoundResponse) - 1);
+                return response->len;
+            }
+            //Admitted before the slashing check, so that a shed request doesn't raise the watermarks
+            uint64_t deadline;
+            int priority = requestPriority(request->json, request->jsonLen, &deadline);
+            if(scheduleResponse(priority, deadline, response) == -1){
+                return response->len;
             }
-            return signResponseStr(buffer, request);
+            int len = slashingSignResponseStr(request, out, response);
+            schedulerRelease();
+            return len;
             break;
+        }
         case upcheck:
-            return upcheckResponseStr(buffer);
+            return upcheckResponseStr(response);
             break;
         case getKeys:
-            if(copyKeys(request) == -1){
-                return -1;
+            return getKeysResponseStr(out, response);
+            break;
+        case signBatch:{
+            //Batches only carry signing roots, which can't be checked against the slashing protection
+            if(slashing != NULL){
+                metricsCountError(errorSlashable);
+                addPart(response, slashableResponse, sizeof(slashableResponse) - 1);
+                return response->len;
+            }
+            if(scheduleResponse(priorityAttestation, 0, response) == -1){
+                return response->len;
             }
-            return getKeysResponseStr(buffer, request);
+            int len = signBatchResponseStr(request, out, response);
+            schedulerRelease();
+            return len;
+            break;
+        }
+        case getMetrics:
+            return metricsResponseStr(out, response);
             break;
         default:
             return -1;
     }
 }
 
+/*
+    Writes the pending bytes of out, the socket is non-blocking
+    On success returns 0, out->pending is left above 0 if the socket is full
+    On error returns -1
+*/
+int flushOutput(int fd, struct outputBuffer* out){
+    while(out->pending > 0){
+        ssize_t n = write(fd, out->data + out->sent, out->pending);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        out->sent += n;
+        out->pending -= n;
+    }
+    out->sent = 0;
+
+    return 0;
+}
+
+/*
+    Keeps the parts the socket didn't take in out, they may point to its data
+    On success returns 0
+    On error returns -1
+*/
+int keepOutput(struct outputBuffer* out, struct iovec* parts, int nParts){
+    size_t len = 0;
+    for(int i = 0; i < nParts; ++i){
+        len += parts[i].iov_len;
+    }
+    char* data = malloc(len);
+    if(data == NULL){
+        return -1;
+    }
+    char* end = data;
+    for(int i = 0; i < nParts; ++i){
+        memcpy(end, parts[i].iov_base, parts[i].iov_len);
+        end += parts[i].iov_len;
+    }
+    free(out->data);
+    out->data = data;
+    out->size = len;
+    out->pending = len;
+    out->sent = 0;
+
+    return 0;
+}
+
+/*
+    The socket is non-blocking, what it doesn't take is kept in out and written by flushOutput
+    once the socket is writable again, no other response may be written until then
+    On success returns 0
+    On error returns -1
+*/
+int writeResponse(int fd, struct httpResponse* response, struct outputBuffer* out){
+    struct iovec* parts = response->parts;
+    int nParts = response->nParts;
+
+    while(nParts > 0){
+        ssize_t n = writev(fd, parts, nParts);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return keepOutput(out, parts, nParts);
+            }
+            return -1;
+        }
+        //Skips what has been written, writev may stop in the middle of a part
+        while(nParts > 0 && (size_t) n >= parts->iov_len){
+            n -= parts->iov_len;
+            ++parts;
+            --nParts;
+        }
+        if(nParts > 0){
+            parts->iov_base = (char*) parts->iov_base + n;
+            parts->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,226 @@
+/*
+    A scanner for the few JSON fields read by the remote signer
+
+    Values are returned as spans of the request body, which is read where picohttpparser
+    left it: nothing is copied or allocated and the body doesn't have to end in \0.
+    Strings are returned as they are written, escapes aren't decoded, which is enough
+    for the hex strings of public keys and signing roots
+*/
+
+#ifndef jsonScan_h
+#define jsonScan_h
+
+#include <stddef.h>
+#include <string.h>
+
+#define MAXJsonDepth 32 //Deeper values are rejected
+
+struct jsonSpan{
+    const char* data;
+    size_t len;
+};
+
+const char* skipSpaces(const char* p, const char* end){
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')){
+        ++p;
+    }
+    return p;
+}
+
+/*
+    p is the opening quote
+    Returns the position that follows the closing quote
+    On error returns NULL
+*/
+const char* skipString(const char* p, const char* end){
+    for(++p; p < end; ++p){
+        if(*p == '\\'){
+            ++p;
+        }else if(*p == '"'){
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Skips the value that starts at p, whatever its type
+    Returns the position that follows it
+    On error returns NULL
+*/
+const char* skipValue(const char* p, const char* end){
+    char closing[MAXJsonDepth];//Brackets still open
+    int depth = 0;
+
+    do{
+        p = skipSpaces(p, end);
+        if(p == end){
+            return NULL;
+        }
+        switch(*p){
+            case '"':
+                p = skipString(p, end);
+                if(p == NULL){
+                    return NULL;
+                }
+                break;
+            case '{':
+            case '[':
+                if(depth == MAXJsonDepth){
+                    return NULL;
+                }
+                closing[depth++] = (*p == '{') ? '}' : ']';
+                ++p;
+                break;
+            case '}':
+            case ']':
+                if(depth == 0 || closing[depth - 1] != *p){
+                    return NULL;
+                }
+                --depth;
+                ++p;
+                break;
+            case ',':
+            case ':':
+                if(depth == 0){
+                    return NULL;
+                }
+                ++p;
+                break;
+            default:{
+                //Numbers, true, false and null
+                const char* start = p;
+                while(p < end && ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') || *p == '-' || *p == '+' || *p == '.' || *p == 'E')){
+                    ++p;
+                }
+                if(p == start){
+                    return NULL;
+                }
+            }
+        }
+    }while(depth > 0);
+
+    return p;
+}
+
+/*
+    Finds the member key of the object in json, whatever its type
+    On success returns 0 and value holds the value as it is written, quotes and brackets included
+    On error, or if the object has no such member, returns -1
+*/
+int jsonGetValue(const char* json, size_t len, const char* key, struct jsonSpan* value){
+    const char* end = json + len;
+    size_t keyLen = strlen(key);
+
+    int found = 0;
+
+    const char* p = skipSpaces(json, end);
+    if(p == end || *p != '{'){
+        return -1;
+    }
+    p = skipSpaces(p + 1, end);
+    if(p < end && *p == '}'){
+        return -1;
+    }
+
+    //The whole object is scanned, so that a malformed body isn't signed
+    for(;;){
+        if(p == end || *p != '"'){
+            return -1;
+        }
+        const char* name = p + 1;
+        p = skipString(p, end);
+        if(p == NULL){
+            return -1;
+        }
+        int isKey = ((size_t) (p - 1 - name) == keyLen) && (memcmp(name, key, keyLen) == 0);
+
+        p = skipSpaces(p, end);
+        if(p == end || *p != ':'){
+            return -1;
+        }
+        const char* start = skipSpaces(p + 1, end);
+        p = skipValue(start, end);
+        if(p == NULL){
+            return -1;
+        }
+        if(isKey && !found){
+            value->data = start;
+            value->len = p - start;
+            found = 1;
+        }
+
+        p = skipSpaces(p, end);
+        if(p == end){
+            return -1;
+        }else if(*p == '}'){
+            return found ? 0 : -1;
+        }else if(*p != ','){
+            return -1;
+        }
+        p = skipSpaces(p + 1, end);
+    }
+}
+
+/*
+    Finds the member key of the object in json, which must be a string
+    On success returns 0 and value holds the string without its quotes
+    On error, or if the object has no such member, returns -1
+*/
+int jsonGetString(const char* json, size_t len, const char* key, struct jsonSpan* value){
+    struct jsonSpan member;
+    if(jsonGetValue(json, len, key, &member) == -1 || member.data[0] != '"'){
+        return -1;
+    }
+    value->data = member.data + 1;
+    value->len = member.len - 2;
+    return 0;
+}
+
+/*
+    Splits the array in json into the spans of its elements, up to max of them
+    With elements NULL the elements are only counted, whatever their number
+    On success returns the number of elements
+    On error, or if the array has more than max elements, returns -1
+*/
+int jsonArray(const char* json, size_t len, struct jsonSpan* elements, int max){
+    const char* end = json + len;
+    int n = 0;
+
+    const char* p = skipSpaces(json, end);
+    if(p == end || *p != '['){
+        return -1;
+    }
+    p = skipSpaces(p + 1, end);
+    if(p < end && *p == ']'){
+        return 0;
+    }
+
+    for(;;){
+        if(elements != NULL && n == max){
+            return -1;
+        }
+        const char* start = p;
+        p = skipValue(start, end);
+        if(p == NULL){
+            return -1;
+        }
+        if(elements != NULL){
+            elements[n].data = start;
+            elements[n].len = p - start;
+        }
+        ++n;
+
+        p = skipSpaces(p, end);
+        if(p == end){
+            return -1;
+        }else if(*p == ']'){
+            return n;
+        }else if(*p != ','){
+            return -1;
+        }
+        p = skipSpaces(p + 1, end);
+    }
+}
+
+#endif
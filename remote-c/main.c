@@ -13,55 +13,259 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "../blst/bindings/blst.h"
+#include "./metrics.h"//Before common.h, so that its stages are timed
 #include "../cli/include/common.h"
 
 #include "./httpRemote.h"
+#include "./connection.h"
+#include "./workerPool.h"
 
 #include "../secure_module/zephyr/spm/src/main.c"
 
 #define PORT 8080
 #define SA struct sockaddr
+#define MAXEvents 64 //Maximum number of events handled per epoll_wait call
 
-void func(int sockfd)
+/*
+    Writes the response to a request, requests that can't be served are answered with an error
+    On success returns 0
+    On error returns -1
+*/
+int answerRequest(struct connection* conn, struct boardRequest* reply)
 {
-    char* argv[4];
-    int argc;
+    struct httpResponse response;
 
-    // infinite loop for chat
-    for (;;) {
-        int bytesRead;
-        char bufferRequest[MAX];
+    PROFILE_BEGIN(request);
+    metricsCountRoute(reply->method);
+    if(dumpHttpResponse(reply, &conn->out, &response) <= 0){
+        printf("Unsuccessful response.\n");
+        metricsCountError(errorBadRequest);
+        response.nParts = 0;
+        response.len = 0;
+        addPart(&response, badRequestResponse, sizeof(badRequestResponse) - 1);
+    }
+    printf("\n\n");
+    for(int i = 0; i < response.nParts; ++i){
+        fwrite(response.parts[i].iov_base, 1, response.parts[i].iov_len, stdout);
+    }
+    printf("\n\n");
+    fflush(stdout);
+
+    int ret = writeResponse(conn->fd, &response, &conn->out);
+    PROFILE_END(request);
 
-        bytesRead = read(sockfd, (void*) bufferRequest, MAX);
-        printf("%.*s\n\n\n\n", bytesRead, bufferRequest);
+    return ret;
+}
+
+/*
+    Reads from the connection and answers, in order, every request that is complete
+    An incomplete request stays in the input buffer until the next read
+    While a response waits for the socket, it is written first and the next requests wait in the input buffer
+    Returns -1 when the connection has to be closed, 0 otherwise
+*/
+int func(struct connection* conn)
+{
+    struct inputBuffer* in = &conn->in;
+    int bytesRead;
+
+    if(flushOutput(conn->fd, &conn->out) == -1){
+        return -1;
+    }
+    if(conn->out.pending > 0){
+        return 0;
+    }
+
+    if(growInput(in) == -1){
+        printf("Request too long.\n");
+        return -1;
+    }
+    bytesRead = read(conn->fd, (void*) (in->data + in->len), in->size - in->len);
+    if(bytesRead == 0 || (bytesRead < 0 && errno != EAGAIN && errno != EINTR)){
+        return -1;
+    }
+
+    //Requests left when the socket was full are answered even if nothing was read
+    if(bytesRead > 0){
+        printf("%.*s\n\n\n\n", bytesRead, in->data + in->len);
         fflush(stdout);
+        in->len += bytesRead;
+    }
+
+    size_t start = 0;
+    for(;;){
         struct boardRequest reply;
+        //Scans of incomplete and malformed requests are timed too
+        PROFILE_BEGIN(parse);
+        int requestLen = parseRequest(in->data + start, in->len - start, &in->lastLen, &conn->arena, &reply);
+        PROFILE_END(parse);
+        if(requestLen == -2){
+            arena_reset(&conn->arena);
+            break;
+        }else if(requestLen < 0){
+            metricsCountError(errorMalformed);
+            return -1;
+        }
 
-        if(parseRequest(bufferRequest, (size_t) bytesRead, &reply) == 0){
-            int bytesToWrite;
-            char bufferReply[MAX];
-
-            if((bytesToWrite = dumpHttpResponse(bufferReply, &reply)) > 0){
-                int bytesWritten = 0;
-                do{
-                    bytesWritten += write(sockfd, (void*) (bufferReply + bytesWritten), bytesToWrite - bytesWritten);
-                }while(bytesWritten < bytesToWrite);
-                printf("\n\n%s\n\n", bufferReply);
-                fflush(stdout);
-            }else{
-                printf("Unsuccessful response.\n");
+        int ret = answerRequest(conn, &reply);
+        arena_reset(&conn->arena);
+        if(ret == -1){
+            return -1;
+        }
+        start += requestLen;
+        if(conn->out.pending > 0){
+            break;
+        }
+    }
+
+    memmove(in->data, in->data + start, in->len - start);
+    in->len -= start;
+
+    return 0;
+}
+
+/*
+    Accepts every pending connection on sockfd and registers it in epollfd
+*/
+void acceptConnections(int sockfd, int epollfd)
+{
+    struct sockaddr_in cli;
+    socklen_t len;
+    struct epoll_event ev;
+
+    for(;;){
+        len = sizeof(cli);
+        int connfd = accept(sockfd, (SA*)&cli, &len);
+        if (connfd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                printf("server accept failed...\n");
             }
+            return;
+        }
+
+        //Workers must not block on a connection, see writeResponse
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+
+        struct connection* conn = newConnection(connfd);
+        if(conn == NULL){
+            close(connfd);
+            continue;
+        }
+
+        //The connection is handed to one worker at a time, see workerPool.h
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, connfd, &ev) == -1){
+            printf("epoll_ctl failed...\n");
+            freeConnection(conn);
+        }else{
+            printf("server accept the client...\n");
         }
     }
 }
 
-void main(void)
+void closeConnection(int epollfd, struct connection* conn)
+{
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    freeConnection(conn);
+}
+
+/*
+    Usage: server [-s slashing.db] [-i interchange.json] [-e interchange.json] [-t signers] [-q queue]
+        [-g genesis time] [-d seconds per slot] [number of workers]
+    -s enables the slashing protection with the database in the file, see slashing.h
+    -i merges an EIP-3076 interchange file into it before serving, -e exports it and exits
+    -t is the number of requests signed at once, one per online core by default, and -q how many
+    wait for them, 4 per signer by default, see scheduler.h
+    -g, the genesis time of the chain in seconds since the Unix epoch, sheds the requests past their slot
+    (slots of 12 seconds unless -d is given)
+    By default there is a worker per signer and per place in the queue
+*/
+void main(int argc, char** argv)
 {
-    int sockfd, connfd, len;
-    struct sockaddr_in servaddr, cli;
-   
+    int sockfd, epollfd;
+    int reuse = 1;
+    struct sockaddr_in servaddr;
+    struct epoll_event ev, events[MAXEvents];
+    struct workerPool pool;
+    const char* slashingPath = NULL;
+    const char* importPath = NULL;
+    const char* exportPath = NULL;
+    int signers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int queueSize = -1;
+    uint64_t genesisTime = 0;
+    uint64_t secondsPerSlot = defaultSecondsPerSlot;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:i:e:t:q:g:d:")) != -1) {
+        switch (opt) {
+            case 's':
+                slashingPath = optarg;
+                break;
+            case 'i':
+                importPath = optarg;
+                break;
+            case 'e':
+                exportPath = optarg;
+                break;
+            case 't':
+                signers = atoi(optarg);
+                break;
+            case 'q':
+                queueSize = atoi(optarg);
+                break;
+            case 'g':
+                genesisTime = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                secondsPerSlot = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: %s [-s slashing.db] [-i interchange.json] [-e interchange.json] [-t signers] [-q queue] "
+                    "[-g genesis time] [-d seconds per slot] [workers]\n", argv[0]);
+                exit(0);
+        }
+    }
+    if ((importPath != NULL || exportPath != NULL) && slashingPath == NULL) {
+        printf("-i and -e need the slashing protection database, -s...\n");
+        exit(0);
+    }
+    if (slashingPath != NULL) {
+        if (slashingOpen(slashingPath) == -1) {
+            printf("the slashing protection database couldn't be opened...\n");
+            exit(0);
+        }
+        printf("Slashing protection enabled..\n");
+    }
+    if (importPath != NULL) {
+        int n = slashingImport(importPath);
+        if (n == -1) {
+            printf("the interchange file couldn't be imported...\n");
+            exit(0);
+        }
+        printf("Imported the slashing protection of %d keys..\n", n);
+    }
+    if (exportPath != NULL) {
+        int n = slashingExport(exportPath);
+        if (n == -1) {
+            printf("the interchange file couldn't be written...\n");
+        } else {
+            printf("Exported the slashing protection of %d keys..\n", n);
+        }
+        exit(0);
+    }
+
+    // keys stored by a previous run, when HSM_KEYSTORE names the keystore file
+    if (keystore_load() == -1) {
+        printf("the keystore file couldn't be loaded...\n");
+        exit(0);
+    }
+
     // socket create and verification
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1) {
@@ -71,12 +275,13 @@ void main(void)
     else
         printf("Socket successfully created..\n");
     bzero(&servaddr, sizeof(servaddr));
-   
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // assign IP, PORT
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(PORT);
-   
+
     // Binding newly created socket to given IP and verification
     if ((bind(sockfd, (SA*)&servaddr, sizeof(servaddr))) != 0) {
         printf("socket bind failed...\n");
@@ -84,28 +289,77 @@ void main(void)
     }
     else
         printf("Socket successfully binded..\n");
-   
+
     // Now server is ready to listen and verification
-    if ((listen(sockfd, 5)) != 0) {
+    if ((listen(sockfd, SOMAXCONN)) != 0) {
         printf("Listen failed...\n");
         exit(0);
     }
     else
         printf("Server listening..\n");
-    len = sizeof(cli);
-   
-    // Accept the data packet from client and verification
-    connfd = accept(sockfd, (SA*)&cli, &len);
-    if (connfd < 0) {
-        printf("server accept failed...\n");
+
+    // The listening socket is non-blocking so that acceptConnections can drain the backlog
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    epollfd = epoll_create1(0);
+    if (epollfd == -1) {
+        printf("epoll creation failed...\n");
+        exit(0);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;//Connections carry their struct connection
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+        printf("epoll_ctl failed...\n");
+        exit(0);
+    }
+
+    if (signers <= 0) {
+        signers = 1;
+    }
+    if (queueSize < 0) {
+        queueSize = 4 * signers;
+    }
+    if (schedulerInit(signers, queueSize, genesisTime, secondsPerSlot) != 0) {
+        printf("scheduler creation failed...\n");
+        exit(0);
+    }
+    else
+        printf("Signing %d requests at once, %d more can wait..\n", signers, queueSize);
+    if (genesisTime != 0) {
+        printf("Requests past their slot are shed, genesis at %llu..\n", (unsigned long long) genesisTime);
+    }
+
+    if (startWorkerPool(&pool, (optind < argc) ? atoi(argv[optind]) : signers + queueSize, epollfd, func) != 0) {
+        printf("worker pool creation failed...\n");
         exit(0);
     }
     else
-        printf("server accept the client...\n");
-   
-    // Function for chatting between client and server
-    func(connfd);
-   
-    // After chatting close the socket
+        printf("Started %d workers..\n", pool.nThreads);
+
+    // Event loop: every connection stays open (keep-alive) until the client closes it.
+    // Readable connections, and writable ones with a response pending, are passed to the workers, which call func()
+    for (;;) {
+        int nfds = epoll_wait(epollfd, events, MAXEvents, -1);
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("epoll_wait failed...\n");
+            break;
+        }
+
+        for (int i = 0; i < nfds; ++i) {
+            struct connection* conn = events[i].data.ptr;
+
+            if (conn == NULL) {
+                acceptConnections(sockfd, epollfd);
+            } else if ((events[i].events & (EPOLLERR | EPOLLHUP)) || (pushWork(&pool.queue, conn) == -1)) {
+                closeConnection(epollfd, conn);
+            }
+        }
+    }
+
+    close(epollfd);
     close(sockfd);
 }
\ No newline at end of file
@@ -0,0 +1,158 @@
+/*
+    Latency and throughput metrics of the remote signer, served on /metrics in Prometheus text format
+
+    Every stage of a request has a histogram of its durations and every route a counter of its requests.
+    They are updated with relaxed atomic additions, so workers never wait for each other to record them,
+    and a scrape may see a histogram in the middle of an update, which Prometheus tolerates.
+
+    The stages inside common.h and the emulated secure module, hash_to_g2 and sign_pk, are timed
+    through their PROFILE_BEGIN and PROFILE_END hooks, so this header has to be included before common.h
+*/
+
+#ifndef metrics_h
+#define metrics_h
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define stage_parse 0 //phr_parse_request and the routing of the request
+#define stage_check_key 1 //Decoding the key of a sign request and looking it up in the keystore
+#define stage_hash_to_g2 2 //Hash to curve of the messages in the secure module, cache hits included
+#define stage_sign_pk 3 //Signing and compressing the signatures in the secure module
+#define stage_serialize 4 //Encoding signatures and building the response
+#define stage_slashing 5 //Checking and raising the slashing protection watermarks of a sign request
+#define stage_queue 6 //Waiting for a signing token of the scheduler
+#define stage_request 7 //Whole response, from the parsed request to the last byte written
+#define nStages 8
+
+//Stages of the shell commands, which the remote signer doesn't time
+#define stage_ikm_sk -1
+#define stage_import_sk -1
+#define stage_core_verify -1
+#define stage_secure_sign -1 //The whole secure call, its hash_to_g2 and sign_pk stages are timed on their own
+
+#define nBuckets 16
+
+/*
+    Upper bounds of the buckets in microseconds, the last bucket, +Inf, is implicit
+*/
+const uint64_t bucketBounds[nBuckets] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000};
+
+const char* stageNames[nStages] = {"parse", "check_key", "hash_to_g2", "sign_pk", "serialize", "slashing", "queue", "request"};
+
+struct histogram{
+    atomic_uint_fast64_t buckets[nBuckets + 1];//Not cumulative, they are added up when served
+    atomic_uint_fast64_t sumNs;
+};
+
+#define errorBadRequest 0 //Answered with 400
+#define errorUnknownKey 1 //Answered with 404
+#define errorMalformed 2 //The connection was closed, the request couldn't be parsed
+#define errorSlashable 3 //Refused by the slashing protection, answered with 412
+#define errorOverloaded 4 //The queue of the scheduler was full, answered with 503
+#define errorLate 5 //Shed by the scheduler, past its deadline, answered with 503
+#define nErrors 6
+
+const char* errorNames[nErrors] = {"bad_request", "unknown_key", "malformed", "slashable", "overloaded", "late"};
+
+/*
+    Indexed by the methods of httpRemote.h
+*/
+#define nRoutes 6
+
+const char* routeNames[nRoutes] = {"sign", "upcheck", "get_keys", "sign_batch", "metrics", "unsupported"};
+
+struct histogram stageHistograms[nStages];
+atomic_uint_fast64_t routeCounters[nRoutes];
+atomic_uint_fast64_t errorCounters[nErrors];
+
+uint64_t metricsNow(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void metricsObserve(int stage, uint64_t ns){
+    if(stage < 0){
+        return;
+    }
+    int bucket = 0;
+    while(bucket < nBuckets && ns > bucketBounds[bucket] * 1000){
+        ++bucket;
+    }
+    atomic_fetch_add_explicit(&stageHistograms[stage].buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stageHistograms[stage].sumNs, ns, memory_order_relaxed);
+}
+
+void metricsCountRoute(int route){
+    if(route >= 0 && route < nRoutes){
+        atomic_fetch_add_explicit(&routeCounters[route], 1, memory_order_relaxed);
+    }
+}
+
+void metricsCountError(int error){
+    atomic_fetch_add_explicit(&errorCounters[error], 1, memory_order_relaxed);
+}
+
+#define PROFILE_BEGIN(stage) uint64_t profileStart_##stage = metricsNow()
+#define PROFILE_END(stage) metricsObserve(stage_##stage, metricsNow() - profileStart_##stage)
+
+/*
+    Writes the metrics in text format into buffer
+    Returns the number of bytes written, -1 if they don't fit in size bytes
+*/
+int metricsText(char* buffer, size_t size){
+    size_t len = 0;
+    int n;
+
+//Appends to buffer, giving up once it's full
+#define metricsPrintf(...) \
+    do{ \
+        n = snprintf(buffer + len, size - len, __VA_ARGS__); \
+        if(n < 0 || (size_t) n >= size - len){ \
+            return -1; \
+        } \
+        len += n; \
+    }while(0)
+
+    metricsPrintf("# HELP remote_stage_duration_seconds Time spent in each stage of a request\n"
+        "# TYPE remote_stage_duration_seconds histogram\n");
+    for(int stage = 0; stage < nStages; ++stage){
+        uint64_t cumulative = 0;
+        for(int bucket = 0; bucket <= nBuckets; ++bucket){
+            cumulative += atomic_load_explicit(&stageHistograms[stage].buckets[bucket], memory_order_relaxed);
+            if(bucket < nBuckets){
+                metricsPrintf("remote_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                    stageNames[stage], bucketBounds[bucket] / 1e6, (unsigned long long) cumulative);
+            }else{
+                metricsPrintf("remote_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                    stageNames[stage], (unsigned long long) cumulative);
+            }
+        }
+        uint64_t sumNs = atomic_load_explicit(&stageHistograms[stage].sumNs, memory_order_relaxed);
+        metricsPrintf("remote_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stageNames[stage], sumNs / 1e9);
+        metricsPrintf("remote_stage_duration_seconds_count{stage=\"%s\"} %llu\n", stageNames[stage], (unsigned long long) cumulative);
+    }
+
+    metricsPrintf("# HELP remote_requests_total Requests answered by route\n"
+        "# TYPE remote_requests_total counter\n");
+    for(int route = 0; route < nRoutes; ++route){
+        metricsPrintf("remote_requests_total{route=\"%s\"} %llu\n", routeNames[route],
+            (unsigned long long) atomic_load_explicit(&routeCounters[route], memory_order_relaxed));
+    }
+
+    metricsPrintf("# HELP remote_errors_total Requests that couldn't be served\n"
+        "# TYPE remote_errors_total counter\n");
+    for(int error = 0; error < nErrors; ++error){
+        metricsPrintf("remote_errors_total{reason=\"%s\"} %llu\n", errorNames[error],
+            (unsigned long long) atomic_load_explicit(&errorCounters[error], memory_order_relaxed));
+    }
+
+#undef metricsPrintf
+
+    return len;
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+    Admission control of the sign requests, in front of the signing engine
+
+    A request takes one of the signing tokens of the scheduler before it's signed, there is one per
+    online core by default. When they are all taken it waits in the queue of its priority:
+        block: BLOCK, BLOCK_V2 and RANDAO_REVEAL
+        aggregate: AGGREGATION_SLOT, AGGREGATE_AND_PROOF and the sync committee selection proofs and contributions
+        attestation: ATTESTATION, SYNC_COMMITTEE_MESSAGE, batches and every other type
+    A released token goes to the highest priority that is waiting, so a block proposal waits for a
+    signature at most, never behind the attestations that came before it.
+
+    The queue is bounded and the lower priorities only fill part of it: attestations half of it and
+    aggregates three quarters, so there is always room, and a worker, left for a block. A request that
+    doesn't fit is refused straight away with a 503, which the validator client can retry elsewhere.
+
+    When the genesis time of the chain is given, the deadline of a request is the end of its slot
+    (of its epoch for RANDAO_REVEAL). A request past it is shed with a 503 instead of being signed,
+    and one still waiting when it passes gives up. Requests without a slot have no deadline.
+*/
+
+#ifndef scheduler_h
+#define scheduler_h
+
+#include <stdint.h>
+#include <errno.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include "./jsonScan.h"
+#include "./slashing.h"
+
+#define priorityBlock 0
+#define priorityAggregate 1
+#define priorityAttestation 2
+#define nPriorities 3
+
+#define schedulerAdmitted 0
+#define schedulerFull -1 //The queue of the priority is full, answered with 503
+#define schedulerLate -2 //Past the deadline of the request, answered with 503
+
+#define slotsPerEpoch 32
+#define defaultSecondsPerSlot 12
+
+struct signScheduler{
+    pthread_mutex_t lock;
+    pthread_cond_t turn[nPriorities];//Waiters of every priority, only the highest one waiting is woken
+    int tokens;//Free signing tokens
+    int waiting[nPriorities];
+    int queued;//Waiting requests of every priority
+    int maxQueued[nPriorities];//The lower priorities only take part of the queue
+    uint64_t genesisTime;//Seconds since the Unix epoch, 0 when it isn't known and requests have no deadline
+    uint64_t secondsPerSlot;
+};
+
+struct signScheduler scheduler;
+
+/*
+    The requests of every type, with the member that holds their slot or epoch
+*/
+struct requestClass{
+    const char* type;
+    int priority;
+    int depth;
+    const char* path[4];
+    uint64_t slotsPerUnit;//1 for a slot, slotsPerEpoch for an epoch
+};
+
+const struct requestClass requestClasses[] = {
+    {"BLOCK", priorityBlock, 2, {"block", "slot"}, 1},
+    {"BLOCK_V2", priorityBlock, 3, {"beacon_block", "block", "slot"}, 1},
+    {"BLOCK_V2", priorityBlock, 3, {"beacon_block", "block_header", "slot"}, 1},
+    {"RANDAO_REVEAL", priorityBlock, 2, {"randao_reveal", "epoch"}, slotsPerEpoch},
+    {"AGGREGATION_SLOT", priorityAggregate, 2, {"aggregation_slot", "slot"}, 1},
+    {"AGGREGATE_AND_PROOF", priorityAggregate, 4, {"aggregate_and_proof", "aggregate", "data", "slot"}, 1},
+    {"SYNC_COMMITTEE_SELECTION_PROOF", priorityAggregate, 2, {"sync_aggregator_selection_data", "slot"}, 1},
+    {"SYNC_COMMITTEE_CONTRIBUTION_AND_PROOF", priorityAggregate, 3, {"contribution_and_proof", "contribution", "slot"}, 1},
+    {"ATTESTATION", priorityAttestation, 2, {"attestation", "slot"}, 1},
+    {"SYNC_COMMITTEE_MESSAGE", priorityAttestation, 2, {"sync_committee_message", "slot"}, 1},
+};
+
+#define nRequestClasses (sizeof(requestClasses) / sizeof(requestClasses[0]))
+
+/*
+    Nanoseconds since the Unix epoch, the clock of the deadlines and of pthread_cond_timedwait
+*/
+uint64_t schedulerNow(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+    tokens requests are signed at once and up to queueSize wait for them
+    genesisTime is 0 when deadlines aren't enforced
+    On success returns 0
+    On error returns -1
+*/
+int schedulerInit(int tokens, int queueSize, uint64_t genesisTime, uint64_t secondsPerSlot){
+    struct signScheduler* s = &scheduler;
+
+    if(tokens <= 0 || queueSize < 0 || secondsPerSlot == 0){
+        return -1;
+    }
+    if(pthread_mutex_init(&s->lock, NULL) != 0){
+        return -1;
+    }
+    for(int p = 0; p < nPriorities; ++p){
+        if(pthread_cond_init(&s->turn[p], NULL) != 0){
+            return -1;
+        }
+        s->waiting[p] = 0;
+    }
+    s->tokens = tokens;
+    s->queued = 0;
+    s->maxQueued[priorityBlock] = queueSize;
+    s->maxQueued[priorityAggregate] = queueSize - queueSize / 4;
+    s->maxQueued[priorityAttestation] = queueSize / 2;
+    s->genesisTime = genesisTime;
+    s->secondsPerSlot = secondsPerSlot;
+
+    return 0;
+}
+
+/*
+    Finds the priority of the request in json and the deadline, in nanoseconds since the Unix epoch
+    The deadline is 0 when the request has none
+    Returns the priority
+*/
+int requestPriority(const char* json, size_t len, uint64_t* deadline){
+    struct signScheduler* s = &scheduler;
+    struct jsonSpan type;
+
+    *deadline = 0;
+    if(json == NULL || jsonGetString(json, len, "type", &type) == -1){
+        return priorityAttestation;
+    }
+    int priority = priorityAttestation;
+    for(size_t i = 0; i < nRequestClasses; ++i){
+        const struct requestClass* c = &requestClasses[i];
+        if(type.len != strlen(c->type) || strncasecmp(type.data, c->type, type.len) != 0){
+            continue;
+        }
+        priority = c->priority;
+
+        uint64_t unit;
+        if(s->genesisTime == 0 || jsonGetUint64(json, len, c->path, c->depth, &unit) == -1){
+            continue;//BLOCK_V2 has two classes, with a block or with a block header
+        }
+        //Slots so far in the future that the deadline would overflow never expire
+        uint64_t slotNs = s->secondsPerSlot * 1000000000;
+        uint64_t limit = (UINT64_MAX - s->genesisTime * 1000000000) / slotNs / c->slotsPerUnit;
+        if(unit < limit){
+            *deadline = s->genesisTime * 1000000000 + (unit + 1) * c->slotsPerUnit * slotNs;
+        }
+        break;
+    }
+
+    return priority;
+}
+
+/*
+    Wakes a waiter of the highest priority that is waiting, if a token is free
+    Called with the lock held
+*/
+void schedulerWake(struct signScheduler* s){
+    if(s->tokens == 0){
+        return;
+    }
+    for(int p = 0; p < nPriorities; ++p){
+        if(s->waiting[p] > 0){
+            pthread_cond_signal(&s->turn[p]);
+            return;
+        }
+    }
+}
+
+int schedulerHigherWaiting(struct signScheduler* s, int priority){
+    for(int p = 0; p < priority; ++p){
+        if(s->waiting[p] > 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Takes a signing token for a request of priority, waiting for it until deadline (0 for no deadline)
+    Returns schedulerAdmitted, and then the token has to be given back with schedulerRelease,
+    schedulerFull or schedulerLate
+*/
+int schedulerAdmit(int priority, uint64_t deadline){
+    struct signScheduler* s = &scheduler;
+    struct timespec until = {deadline / 1000000000, deadline % 1000000000};
+
+    if(deadline != 0 && schedulerNow() >= deadline){
+        return schedulerLate;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if(s->tokens == 0 || schedulerHigherWaiting(s, priority)){
+        if(s->queued >= s->maxQueued[priority]){
+            pthread_mutex_unlock(&s->lock);
+            return schedulerFull;
+        }
+        s->waiting[priority]++;
+        s->queued++;
+        while(s->tokens == 0 || schedulerHigherWaiting(s, priority)){
+            if(deadline == 0){
+                pthread_cond_wait(&s->turn[priority], &s->lock);
+            }else if(pthread_cond_timedwait(&s->turn[priority], &s->lock, &until) == ETIMEDOUT){
+                s->waiting[priority]--;
+                s->queued--;
+                schedulerWake(s);//It may have been woken for a token just before giving up
+                pthread_mutex_unlock(&s->lock);
+                return schedulerLate;
+            }
+        }
+        s->waiting[priority]--;
+        s->queued--;
+    }
+    s->tokens--;
+    schedulerWake(s);//Tokens released together are handed on one waiter at a time
+    pthread_mutex_unlock(&s->lock);
+
+    return schedulerAdmitted;
+}
+
+void schedulerRelease(){
+    struct signScheduler* s = &scheduler;
+
+    pthread_mutex_lock(&s->lock);
+    s->tokens++;
+    schedulerWake(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+#endif
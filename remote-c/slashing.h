@@ -0,0 +1,577 @@
+/*
+    Slashing protection of the remote signer
+
+    The database keeps, for every public key, the highest block slot and the highest attestation
+    source and target epochs it has signed, and refuses to sign anything that isn't above them
+    (the minimal conditions of EIP-3076). It's a file mapped in memory, shared by every worker:
+        header: magic "SLASHDB1", capacity, genesis validators root
+        records: public key, block watermark, attestation watermark
+    Records are an open addressing hash table of public keys (linear probing) with a fixed capacity,
+    a full database refuses to sign for new keys. remote-go reads the same file.
+
+    Checks don't lock: a block watermark is slot + 1 and an attestation watermark packs
+    target + 1 and source + 1 in a single word, 0 meaning nothing signed, and each one is raised
+    with a compare and swap, so two requests for the same key can't both pass with values that
+    conflict. Only the first request of a key takes the lock, to add its record.
+
+    The mapping is shared, so the watermarks survive a crash of the signer as soon as they are
+    written. Flushing them to disk is left to the kernel.
+
+    EIP-3076 interchange files are imported and exported with slashingImport and slashingExport.
+    Only the watermarks are kept, so an export has a block and an attestation per key at most.
+*/
+
+#ifndef slashing_h
+#define slashing_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./jsonScan.h"
+#include "./ssz.h"
+#include "../cli/include/hex.h"
+
+#define slashingMagic "SLASHDB1"
+#define slashingCapacity 65536 //Records of a new database, a power of two
+#define slashingHeaderSize 64
+#define slashingPkSize 48
+#define slashingRootSize 32
+
+#define slashingSafe 0
+#define slashingRefused -1 //Slashable, or the database can't take the key
+#define slashingInvalid -2 //The signing root can't be derived from the request, or isn't the one it carries
+#define slashingSlotsPerEpoch 32
+
+struct slashingHeader{
+    char magic[8];
+    uint32_t capacity;
+    _Atomic uint32_t gvrSet;
+    uint8_t gvr[slashingRootSize];
+    uint8_t reserved[16];
+};
+
+struct slashingRecord{
+    uint8_t pk[slashingPkSize];
+    _Atomic uint32_t used;
+    uint32_t reserved;
+    _Atomic uint64_t block;
+    _Atomic uint64_t attestation;
+};
+
+_Static_assert(sizeof(struct slashingHeader) == slashingHeaderSize, "The header of the file is 64 bytes");
+_Static_assert(sizeof(struct slashingRecord) == 72, "Records of the file are 72 bytes");
+
+struct slashingDB{
+    struct slashingHeader* header;
+    struct slashingRecord* records;
+    size_t size;
+    pthread_mutex_t lock;//Taken to add records and to set the genesis validators root
+};
+
+struct slashingDB* slashing = NULL;//NULL unless the signer was started with a database
+
+/*
+    Opens the database in path, it's created if it doesn't exist
+    On success returns 0
+    On error returns -1
+*/
+int slashingOpen(const char* path){
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd == -1){
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if(size == 0){
+        size = slashingHeaderSize + (size_t) slashingCapacity * sizeof(struct slashingRecord);
+        if(ftruncate(fd, size) == -1){
+            close(fd);
+            return -1;
+        }
+    }
+
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        return -1;
+    }
+
+    struct slashingHeader* header = data;
+    if(st.st_size == 0){
+        memcpy(header->magic, slashingMagic, 8);
+        header->capacity = slashingCapacity;
+    }
+    uint32_t capacity = header->capacity;
+    if(memcmp(header->magic, slashingMagic, 8) != 0 || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+    size < slashingHeaderSize + (size_t) capacity * sizeof(struct slashingRecord)){
+        munmap(data, size);
+        return -1;
+    }
+
+    slashing = malloc(sizeof(struct slashingDB));
+    if(slashing == NULL){
+        munmap(data, size);
+        return -1;
+    }
+    slashing->header = header;
+    slashing->records = (struct slashingRecord*) ((char*) data + slashingHeaderSize);
+    slashing->size = size;
+    pthread_mutex_init(&slashing->lock, NULL);
+
+    return 0;
+}
+
+/*
+    Returns the record of pk, added if add is set
+    Returns NULL if it isn't found, or if the database is full
+*/
+struct slashingRecord* slashingRecord(const uint8_t* pk, int add){
+    uint32_t mask = slashing->header->capacity - 1;
+    uint32_t home = (((uint32_t) pk[44] << 24) | ((uint32_t) pk[45] << 16) | ((uint32_t) pk[46] << 8) | pk[47]) & mask;
+    uint32_t pos = home;
+
+    //Records are never removed, so the first free one ends the search
+    do{
+        struct slashingRecord* record = &slashing->records[pos];
+        if(atomic_load_explicit(&record->used, memory_order_acquire) == 0){
+            break;
+        }
+        if(memcmp(record->pk, pk, slashingPkSize) == 0){
+            return record;
+        }
+        pos = (pos + 1) & mask;
+    }while(pos != home);
+
+    if(!add){
+        return NULL;
+    }
+
+    //Another worker may be adding the same key, so it's searched again while the lock is held
+    struct slashingRecord* found = NULL;
+    pthread_mutex_lock(&slashing->lock);
+    do{
+        struct slashingRecord* record = &slashing->records[pos];
+        if(atomic_load_explicit(&record->used, memory_order_acquire) == 0){
+            memcpy(record->pk, pk, slashingPkSize);
+            atomic_store_explicit(&record->used, 1, memory_order_release);
+            found = record;
+        }else if(memcmp(record->pk, pk, slashingPkSize) == 0){
+            found = record;
+        }
+        pos = (pos + 1) & mask;
+    }while(found == NULL && pos != home);
+    pthread_mutex_unlock(&slashing->lock);
+
+    return found;
+}
+
+/*
+    Signatures are only made for a single chain, the first one seen or imported
+    Returns slashingSafe if gvr is the root of the database
+*/
+int slashingCheckRoot(const uint8_t* gvr){
+    if(atomic_load_explicit(&slashing->header->gvrSet, memory_order_acquire) == 0){
+        pthread_mutex_lock(&slashing->lock);
+        if(atomic_load_explicit(&slashing->header->gvrSet, memory_order_relaxed) == 0){
+            memcpy(slashing->header->gvr, gvr, slashingRootSize);
+            atomic_store_explicit(&slashing->header->gvrSet, 1, memory_order_release);
+        }
+        pthread_mutex_unlock(&slashing->lock);
+    }
+    return (memcmp(slashing->header->gvr, gvr, slashingRootSize) == 0) ? slashingSafe : slashingRefused;
+}
+
+/*
+    Raises the block watermark of pk to slot
+    Returns slashingSafe if the block can be signed
+*/
+int slashingCheckBlock(const uint8_t* pk, uint64_t slot){
+    struct slashingRecord* record = slashingRecord(pk, 1);
+    if(record == NULL || slot >= UINT64_MAX - 1){
+        return slashingRefused;
+    }
+
+    uint64_t last = atomic_load_explicit(&record->block, memory_order_acquire);
+    do{
+        if(last != 0 && slot + 1 <= last){
+            return slashingRefused;
+        }
+    }while(!atomic_compare_exchange_weak_explicit(&record->block, &last, slot + 1, memory_order_acq_rel, memory_order_acquire));
+
+    return slashingSafe;
+}
+
+/*
+    Raises the attestation watermark of pk to source and target
+    Returns slashingSafe if the attestation can be signed
+*/
+int slashingCheckAttestation(const uint8_t* pk, uint64_t source, uint64_t target){
+    struct slashingRecord* record = slashingRecord(pk, 1);
+    if(record == NULL || source > target || target >= UINT32_MAX){
+        return slashingRefused;
+    }
+
+    uint64_t next = ((target + 1) << 32) | (source + 1);
+    uint64_t last = atomic_load_explicit(&record->attestation, memory_order_acquire);
+    do{
+        //Neither a double vote nor a surrounded vote: the source can't go back and the target must move on
+        if(last != 0 && ((source + 1) < (last & 0xffffffff) || (target + 1) <= (last >> 32))){
+            return slashingRefused;
+        }
+    }while(!atomic_compare_exchange_weak_explicit(&record->attestation, &last, next, memory_order_acq_rel, memory_order_acquire));
+
+    return slashingSafe;
+}
+
+/*
+    Follows the path of members from json down to a string and parses it
+    On success returns 0
+    On error, or if any member is missing, returns -1
+*/
+int jsonGetUint64(const char* json, size_t len, const char* const* path, int depth, uint64_t* value){
+    struct jsonSpan span = {json, len};
+    for(int i = 0; i < depth - 1; ++i){
+        if(jsonGetValue(span.data, span.len, path[i], &span) == -1){
+            return -1;
+        }
+    }
+    if(jsonGetString(span.data, span.len, path[depth - 1], &span) == -1){
+        return -1;
+    }
+    return spanToUint64(&span, value);
+}
+
+/*
+    Signing requests whose root is derived from their typed object, as remote-go does
+    epochPath leads to the slot or the epoch that selects the fork version of the domain
+*/
+#define slashingOther 0
+#define slashingBlock 1
+#define slashingAttestation 2
+
+struct slashingType{
+    const char* type;
+    const char* member;//Object of the request that is signed
+    sszRootFunction rootOf;
+    uint8_t domainType;
+    int kind;
+    const char* epochPath[3];
+    int epochDepth;
+    int isSlot;
+};
+
+const struct slashingType slashingTypes[] = {
+    {"block", "block", sszBlockRoot, 0, slashingBlock, {"slot"}, 1, 1},
+    {"block_v2", "beacon_block", NULL, 0, slashingBlock, {"slot"}, 1, 1},//Its block or block header, see slashingBlockV2
+    {"attestation", "attestation", sszAttestationDataRoot, 1, slashingAttestation, {"target", "epoch"}, 2, 0},
+    {"randao_reveal", "random_reveal", sszRandaoRevealRoot, 2, slashingOther, {"epoch"}, 1, 0},
+    {"aggregation_slot", "aggregation_slot", sszAggregationSlotRoot, 5, slashingOther, {"slot"}, 1, 1},
+    {"aggregate_and_proof", "aggregate_and_proof", sszAggregateAndProofRoot, 6, slashingOther, {"aggregate", "data", "slot"}, 3, 1},
+};
+
+#define nSlashingTypes (sizeof(slashingTypes)/sizeof(slashingTypes[0]))
+
+/*
+    A BLOCK_V2 request carries a block header of any fork, or a whole block, which is only derived for phase0
+    On success returns 0 and object is the header or the block
+    On error returns -1
+*/
+int slashingBlockV2(const struct jsonSpan* beaconBlock, struct jsonSpan* object, sszRootFunction* rootOf){
+    struct jsonSpan version;
+    if(jsonGetValue(beaconBlock->data, beaconBlock->len, "block_header", object) == 0){
+        *rootOf = sszBlockHeaderRoot;
+        return 0;
+    }
+    if(jsonGetString(beaconBlock->data, beaconBlock->len, "version", &version) == -1 ||
+    version.len != 6 || strncasecmp(version.data, "phase0", 6) != 0 ||
+    jsonGetValue(beaconBlock->data, beaconBlock->len, "block", object) == -1){
+        return -1;
+    }
+    *rootOf = sszBlockRoot;
+    return 0;
+}
+
+/*
+    Derives the signing root of a Web3Signer signing request from its typed object, also without a database
+    object is the member that was derived, gvr the genesis validators root and position its slot or epoch
+    Returns the type of the request, signingRoot holds the 32 bytes to sign
+    Returns NULL if the root can't be derived, or isn't the signingRoot the request carries
+*/
+const struct slashingType* slashingDeriveRoot(const char* json, size_t len, struct jsonSpan* object, uint8_t* gvr,
+    uint64_t* position, uint8_t* signingRoot){
+    static const char* const forkEpochPath[] = {"epoch"};
+
+    struct jsonSpan type;
+    if(json == NULL || jsonGetString(json, len, "type", &type) == -1){
+        return NULL;
+    }
+    const struct slashingType* t = NULL;
+    for(size_t i = 0; i < nSlashingTypes && t == NULL; ++i){
+        if(type.len == strlen(slashingTypes[i].type) && strncasecmp(type.data, slashingTypes[i].type, type.len) == 0){
+            t = &slashingTypes[i];
+        }
+    }
+    if(t == NULL){
+        return NULL;
+    }
+
+    struct jsonSpan forkInfo, fork, gvrSpan, versionSpan, claimed;
+    sszRootFunction rootOf = t->rootOf;
+    if(jsonGetValue(json, len, t->member, object) == -1 || (rootOf == NULL && slashingBlockV2(object, object, &rootOf) == -1)){
+        return NULL;
+    }
+
+    //The fork of the domain is the one of the epoch of the object
+    uint8_t version[4], objectRoot[sszChunkSize], domain[sszChunkSize], claimedRoot[sszChunkSize];
+    uint64_t epoch, forkEpoch;
+    if(jsonGetValue(json, len, "fork_info", &forkInfo) == -1 ||
+    jsonGetString(forkInfo.data, forkInfo.len, "genesis_validators_root", &gvrSpan) == -1 ||
+    decodeSpan(&gvrSpan, gvr, slashingRootSize) == -1 || jsonGetValue(forkInfo.data, forkInfo.len, "fork", &fork) == -1 ||
+    jsonGetUint64(fork.data, fork.len, forkEpochPath, 1, &forkEpoch) == -1 ||
+    jsonGetUint64(object->data, object->len, t->epochPath, t->epochDepth, position) == -1){
+        return NULL;
+    }
+    epoch = t->isSlot ? *position/slashingSlotsPerEpoch : *position;
+    if(jsonGetString(fork.data, fork.len, (epoch < forkEpoch) ? "previous_version" : "current_version", &versionSpan) == -1 ||
+    decodeSpan(&versionSpan, version, 4) == -1 || rootOf(object, objectRoot) == -1){
+        return NULL;
+    }
+    sszDomain(t->domainType, version, gvr, domain);
+    sszSigningRoot(objectRoot, domain, signingRoot);
+    if(jsonGetString(json, len, "signingRoot", &claimed) == 0 &&
+    (decodeSpan(&claimed, claimedRoot, sszChunkSize) == -1 || memcmp(claimedRoot, signingRoot, sszChunkSize) != 0)){
+        return NULL;
+    }
+    return t;
+}
+
+/*
+    Checks a Web3Signer signing request of the key pkHex and derives the root to sign from its typed object,
+    so that what is signed is what was checked, whatever signingRoot the request carries
+    Blocks and attestations raise the watermarks of the key, the other types can't be slashed
+    Types whose root can't be derived are refused, their signing root could be of anything
+    Returns slashingSafe if the request can be signed, signingRoot holds the 32 bytes to sign
+    Returns slashingRefused if it's slashable, and slashingInvalid if the root can't be derived or doesn't match
+*/
+int slashingCheckRequest(const char* pkHex, const char* json, size_t len, uint8_t* signingRoot){
+    static const char* const sourceEpoch[] = {"source", "epoch"};
+    static const char* const targetEpoch[] = {"target", "epoch"};
+
+    struct jsonSpan object;
+    uint8_t gvr[slashingRootSize];
+    uint64_t position;
+    const struct slashingType* t = slashingDeriveRoot(json, len, &object, gvr, &position, signingRoot);
+    if(t == NULL){
+        return slashingInvalid;
+    }
+    if(t->kind == slashingOther){
+        return slashingSafe;
+    }
+
+    uint8_t pk[slashingPkSize];
+    if(hex_decode(pkHex, 2*slashingPkSize, pk) == -1 || slashingCheckRoot(gvr) == -1){
+        return slashingRefused;
+    }
+    if(t->kind == slashingBlock){
+        return slashingCheckBlock(pk, position);
+    }
+    uint64_t source, target;
+    if(jsonGetUint64(object.data, object.len, sourceEpoch, 2, &source) == -1 ||
+    jsonGetUint64(object.data, object.len, targetEpoch, 2, &target) == -1){
+        return slashingInvalid;
+    }
+    return slashingCheckAttestation(pk, source, target);
+}
+
+/*
+    Reads the whole file in path, which has to be freed
+    Returns NULL on error
+*/
+char* readFile(const char* path, size_t* len){
+    FILE* file = fopen(path, "rb");
+    if(file == NULL){
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = (size >= 0) ? malloc(size + 1) : NULL;
+    if(data != NULL && fread(data, 1, size, file) != (size_t) size){
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if(data != NULL){
+        *len = size;
+    }
+    return data;
+}
+
+/*
+    Maximum of the member key, a decimal string, of the objects in the array
+    On success returns 0, and *found tells if any object had the member
+    On error returns -1
+*/
+int jsonArrayMax(const struct jsonSpan* array, const char* key, uint64_t* max, int* found){
+    int n = jsonArray(array->data, array->len, NULL, 0);
+    if(n <= 0){
+        return n;
+    }
+    struct jsonSpan* elements = malloc(n * sizeof(struct jsonSpan));
+    if(elements == NULL || jsonArray(array->data, array->len, elements, n) != n){
+        free(elements);
+        return -1;
+    }
+    for(int i = 0; i < n; ++i){
+        struct jsonSpan span;
+        uint64_t value;
+        if(jsonGetString(elements[i].data, elements[i].len, key, &span) == -1 || spanToUint64(&span, &value) == -1){
+            free(elements);
+            return -1;
+        }
+        if(!*found || value > *max){
+            *max = value;
+        }
+        *found = 1;
+    }
+    free(elements);
+    return 0;
+}
+
+void raiseWatermark(_Atomic uint64_t* watermark, uint64_t value){
+    uint64_t last = atomic_load(watermark);
+    while(value > last && !atomic_compare_exchange_weak(watermark, &last, value)){
+    }
+}
+
+/*
+    Merges an EIP-3076 interchange file into the database, the watermarks of every key are raised to
+    the highest slot and epochs of the file
+    On success returns the number of keys in the file
+    On error, or if the file is of another chain, returns -1
+*/
+int slashingImport(const char* path){
+    size_t len;
+    char* json = readFile(path, &len);
+    if(json == NULL){
+        return -1;
+    }
+
+    int ret = -1;
+    struct jsonSpan metadata, version, gvrSpan, data;
+    struct jsonSpan* entries = NULL;
+    uint8_t gvr[slashingRootSize];
+    if(jsonGetValue(json, len, "metadata", &metadata) == -1 ||
+    jsonGetString(metadata.data, metadata.len, "interchange_format_version", &version) == -1 ||
+    version.len != 1 || version.data[0] != '5' ||
+    jsonGetString(metadata.data, metadata.len, "genesis_validators_root", &gvrSpan) == -1 ||
+    decodeSpan(&gvrSpan, gvr, slashingRootSize) == -1 || slashingCheckRoot(gvr) == -1 ||
+    jsonGetValue(json, len, "data", &data) == -1){
+        goto end;
+    }
+
+    int n = jsonArray(data.data, data.len, NULL, 0);
+    entries = (n > 0) ? malloc(n * sizeof(struct jsonSpan)) : NULL;
+    if(n < 0 || (n > 0 && (entries == NULL || jsonArray(data.data, data.len, entries, n) != n))){
+        goto end;
+    }
+    for(int i = 0; i < n; ++i){
+        struct jsonSpan pkSpan, blocks, attestations;
+        uint8_t pk[slashingPkSize];
+        uint64_t slot = 0, source = 0, target = 0;
+        int hasBlock = 0, hasSource = 0, hasTarget = 0;
+
+        if(jsonGetString(entries[i].data, entries[i].len, "pubkey", &pkSpan) == -1 || decodeSpan(&pkSpan, pk, slashingPkSize) == -1){
+            goto end;
+        }
+        if((jsonGetValue(entries[i].data, entries[i].len, "signed_blocks", &blocks) == 0 &&
+        jsonArrayMax(&blocks, "slot", &slot, &hasBlock) == -1) ||
+        (jsonGetValue(entries[i].data, entries[i].len, "signed_attestations", &attestations) == 0 &&
+        (jsonArrayMax(&attestations, "source_epoch", &source, &hasSource) == -1 ||
+        jsonArrayMax(&attestations, "target_epoch", &target, &hasTarget) == -1))){
+            goto end;
+        }
+
+        struct slashingRecord* record = slashingRecord(pk, 1);
+        if(record == NULL || slot >= UINT64_MAX - 1 || target >= UINT32_MAX){
+            goto end;
+        }
+        if(hasBlock){
+            raiseWatermark(&record->block, slot + 1);
+        }
+        if(hasTarget){
+            //Both epochs are raised at once, so the attestation watermark is built from the highest of each
+            uint64_t last = atomic_load(&record->attestation);
+            uint64_t next;
+            do{
+                uint64_t lastSource = last & 0xffffffff, lastTarget = last >> 32;
+                next = (((target + 1 > lastTarget) ? target + 1 : lastTarget) << 32) |
+                    ((source + 1 > lastSource) ? source + 1 : lastSource);
+            }while(!atomic_compare_exchange_weak(&record->attestation, &last, next));
+        }
+    }
+    ret = n;
+
+end:
+    free(entries);
+    free(json);
+    return ret;
+}
+
+/*
+    Writes the watermarks of every key as an EIP-3076 interchange file
+    On success returns the number of keys written
+    On error returns -1
+*/
+int slashingExport(const char* path){
+    FILE* file = fopen(path, "w");
+    if(file == NULL){
+        return -1;
+    }
+
+    char gvrHex[2*slashingRootSize + 1];
+    hex_encode(slashing->header->gvr, slashingRootSize, gvrHex);
+    fprintf(file, "{\"metadata\":{\"interchange_format_version\":\"5\",\"genesis_validators_root\":\"0x%s\"},\"data\":[", gvrHex);
+
+    int n = 0;
+    for(uint32_t i = 0; i < slashing->header->capacity; ++i){
+        struct slashingRecord* record = &slashing->records[i];
+        if(atomic_load_explicit(&record->used, memory_order_acquire) == 0){
+            continue;
+        }
+        char pkHex[2*slashingPkSize + 1];
+        hex_encode(record->pk, slashingPkSize, pkHex);
+        uint64_t block = atomic_load(&record->block);
+        uint64_t attestation = atomic_load(&record->attestation);
+
+        fprintf(file, "%s\n{\"pubkey\":\"0x%s\",\"signed_blocks\":[", (n == 0) ? "" : ",", pkHex);
+        if(block != 0){
+            fprintf(file, "{\"slot\":\"%llu\"}", (unsigned long long) (block - 1));
+        }
+        fprintf(file, "],\"signed_attestations\":[");
+        if(attestation != 0){
+            fprintf(file, "{\"source_epoch\":\"%llu\",\"target_epoch\":\"%llu\"}",
+                (unsigned long long) ((attestation & 0xffffffff) - 1), (unsigned long long) ((attestation >> 32) - 1));
+        }
+        fprintf(file, "]}");
+        ++n;
+    }
+    fprintf(file, "\n]}\n");
+
+    return (fclose(file) == 0) ? n : -1;
+}
+
+#endif
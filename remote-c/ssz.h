@@ -0,0 +1,484 @@
+/*
+    Hash tree roots of the phase0 objects of a signing request, the SSZ merkleization of the consensus specs
+
+    Objects are read from the JSON of the request with jsonScan, as the beacon API writes them:
+    integers as decimal strings and bytes as 0x hex strings. Each field is hashed into its 32 byte
+    chunk as soon as it's parsed, so an object is never decoded whole; only lists take a buffer for
+    the roots of their elements. Lists take the limits of the mainnet preset, like remote-go.
+*/
+
+#ifndef ssz_h
+#define ssz_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../blst/bindings/blst.h"
+#include "./jsonScan.h"
+#include "../cli/include/hex.h"
+
+#define sszChunkSize 32
+#define sszMaxDepth 10 //Deepest tree of the lists below, the 2048 attesting indices take 512 chunks
+
+//Lists of the blocks (MAX_* of the mainnet preset)
+#define sszMaxValidatorsPerCommittee 2048
+#define sszMaxProposerSlashings 16
+#define sszMaxAttesterSlashings 2
+#define sszMaxAttestations 128
+#define sszMaxDeposits 16
+#define sszMaxVoluntaryExits 16
+#define sszDepositProofLength 33
+
+#define sszPkSize 48
+#define sszSignatureSize 96
+
+//Roots of the trees of zero chunks, sszZeroHashes[d] is the one of depth d
+uint8_t sszZeroHashes[sszMaxDepth + 1][sszChunkSize];
+pthread_once_t sszZeroHashesOnce = PTHREAD_ONCE_INIT;
+
+void sszHashPair(uint8_t* out, const uint8_t* left, const uint8_t* right){
+    uint8_t pair[2*sszChunkSize];
+    memcpy(pair, left, sszChunkSize);
+    memcpy(pair + sszChunkSize, right, sszChunkSize);
+    blst_sha256(out, pair, sizeof(pair));
+}
+
+void sszInitZeroHashes(void){
+    memset(sszZeroHashes[0], 0, sszChunkSize);
+    for(int d = 1; d <= sszMaxDepth; ++d){
+        sszHashPair(sszZeroHashes[d], sszZeroHashes[d - 1], sszZeroHashes[d - 1]);
+    }
+}
+
+/*
+    Merkleizes n chunks padded with zero chunks up to limit, the chunks are overwritten
+    On success returns 0
+    On error, if there are more than limit chunks, returns -1
+*/
+int sszMerkleize(uint8_t (*chunks)[sszChunkSize], size_t n, size_t limit, uint8_t* root){
+    int depth = 0;
+    while(((size_t) 1 << depth) < limit){
+        ++depth;
+    }
+    if(n > limit || depth > sszMaxDepth){
+        return -1;
+    }
+    pthread_once(&sszZeroHashesOnce, sszInitZeroHashes);
+    if(n == 0){
+        memcpy(root, sszZeroHashes[depth], sszChunkSize);
+        return 0;
+    }
+
+    for(int d = 0; d < depth; ++d){
+        size_t parents = (n + 1)/2;
+        for(size_t i = 0; i < parents; ++i){
+            sszHashPair(chunks[i], chunks[2*i], (2*i + 1 < n) ? chunks[2*i + 1] : sszZeroHashes[d]);
+        }
+        n = parents;
+    }
+    memcpy(root, chunks[0], sszChunkSize);
+    return 0;
+}
+
+void sszMixInLength(uint8_t* root, uint64_t length){
+    uint8_t chunk[sszChunkSize] = {0};
+    for(int i = 0; i < 8; ++i){
+        chunk[i] = length >> (8*i);
+    }
+    sszHashPair(root, root, chunk);
+}
+
+void sszUint64Chunk(uint64_t value, uint8_t* chunk){
+    memset(chunk, 0, sszChunkSize);
+    for(int i = 0; i < 8; ++i){
+        chunk[i] = value >> (8*i);
+    }
+}
+
+/*
+    Parses the decimal string in span, as Web3Signer and EIP-3076 write slots and epochs
+    On success returns 0
+    On error returns -1
+*/
+int spanToUint64(const struct jsonSpan* span, uint64_t* value){
+    if(span->len == 0 || span->len > 20){
+        return -1;
+    }
+    uint64_t v = 0;
+    for(size_t i = 0; i < span->len; ++i){
+        if(span->data[i] < '0' || span->data[i] > '9' || v > (UINT64_MAX - (span->data[i] - '0'))/10){
+            return -1;
+        }
+        v = 10*v + (span->data[i] - '0');
+    }
+    *value = v;
+    return 0;
+}
+
+/*
+    Decodes the hex string in span, with or without 0x, into len bytes
+    On success returns 0
+    On error returns -1
+*/
+int decodeSpan(const struct jsonSpan* span, uint8_t* bin, size_t len){
+    size_t offset = (span->len >= 2 && span->data[0] == '0' && span->data[1] == 'x') ? 2 : 0;
+    if(span->len - offset != 2*len){
+        return -1;
+    }
+    return hex_decode(span->data + offset, 2*len, bin);
+}
+
+/*
+    Field parsers: each one reads the member key of the object in obj into its chunk
+    On success returns 0
+    On error, or if the member is missing, returns -1
+*/
+int sszUint64Field(const struct jsonSpan* obj, const char* key, uint64_t* value, uint8_t* chunk){
+    struct jsonSpan span;
+    uint64_t v;
+    if(jsonGetString(obj->data, obj->len, key, &span) == -1 || spanToUint64(&span, &v) == -1){
+        return -1;
+    }
+    if(value != NULL){
+        *value = v;
+    }
+    sszUint64Chunk(v, chunk);
+    return 0;
+}
+
+//Bytes4 and Bytes32, padded to a chunk
+int sszBytesField(const struct jsonSpan* obj, const char* key, size_t size, uint8_t* chunk){
+    struct jsonSpan span;
+    memset(chunk, 0, sszChunkSize);
+    if(jsonGetString(obj->data, obj->len, key, &span) == -1){
+        return -1;
+    }
+    return decodeSpan(&span, chunk, size);
+}
+
+//Public keys and signatures, which take several chunks
+int sszLongBytesField(const struct jsonSpan* obj, const char* key, size_t size, uint8_t* chunk){
+    uint8_t chunks[sszSignatureSize/sszChunkSize][sszChunkSize] = {{0}};
+    struct jsonSpan span;
+    size_t n = (size + sszChunkSize - 1)/sszChunkSize;
+    if(jsonGetString(obj->data, obj->len, key, &span) == -1 || decodeSpan(&span, chunks[0], size) == -1){
+        return -1;
+    }
+    return sszMerkleize(chunks, n, n, chunk);
+}
+
+typedef int (*sszRootFunction)(const struct jsonSpan* obj, uint8_t* root);
+
+//Containers and lists of containers
+int sszContainerField(const struct jsonSpan* obj, const char* key, sszRootFunction rootOf, uint8_t* chunk){
+    struct jsonSpan value;
+    if(jsonGetValue(obj->data, obj->len, key, &value) == -1){
+        return -1;
+    }
+    return rootOf(&value, chunk);
+}
+
+int sszListField(const struct jsonSpan* obj, const char* key, size_t limit, sszRootFunction rootOf, uint8_t* chunk){
+    struct jsonSpan list;
+    if(jsonGetValue(obj->data, obj->len, key, &list) == -1){
+        return -1;
+    }
+    int n = jsonArray(list.data, list.len, NULL, 0);
+    if(n < 0 || (size_t) n > limit){
+        return -1;
+    }
+    struct jsonSpan* elements = malloc((n + 1) * sizeof(struct jsonSpan));
+    uint8_t (*roots)[sszChunkSize] = malloc((n + 1) * sszChunkSize);
+    int ret = -1;
+    if(elements == NULL || roots == NULL || jsonArray(list.data, list.len, elements, n) != n){
+        goto end;
+    }
+    for(int i = 0; i < n; ++i){
+        if(rootOf(&elements[i], roots[i]) == -1){
+            goto end;
+        }
+    }
+    if(sszMerkleize(roots, n, limit, chunk) == 0){
+        sszMixInLength(chunk, n);
+        ret = 0;
+    }
+
+end:
+    free(elements);
+    free(roots);
+    return ret;
+}
+
+//List of validator indices, packed 4 to a chunk
+int sszIndicesField(const struct jsonSpan* obj, const char* key, size_t limit, uint8_t* chunk){
+    struct jsonSpan list;
+    if(jsonGetValue(obj->data, obj->len, key, &list) == -1){
+        return -1;
+    }
+    int n = jsonArray(list.data, list.len, NULL, 0);
+    if(n < 0 || (size_t) n > limit){
+        return -1;
+    }
+    size_t nChunks = (n + 3)/4;
+    struct jsonSpan* elements = malloc((n + 1) * sizeof(struct jsonSpan));
+    uint8_t (*chunks)[sszChunkSize] = calloc(nChunks + 1, sszChunkSize);
+    int ret = -1;
+    if(elements == NULL || chunks == NULL || jsonArray(list.data, list.len, elements, n) != n){
+        goto end;
+    }
+    for(int i = 0; i < n; ++i){
+        struct jsonSpan index = {elements[i].data + 1, elements[i].len - 2};
+        uint64_t value;
+        if(elements[i].len < 2 || elements[i].data[0] != '"' || spanToUint64(&index, &value) == -1){
+            goto end;
+        }
+        for(int b = 0; b < 8; ++b){
+            chunks[i/4][8*(i%4) + b] = value >> (8*b);
+        }
+    }
+    if(sszMerkleize(chunks, nChunks, (limit + 3)/4, chunk) == 0){
+        sszMixInLength(chunk, n);
+        ret = 0;
+    }
+
+end:
+    free(elements);
+    free(chunks);
+    return ret;
+}
+
+//Bitlist, its last set bit only marks the length
+int sszBitlistField(const struct jsonSpan* obj, const char* key, size_t limit, uint8_t* chunk){
+    uint8_t bits[sszMaxValidatorsPerCommittee/8 + sszChunkSize] = {0};
+    struct jsonSpan span;
+    if(jsonGetString(obj->data, obj->len, key, &span) == -1){
+        return -1;
+    }
+    size_t offset = (span.len >= 2 && span.data[0] == '0' && span.data[1] == 'x') ? 2 : 0;
+    size_t nBytes = (span.len - offset)/2;
+    if(limit > sszMaxValidatorsPerCommittee || nBytes == 0 || nBytes > limit/8 + 1 || (span.len - offset) % 2 ||
+    hex_decode(span.data + offset, 2*nBytes, bits) == -1 || bits[nBytes - 1] == 0){
+        return -1;
+    }
+    int top = 7;
+    while(!(bits[nBytes - 1] & (1 << top))){
+        --top;
+    }
+    uint64_t length = 8*(nBytes - 1) + top;
+    if(length > limit){
+        return -1;
+    }
+    bits[nBytes - 1] &= ~(1 << top);
+    if(sszMerkleize((uint8_t (*)[sszChunkSize]) bits, (length + 255)/256, (limit + 255)/256, chunk) == -1){
+        return -1;
+    }
+    sszMixInLength(chunk, length);
+    return 0;
+}
+
+/*
+    Hash tree roots of the containers, obj is the JSON object
+    On success returns 0
+    On error, if a field is missing or malformed, returns -1
+*/
+int sszCheckpointRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[2][sszChunkSize];
+    if(sszUint64Field(obj, "epoch", NULL, fields[0]) == -1 || sszBytesField(obj, "root", 32, fields[1]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 2, 2, root);
+}
+
+int sszAttestationDataRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[5][sszChunkSize];
+    if(sszUint64Field(obj, "slot", NULL, fields[0]) == -1 || sszUint64Field(obj, "index", NULL, fields[1]) == -1 ||
+    sszBytesField(obj, "beacon_block_root", 32, fields[2]) == -1 ||
+    sszContainerField(obj, "source", sszCheckpointRoot, fields[3]) == -1 ||
+    sszContainerField(obj, "target", sszCheckpointRoot, fields[4]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 5, 5, root);
+}
+
+int sszAttestationRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[3][sszChunkSize];
+    if(sszBitlistField(obj, "aggregation_bits", sszMaxValidatorsPerCommittee, fields[0]) == -1 ||
+    sszContainerField(obj, "data", sszAttestationDataRoot, fields[1]) == -1 ||
+    sszLongBytesField(obj, "signature", sszSignatureSize, fields[2]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 3, 3, root);
+}
+
+int sszIndexedAttestationRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[3][sszChunkSize];
+    if(sszIndicesField(obj, "attesting_indices", sszMaxValidatorsPerCommittee, fields[0]) == -1 ||
+    sszContainerField(obj, "data", sszAttestationDataRoot, fields[1]) == -1 ||
+    sszLongBytesField(obj, "signature", sszSignatureSize, fields[2]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 3, 3, root);
+}
+
+int sszAttesterSlashingRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[2][sszChunkSize];
+    if(sszContainerField(obj, "attestation_1", sszIndexedAttestationRoot, fields[0]) == -1 ||
+    sszContainerField(obj, "attestation_2", sszIndexedAttestationRoot, fields[1]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 2, 2, root);
+}
+
+int sszBlockHeaderRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[5][sszChunkSize];
+    if(sszUint64Field(obj, "slot", NULL, fields[0]) == -1 || sszUint64Field(obj, "proposer_index", NULL, fields[1]) == -1 ||
+    sszBytesField(obj, "parent_root", 32, fields[2]) == -1 || sszBytesField(obj, "state_root", 32, fields[3]) == -1 ||
+    sszBytesField(obj, "body_root", 32, fields[4]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 5, 5, root);
+}
+
+int sszSignedBlockHeaderRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[2][sszChunkSize];
+    if(sszContainerField(obj, "message", sszBlockHeaderRoot, fields[0]) == -1 ||
+    sszLongBytesField(obj, "signature", sszSignatureSize, fields[1]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 2, 2, root);
+}
+
+int sszProposerSlashingRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[2][sszChunkSize];
+    if(sszContainerField(obj, "signed_header_1", sszSignedBlockHeaderRoot, fields[0]) == -1 ||
+    sszContainerField(obj, "signed_header_2", sszSignedBlockHeaderRoot, fields[1]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 2, 2, root);
+}
+
+int sszEth1DataRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[3][sszChunkSize];
+    if(sszBytesField(obj, "deposit_root", 32, fields[0]) == -1 || sszUint64Field(obj, "deposit_count", NULL, fields[1]) == -1 ||
+    sszBytesField(obj, "block_hash", 32, fields[2]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 3, 3, root);
+}
+
+int sszDepositDataRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[4][sszChunkSize];
+    if(sszLongBytesField(obj, "pubkey", sszPkSize, fields[0]) == -1 ||
+    sszBytesField(obj, "withdrawal_credentials", 32, fields[1]) == -1 || sszUint64Field(obj, "amount", NULL, fields[2]) == -1 ||
+    sszLongBytesField(obj, "signature", sszSignatureSize, fields[3]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 4, 4, root);
+}
+
+int sszDepositRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[2][sszChunkSize];
+    uint8_t proof[sszDepositProofLength][sszChunkSize];
+    struct jsonSpan list, elements[sszDepositProofLength];
+    if(jsonGetValue(obj->data, obj->len, "proof", &list) == -1 ||
+    jsonArray(list.data, list.len, elements, sszDepositProofLength) != sszDepositProofLength){
+        return -1;
+    }
+    for(int i = 0; i < sszDepositProofLength; ++i){
+        struct jsonSpan hash = {elements[i].data + 1, elements[i].len - 2};
+        if(elements[i].len < 2 || elements[i].data[0] != '"' || decodeSpan(&hash, proof[i], 32) == -1){
+            return -1;
+        }
+    }
+    if(sszMerkleize(proof, sszDepositProofLength, sszDepositProofLength, fields[0]) == -1 ||
+    sszContainerField(obj, "data", sszDepositDataRoot, fields[1]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 2, 2, root);
+}
+
+int sszVoluntaryExitRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[2][sszChunkSize];
+    if(sszUint64Field(obj, "epoch", NULL, fields[0]) == -1 || sszUint64Field(obj, "validator_index", NULL, fields[1]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 2, 2, root);
+}
+
+int sszSignedVoluntaryExitRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[2][sszChunkSize];
+    if(sszContainerField(obj, "message", sszVoluntaryExitRoot, fields[0]) == -1 ||
+    sszLongBytesField(obj, "signature", sszSignatureSize, fields[1]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 2, 2, root);
+}
+
+int sszBlockBodyRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[8][sszChunkSize];
+    if(sszLongBytesField(obj, "randao_reveal", sszSignatureSize, fields[0]) == -1 ||
+    sszContainerField(obj, "eth1_data", sszEth1DataRoot, fields[1]) == -1 ||
+    sszBytesField(obj, "graffiti", 32, fields[2]) == -1 ||
+    sszListField(obj, "proposer_slashings", sszMaxProposerSlashings, sszProposerSlashingRoot, fields[3]) == -1 ||
+    sszListField(obj, "attester_slashings", sszMaxAttesterSlashings, sszAttesterSlashingRoot, fields[4]) == -1 ||
+    sszListField(obj, "attestations", sszMaxAttestations, sszAttestationRoot, fields[5]) == -1 ||
+    sszListField(obj, "deposits", sszMaxDeposits, sszDepositRoot, fields[6]) == -1 ||
+    sszListField(obj, "voluntary_exits", sszMaxVoluntaryExits, sszSignedVoluntaryExitRoot, fields[7]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 8, 8, root);
+}
+
+int sszBlockRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[5][sszChunkSize];
+    if(sszUint64Field(obj, "slot", NULL, fields[0]) == -1 || sszUint64Field(obj, "proposer_index", NULL, fields[1]) == -1 ||
+    sszBytesField(obj, "parent_root", 32, fields[2]) == -1 || sszBytesField(obj, "state_root", 32, fields[3]) == -1 ||
+    sszContainerField(obj, "body", sszBlockBodyRoot, fields[4]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 5, 5, root);
+}
+
+int sszAggregateAndProofRoot(const struct jsonSpan* obj, uint8_t* root){
+    uint8_t fields[3][sszChunkSize];
+    if(sszUint64Field(obj, "aggregator_index", NULL, fields[0]) == -1 ||
+    sszContainerField(obj, "aggregate", sszAttestationRoot, fields[1]) == -1 ||
+    sszLongBytesField(obj, "selection_proof", sszSignatureSize, fields[2]) == -1){
+        return -1;
+    }
+    return sszMerkleize(fields, 3, 3, root);
+}
+
+//Selection proofs of aggregators and RANDAO reveals sign a single integer
+int sszAggregationSlotRoot(const struct jsonSpan* obj, uint8_t* root){
+    return sszUint64Field(obj, "slot", NULL, root);
+}
+
+int sszRandaoRevealRoot(const struct jsonSpan* obj, uint8_t* root){
+    return sszUint64Field(obj, "epoch", NULL, root);
+}
+
+/*
+    compute_domain of the specs: the domain type followed by the start of the root of the fork data
+*/
+void sszDomain(uint8_t domainType, const uint8_t* forkVersion, const uint8_t* gvr, uint8_t* domain){
+    uint8_t fields[2][sszChunkSize] = {{0}};
+    uint8_t root[sszChunkSize];
+    memcpy(fields[0], forkVersion, 4);
+    memcpy(fields[1], gvr, sszChunkSize);
+    sszMerkleize(fields, 2, 2, root);
+    memset(domain, 0, 4);
+    domain[0] = domainType;
+    memcpy(domain + 4, root, sszChunkSize - 4);
+}
+
+//compute_signing_root of the specs
+void sszSigningRoot(const uint8_t* objectRoot, const uint8_t* domain, uint8_t* signingRoot){
+    uint8_t fields[2][sszChunkSize];
+    memcpy(fields[0], objectRoot, sszChunkSize);
+    memcpy(fields[1], domain, sszChunkSize);
+    sszMerkleize(fields, 2, 2, signingRoot);
+}
+
+#endif
@@ -0,0 +1,152 @@
+/*
+    A pool of worker threads that serve the connections of the remote signer
+
+    The event loop only waits for readable sockets, or writable ones with a response pending,
+    and pushes them to the queue, the workers read, sign and answer. Connections are registered with EPOLLONESHOT,
+    so a connection is owned by one worker at a time and its requests are answered in order,
+    while requests from different connections are signed in parallel on every core.
+*/
+
+#ifndef workerPool_h
+#define workerPool_h
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "./connection.h"
+
+#define initialQueueSize 64
+
+struct workQueue{
+    struct connection** conns;//Ring buffer of connections ready to be read
+    size_t head;
+    size_t count;
+    size_t size;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+};
+
+struct workerPool{
+    struct workQueue queue;
+    pthread_t* threads;
+    int nThreads;
+    int epollfd;
+    int (*handler)(struct connection* conn);//Returns -1 when the connection has to be closed
+};
+
+/*
+    On success returns 0
+    On error returns -1
+*/
+int pushWork(struct workQueue* queue, struct connection* conn){
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->count == queue->size){
+        size_t newSize = 2*queue->size;
+        struct connection** conns = malloc(newSize * sizeof(struct connection*));
+        if(conns == NULL){
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        for(size_t i = 0; i < queue->count; ++i){
+            conns[i] = queue->conns[(queue->head + i) % queue->size];
+        }
+        free(queue->conns);
+        queue->conns = conns;
+        queue->head = 0;
+        queue->size = newSize;
+    }
+
+    queue->conns[(queue->head + queue->count) % queue->size] = conn;
+    ++queue->count;
+
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+
+    return 0;
+}
+
+struct connection* popWork(struct workQueue* queue){
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == 0){
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    }
+
+    struct connection* conn = queue->conns[queue->head];
+    queue->head = (queue->head + 1) % queue->size;
+    --queue->count;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return conn;
+}
+
+/*
+    Gives the connection back to the event loop once its request has been answered,
+    a response the socket didn't take waits for it to be writable instead
+*/
+void rearmConnection(int epollfd, struct connection* conn){
+    struct epoll_event ev;
+    ev.events = ((conn->out.pending > 0) ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if(epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1){
+        freeConnection(conn);
+    }
+}
+
+void* workerLoop(void* arg){
+    struct workerPool* pool = (struct workerPool*) arg;
+
+    for(;;){
+        struct connection* conn = popWork(&pool->queue);
+
+        if(pool->handler(conn) == -1){
+            epoll_ctl(pool->epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            freeConnection(conn);
+        }else{
+            rearmConnection(pool->epollfd, conn);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Starts one worker per online core when nThreads <= 0
+    On success returns 0
+    On error returns -1
+*/
+int startWorkerPool(struct workerPool* pool, int nThreads, int epollfd, int (*handler)(struct connection* conn)){
+    if(nThreads <= 0){
+        nThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if(nThreads <= 0){
+            nThreads = 1;
+        }
+    }
+
+    pool->queue.conns = malloc(initialQueueSize * sizeof(struct connection*));
+    pool->threads = malloc(nThreads * sizeof(pthread_t));
+    if(pool->queue.conns == NULL || pool->threads == NULL){
+        return -1;
+    }
+    pool->queue.head = 0;
+    pool->queue.count = 0;
+    pool->queue.size = initialQueueSize;
+    pthread_mutex_init(&pool->queue.lock, NULL);
+    pthread_cond_init(&pool->queue.notEmpty, NULL);
+
+    pool->nThreads = nThreads;
+    pool->epollfd = epollfd;
+    pool->handler = handler;
+
+    for(int i = 0; i < nThreads; ++i){
+        if(pthread_create(&pool->threads[i], NULL, workerLoop, pool) != 0){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
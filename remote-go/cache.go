@@ -0,0 +1,103 @@
+package main
+
+import (
+	"container/list"
+	"sync"
+
+	"github.com/protolambda/zrnt/eth2/beacon/common"
+)
+
+//Caches used by getSigningRoot
+//Validators on the same fork sign the same attestation data every slot, so the hash tree root of a
+//signed object and the domain it's signed with are looked up before being computed
+
+//Distinct domains kept, beyond this the cache starts over
+const domainCacheSize = 64
+
+//Hash tree roots kept, the least recently used is evicted first
+const rootCacheSize = 1024
+
+type domainKey struct {
+	domtype common.BLSDomainType
+	fork    common.Fork
+	gvroot  common.Root
+}
+
+type domainCache struct {
+	lock    sync.RWMutex
+	domains map[domainKey]common.BLSDomain
+}
+
+var domains = &domainCache{domains: make(map[domainKey]common.BLSDomain)}
+
+func (c *domainCache) get(domtype common.BLSDomainType, fork *common.Fork, gvroot common.Root) (common.BLSDomain, error) {
+	key := domainKey{domtype, *fork, gvroot}
+
+	c.lock.RLock()
+	dom, ok := c.domains[key]
+	c.lock.RUnlock()
+	if ok {
+		return dom, nil
+	}
+
+	dom, err := fork.GetDomain(domtype, gvroot, fork.Epoch)
+	if err != nil {
+		return dom, err
+	}
+
+	c.lock.Lock()
+	if len(c.domains) >= domainCacheSize {
+		c.domains = make(map[domainKey]common.BLSDomain)
+	}
+	c.domains[key] = dom
+	c.lock.Unlock()
+
+	return dom, nil
+}
+
+//Objects are identified by their type and the SHA-256 of their JSON
+type rootKey struct {
+	domtype common.BLSDomainType
+	sum     [32]byte
+}
+
+type rootEntry struct {
+	key  rootKey
+	root common.Root
+}
+
+type rootCache struct {
+	lock    sync.Mutex
+	order   *list.List //Most recently used first
+	entries map[rootKey]*list.Element
+}
+
+var roots = &rootCache{order: list.New(), entries: make(map[rootKey]*list.Element)}
+
+func (c *rootCache) get(key rootKey) (common.Root, bool) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+
+	elem, ok := c.entries[key]
+	if !ok {
+		return common.Root{}, false
+	}
+	c.order.MoveToFront(elem)
+	return elem.Value.(*rootEntry).root, true
+}
+
+func (c *rootCache) add(key rootKey, root common.Root) {
+	c.lock.Lock()
+	defer c.lock.Unlock()
+
+	if elem, ok := c.entries[key]; ok {
+		c.order.MoveToFront(elem)
+		return
+	}
+	if c.order.Len() >= rootCacheSize {
+		oldest := c.order.Back()
+		c.order.Remove(oldest)
+		delete(c.entries, oldest.Value.(*rootEntry).key)
+	}
+	c.entries[key] = c.order.PushFront(&rootEntry{key, root})
+}
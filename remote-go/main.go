@@ -1,8 +1,8 @@
 package main
 
 import (
-	"bufio"
 	"bytes"
+	"crypto/sha256"
 	"encoding/hex"
 	"encoding/json"
 	"errors"
@@ -11,7 +11,9 @@ import (
 	"log"
 	"net/http"
 	"os"
+	"os/signal"
 	"strings"
+	"syscall"
 
 	"github.com/protolambda/go-keystorev4"
 	"github.com/protolambda/zrnt/eth2/beacon/common"
@@ -19,7 +21,6 @@ import (
 	"github.com/protolambda/zrnt/eth2/configs"
 	"github.com/protolambda/ztyp/tree"
 	"github.com/prysmaticlabs/prysm/shared/keystore"
-	"github.com/tarm/serial"
 )
 
 var sk string
@@ -27,6 +28,9 @@ var pk string
 var pkhex string
 var v bool = false
 
+//Boards the requests are sent to, opened once in main
+var pool *devicePool
+
 //Compatible with Prysm
 func decryptWeb3() error {
 	ks := new(keystore.Keystore)
@@ -50,116 +54,129 @@ func decryptEIP2335(ksjson *[]byte) error {
 	return err
 }
 
+//Body of a signing request, the object to sign is decoded once its type is known
+type signingRequest struct {
+	Type              string          `json:"type"`
+	ForkInfo          *forkInfo       `json:"fork_info"`
+	SigningRoot       *string         `json:"signingRoot"`
+	Block             json.RawMessage `json:"block"`
+	Attestation       json.RawMessage `json:"attestation"`
+	AggregationSlot   json.RawMessage `json:"aggregation_slot"`
+	AggregateAndProof json.RawMessage `json:"aggregate_and_proof"`
+}
+
+type forkInfo struct {
+	Fork                  common.Fork `json:"fork"`
+	GenesisValidatorsRoot string      `json:"genesis_validators_root"`
+}
+
+func blockRoot(body []byte) (common.Root, error) {
+	beaconblock := new(phase0.BeaconBlock)
+	err := json.Unmarshal(body, beaconblock)
+	if err != nil {
+		return common.Root{}, err
+	}
+	sp := configs.Mainnet
+	return beaconblock.HashTreeRoot(sp, tree.GetHashFn()), nil
+}
+
+func attestationRoot(body []byte) (common.Root, error) {
+	attestation := new(phase0.AttestationData)
+	err := json.Unmarshal(body, attestation)
+	if err != nil {
+		return common.Root{}, err
+	}
+	return attestation.HashTreeRoot(tree.GetHashFn()), nil
+}
+
+func aggregationSlotRoot(body []byte) (common.Root, error) {
+	type AggregationSlot struct {
+		Slot common.Slot `json:"slot"`
+	}
+	agslot := new(AggregationSlot)
+	err := json.Unmarshal(body, agslot)
+	if err != nil {
+		return common.Root{}, err
+	}
+	return agslot.Slot.HashTreeRoot(tree.GetHashFn()), nil
+}
+
+func aggregateAndProofRoot(body []byte) (common.Root, error) {
+	agandproof := new(phase0.AggregateAndProof)
+	err := json.Unmarshal(body, agandproof)
+	if err != nil {
+		return common.Root{}, err
+	}
+	sp := configs.Mainnet
+	return agandproof.HashTreeRoot(sp, tree.GetHashFn()), nil
+}
+
 func getSigningRoot(bod []byte, supported *bool, signingroot *[]byte) error {
-	var htr common.Root
+	var req signingRequest
+	var body []byte
 	var domtype common.BLSDomainType
-	var sr common.Root
-	var bodymap map[string]interface{}
-	err := json.Unmarshal(bod, &bodymap)
+	var hashTreeRoot func(body []byte) (common.Root, error)
+	err := json.Unmarshal(bod, &req)
 	if err != nil {
 		return err
 	}
 
-	switch bodymap["type"].(string) {
+	switch req.Type {
 	case "block", "BLOCK":
 		*supported = true
-		body, err := json.Marshal(bodymap["block"])
-		if err != nil {
-			return err
-		}
-
-		beaconblock := new(phase0.BeaconBlock)
-		err = json.Unmarshal(body, beaconblock)
-		if err != nil {
-			return err
-		}
-		sp := configs.Mainnet
-		htr = beaconblock.HashTreeRoot(sp, tree.GetHashFn())
+		body = req.Block
+		hashTreeRoot = blockRoot
 		domtype = common.DOMAIN_BEACON_PROPOSER
-		break
 	case "attestation", "ATTESTATION":
 		*supported = true
-		body, err := json.Marshal(bodymap["attestation"])
-		if err != nil {
-			return err
-		}
-		attestation := new(phase0.AttestationData)
-		err = json.Unmarshal(body, attestation)
-		if err != nil {
-			return err
-		}
-		htr = attestation.HashTreeRoot(tree.GetHashFn())
+		body = req.Attestation
+		hashTreeRoot = attestationRoot
 		domtype = common.DOMAIN_BEACON_ATTESTER
-		break
 	case "aggregation_slot", "AGGREGATION_SLOT":
 		*supported = true
-		body, err := json.Marshal(bodymap["aggregation_slot"])
-		if err != nil {
-			return err
-		}
-		type AggregationSlot struct {
-			Slot common.Slot `json:slot`
-		}
-		agslot := new(AggregationSlot)
-		err = json.Unmarshal(body, agslot)
-		if err != nil {
-			return err
-		}
-		htr = agslot.Slot.HashTreeRoot(tree.GetHashFn())
+		body = req.AggregationSlot
+		hashTreeRoot = aggregationSlotRoot
 		domtype = common.DOMAIN_SELECTION_PROOF
-		break
 	case "aggregate_and_proof", "AGGREGATE_AND_PROOF":
 		*supported = true
-		body, err := json.Marshal(bodymap["aggregate_and_proof"])
-		if err != nil {
-			return err
-		}
-		agandproof := new(phase0.AggregateAndProof)
-		err = json.Unmarshal(body, agandproof)
-		if err != nil {
-			return err
-		}
-		sp := configs.Mainnet
-		htr = agandproof.HashTreeRoot(sp, tree.GetHashFn())
+		body = req.AggregateAndProof
+		hashTreeRoot = aggregateAndProofRoot
 		domtype = common.DOMAIN_AGGREGATE_AND_PROOF
-		break
 	}
 
-	if *supported {
-		forkinfo, err := json.Marshal(bodymap["fork_info"])
-		if err != nil {
-			return err
-		}
-		var forkinfomap map[string]interface{}
-		err = json.Unmarshal(forkinfo, &forkinfomap)
-		if err != nil {
-			return err
-		}
-		fork := new(common.Fork)
-		forkbin, err := json.Marshal(forkinfomap["fork"])
-		err = json.Unmarshal(forkbin, fork)
-		if err != nil {
-			return err
-		}
+	if !*supported {
+		return errors.New("Type not supported")
+	}
+	if req.ForkInfo == nil {
+		return errors.New("Missing fork_info")
+	}
 
-		gvroot, err := hex.DecodeString(forkinfomap["genesis_validators_root"].(string)[2:])
+	//Identical objects are hashed once
+	key := rootKey{domtype, sha256.Sum256(body)}
+	htr, ok := roots.get(key)
+	if !ok {
+		htr, err = hashTreeRoot(body)
 		if err != nil {
 			return err
 		}
-		genvalroot := new(common.Root)
-		copy(genvalroot[:], gvroot[:])
+		roots.add(key, htr)
+	}
 
-		dom, err := fork.GetDomain(domtype, *genvalroot, fork.Epoch)
-		sr = common.ComputeSigningRoot(htr, dom)
-		if err != nil {
-			return err
-		}
-		*signingroot, err = sr.MarshalText()
-		if bodymap["signingRoot"] != nil && bodymap["signingRoot"].(string) != string(*signingroot) {
-			err = errors.New("Incorrect signing root")
-		}
-	} else {
-		err = errors.New("Type not supported")
+	gvroot, err := hex.DecodeString(strings.TrimPrefix(req.ForkInfo.GenesisValidatorsRoot, "0x"))
+	if err != nil {
+		return err
+	}
+	var genvalroot common.Root
+	copy(genvalroot[:], gvroot[:])
+
+	dom, err := domains.get(domtype, &req.ForkInfo.Fork, genvalroot)
+	if err != nil {
+		return err
+	}
+	sr := common.ComputeSigningRoot(htr, dom)
+	*signingroot, err = sr.MarshalText()
+	if req.SigningRoot != nil && *req.SigningRoot != string(*signingroot) {
+		err = errors.New("Incorrect signing root")
 	}
 
 	return err
@@ -167,44 +184,27 @@ func getSigningRoot(bod []byte, supported *bool, signingroot *[]byte) error {
 
 func publicKeysHandler(w http.ResponseWriter, r *http.Request) {
 	if r.Method == http.MethodGet {
-		com := os.Args[1]
-
-		c := &serial.Config{Name: com, Baud: 115200}
-		s, err := serial.OpenPort(c)
-		if err != nil {
-			log.Fatal(err)
-		}
-
-		n, err := s.Write([]byte("shell echo off\nprompt off\ngetkeys\n"))
-		if err != nil {
-			s.Close()
-			log.Fatal(err)
+		keys := pool.Keys()
+		if pool.Healthy() == 0 {
+			w.Header().Set("Content-Type", "application/json")
+			w.WriteHeader(http.StatusInternalServerError)
+			w.Write([]byte("{\"error\": \"No board answered\"}"))
+			return
 		}
-		_ = n
-
-		scanner := bufio.NewScanner(s)
 
 		var b bytes.Buffer
 
-		for scanner.Scan() {
-			if strings.Contains(scanner.Text(), "\"") {
-				b.Write([]byte(scanner.Text()))
-			}
-			if strings.Contains(scanner.Text(), "}") || strings.Contains(scanner.Text(), "stored") {
-				break
+		b.Write([]byte("{\"keys\":["))
+		for i, key := range keys {
+			if i > 0 {
+				b.Write([]byte(", "))
 			}
+			b.Write([]byte("\"" + key + "\""))
 		}
+		b.Write([]byte("]}"))
 		w.Header().Set("Content-Type", "application/json")
 		w.WriteHeader(http.StatusOK)
 		w.Write(b.Bytes())
-
-		n, err = s.Write([]byte("shell echo on\nprompt on\n"))
-		if err != nil {
-			s.Close()
-			log.Fatal(err)
-		}
-		_ = n
-		s.Close()
 	} else {
 		w.Header().Set("Content-Type", "application/json")
 		w.WriteHeader(http.StatusMethodNotAllowed)
@@ -236,43 +236,53 @@ func signHandler(w http.ResponseWriter, r *http.Request) {
 				if v {
 					fmt.Println("Signing root: " + string(signingroot))
 				}
-				com := os.Args[1]
-
-				c := &serial.Config{Name: com, Baud: 115200}
-				s, err := serial.OpenPort(c)
+				//Admitted before the slashing check, so that a shed request doesn't raise the watermarks
+				err = scheduler.admit(scheduler.classify(bod))
 				if err != nil {
-					log.Fatal(err)
+					if v {
+						fmt.Println("Signing refused: " + err.Error())
+					}
+					w.Header().Set("Content-Type", "application/json")
+					w.WriteHeader(http.StatusServiceUnavailable)
+					w.Write([]byte("{\"error\":\"" + err.Error() + "\"}"))
+					return
 				}
-
-				n, err := s.Write([]byte("shell echo off\nprompt off\n"))
-				if err != nil {
-					s.Close()
-					log.Fatal(err)
+				defer scheduler.release()
+				if slashing != nil {
+					err = slashing.check(r.URL.Path[18:], bod)
+					if err != nil {
+						if v {
+							fmt.Println("Signing refused: " + err.Error())
+						}
+						w.Header().Set("Content-Type", "application/json")
+						w.WriteHeader(http.StatusPreconditionFailed)
+						w.Write([]byte("{\"error\":\"Signing operation failed due to slashing protection rules\"}"))
+						return
+					}
 				}
-
 				str := "signature " + r.URL.Path[18:] + " " + string(signingroot) + "\n"
 
-				n, err = s.Write([]byte(str))
-				if err != nil {
-					s.Close()
-					log.Fatal(err)
+				lines, err := pool.Sign(r.URL.Path[18:], str, func(line string) bool {
+					return strings.Contains(line, "0x") || strings.Contains(line, "stored") || strings.Contains(line, "Incorrect")
+				})
+				if err == errKeyNotFound {
+					lines = []string{err.Error()}
+				} else if err != nil {
+					if v {
+						fmt.Println("Signing failed: " + err.Error())
+					}
+					w.Header().Set("Content-Type", "application/json")
+					w.WriteHeader(http.StatusInternalServerError)
+					w.Write([]byte("{\"error\":\"Failed while signing\"}"))
+					return
 				}
 
-				scanner := bufio.NewScanner(s)
-
 				var b bytes.Buffer
 				e := true
 
-				for scanner.Scan() {
-					if strings.Contains(scanner.Text(), "0x") {
-						e = false
-						str = scanner.Text()
-						b.Write([]byte("{\r\n\t\"signature\": \"" + scanner.Text() + "\"\r\n}"))
-						break
-					}
-					if strings.Contains(scanner.Text(), "stored") || strings.Contains(scanner.Text(), "Incorrect") {
-						break
-					}
+				if last := lines[len(lines)-1]; strings.Contains(last, "0x") {
+					e = false
+					b.Write([]byte("{\r\n\t\"signature\": \"" + last + "\"\r\n}"))
 				}
 				if e == false {
 					if v {
@@ -289,15 +299,6 @@ func signHandler(w http.ResponseWriter, r *http.Request) {
 					w.WriteHeader(http.StatusNotFound)
 					w.Write([]byte("{\"error\": \"Key not found: " + r.URL.Path[6:] + "\"}"))
 				}
-
-				n, err = s.Write([]byte("shell echo on\nprompt on\n"))
-				if err != nil {
-					s.Close()
-					log.Fatal(err)
-				}
-				_ = n
-
-				s.Close()
 			} else {
 				if v {
 					fmt.Println("Signing failed")
@@ -361,55 +362,57 @@ func main() {
 		} else {
 			err = decryptWeb3()
 		}
-		if err != nil {
-			fmt.Println("Failed processing keystore")
-		} else {
-			com := os.Args[1]
-
-			c := &serial.Config{Name: com, Baud: 115200}
-			s, err := serial.OpenPort(c)
+		if path := os.Getenv("HSM_SLASHING_DB"); err == nil && path != "" {
+			slashing, err = openSlashingDB(path)
 			if err != nil {
 				log.Fatal(err)
 			}
-
-			n, err := s.Write([]byte("shell echo off\nprompt off\n"))
+			fmt.Println("Slashing protection enabled")
+		}
+		if err != nil {
+			fmt.Println("Failed processing keystore")
+		} else {
+			pool, err = openPool(discoverPorts(os.Args[1]))
 			if err != nil {
-				s.Close()
 				log.Fatal(err)
 			}
-			n, err = s.Write([]byte("import " + sk + "\n"))
+			scheduler, err = openScheduler(len(pool.devices))
 			if err != nil {
-				s.Close()
 				log.Fatal(err)
 			}
-			_ = n
 
-			scanner := bufio.NewScanner(s)
-			e := true
-			for scanner.Scan() {
-				if ((strings.HasPrefix(scanner.Text(), "0x")) && (scanner.Text() == pkhex)) || (strings.Contains(scanner.Text(), "already")) {
-					e = false
-					break
-				} else if strings.HasPrefix(scanner.Text(), "Incorrect") || strings.Contains(scanner.Text(), "reached") {
-					break
+			imported := 0
+			for _, last := range pool.Import("import "+sk+"\n", func(line string) bool {
+				return ((strings.HasPrefix(line, "0x")) && (line == pkhex)) || (strings.Contains(line, "already")) ||
+					strings.HasPrefix(line, "Incorrect") || strings.Contains(line, "reached")
+			}) {
+				if last == pkhex || strings.Contains(last, "already") {
+					imported++
 				}
 			}
-			n, err = s.Write([]byte("shell echo on\nprompt on\n"))
-			if err != nil {
-				s.Close()
-				log.Fatal(err)
-			}
-			s.Close()
-			if e {
+			if imported == 0 {
+				pool.Close()
 				fmt.Println("Failed importing key")
 
 			} else {
-				fmt.Println("Key imported")
+				fmt.Printf("Key imported in %d boards\n", imported)
 				fmt.Println("Starting server at port 80")
-				log.Fatal(http.ListenAndServe(":80", nil))
+
+				//The shell gets its echo and prompt back when the server is stopped
+				stop := make(chan os.Signal, 1)
+				signal.Notify(stop, os.Interrupt, syscall.SIGTERM)
+				go func() {
+					<-stop
+					pool.Close()
+					os.Exit(0)
+				}()
+
+				err = http.ListenAndServe(":80", nil)
+				pool.Close()
+				log.Fatal(err)
 			}
 		}
 	} else {
-		fmt.Println("Usage: " + os.Args[0] + " <comPort> " + "<keystore_path> " + "<keystore_password> " + "[-v]")
+		fmt.Println("Usage: " + os.Args[0] + " <comPort[,comPort...]> " + "<keystore_path> " + "<keystore_password> " + "[-v]")
 	}
 }
@@ -0,0 +1,258 @@
+package main
+
+import (
+	"errors"
+	"log"
+	"path/filepath"
+	"regexp"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+//Pool of the boards behind the signer
+//Every board has its own session. The pool learns which keys each one holds with getkeys and sends
+//a signing request to the least busy healthy board that holds its key. Keys are imported on every board,
+//so each of them signs for every imported key and a board that stops answering is left out until it's back
+
+//Time between two health checks of every board
+const healthInterval = 5 * time.Second
+
+var keyPattern = regexp.MustCompile(`[0-9a-fA-F]{96}`)
+
+var errKeyNotFound = errors.New("No healthy board holds the key")
+
+type device struct {
+	com      string
+	session  *serialSession
+	healthy  bool
+	keys     map[string]bool //Lowercase hex without 0x
+	inflight int64
+}
+
+type devicePool struct {
+	lock        sync.RWMutex
+	connectLock sync.Mutex //Boards are opened and checked one at a time
+	devices     []*device
+	imports     []importCommand //Replayed on the boards that come back
+	next        uint64
+}
+
+type importCommand struct {
+	command string
+	done    func(line string) bool
+}
+
+//Ports are separated by commas and may be patterns, such as /dev/ttyACM*
+func discoverPorts(arg string) []string {
+	var ports []string
+	for _, port := range strings.Split(arg, ",") {
+		matches, err := filepath.Glob(port)
+		if err != nil || len(matches) == 0 {
+			matches = []string{port}
+		}
+		ports = append(ports, matches...)
+	}
+	return ports
+}
+
+//Opens every port, the boards that fail are retried by the health checks
+func openPool(ports []string) (*devicePool, error) {
+	pool := &devicePool{}
+	healthy := 0
+	for _, com := range ports {
+		d := &device{com: com, keys: make(map[string]bool)}
+		pool.devices = append(pool.devices, d)
+		if pool.connect(d) == nil {
+			healthy++
+		}
+	}
+	if healthy == 0 {
+		return nil, errors.New("No board answered")
+	}
+	go pool.healthLoop()
+	return pool, nil
+}
+
+func getKeysDone(line string) bool {
+	return strings.Contains(line, "}") || strings.Contains(line, "stored")
+}
+
+//Opens the session of d if it has none, and learns its keys
+func (pool *devicePool) connect(d *device) error {
+	pool.connectLock.Lock()
+	defer pool.connectLock.Unlock()
+
+	pool.lock.RLock()
+	session := d.session
+	imports := pool.imports
+	pool.lock.RUnlock()
+
+	if session == nil {
+		var err error
+		session, err = openSession(d.com)
+		if err != nil {
+			return err
+		}
+		for _, imp := range imports {
+			session.Do(imp.command, imp.done)
+		}
+	}
+
+	lines, err := session.Do("getkeys\n", getKeysDone)
+	keys := make(map[string]bool)
+	if err == nil {
+		for _, line := range lines {
+			for _, key := range keyPattern.FindAllString(line, -1) {
+				keys[strings.ToLower(key)] = true
+			}
+		}
+	}
+
+	pool.lock.Lock()
+	defer pool.lock.Unlock()
+	if err != nil {
+		//The port is opened again by the next health check
+		if d.healthy {
+			log.Printf("Board %s stopped answering: %v", d.com, err)
+		}
+		d.healthy = false
+		d.session = nil
+		session.Close()
+		return err
+	}
+	if !d.healthy {
+		log.Printf("Board %s is healthy, %d keys", d.com, len(keys))
+	}
+	d.session = session
+	d.keys = keys
+	d.healthy = true
+	return nil
+}
+
+func (pool *devicePool) healthLoop() {
+	for range time.Tick(healthInterval) {
+		for _, d := range pool.devices {
+			pool.connect(d)
+		}
+	}
+}
+
+//Sends command to the least busy healthy board that holds key, and to the next one if it fails
+func (pool *devicePool) Sign(key string, command string, done func(line string) bool) ([]string, error) {
+	key = strings.ToLower(strings.TrimPrefix(key, "0x"))
+	tried := make(map[*device]bool)
+	var lastErr error
+	for {
+		pool.lock.RLock()
+		var best *device
+		var session *serialSession
+		//Boards equally busy take turns
+		start := int(atomic.AddUint64(&pool.next, 1))
+		for i := range pool.devices {
+			d := pool.devices[(start+i)%len(pool.devices)]
+			if d.healthy && d.keys[key] && !tried[d] &&
+				(best == nil || atomic.LoadInt64(&d.inflight) < atomic.LoadInt64(&best.inflight)) {
+				best = d
+				session = d.session
+			}
+		}
+		pool.lock.RUnlock()
+		if best == nil && lastErr != nil {
+			return nil, lastErr
+		} else if best == nil {
+			return nil, errKeyNotFound
+		}
+
+		tried[best] = true
+		atomic.AddInt64(&best.inflight, 1)
+		lines, err := session.Do(command, done)
+		atomic.AddInt64(&best.inflight, -1)
+		if err == nil {
+			return lines, nil
+		}
+		lastErr = err
+		pool.fail(best, session, err)
+	}
+}
+
+func (pool *devicePool) fail(d *device, session *serialSession, err error) {
+	pool.lock.Lock()
+	defer pool.lock.Unlock()
+	if d.session == session && d.healthy {
+		log.Printf("Board %s failed: %v", d.com, err)
+		d.healthy = false
+	}
+}
+
+//Imports a key on every healthy board, and on the boards that join later
+//Returns the last line answered by every board
+func (pool *devicePool) Import(command string, done func(line string) bool) []string {
+	pool.lock.Lock()
+	pool.imports = append(pool.imports, importCommand{command, done})
+	pool.lock.Unlock()
+
+	var last []string
+	for _, d := range pool.devices {
+		pool.lock.RLock()
+		session, healthy := d.session, d.healthy
+		pool.lock.RUnlock()
+		if !healthy {
+			continue
+		}
+		lines, err := session.Do(command, done)
+		if err != nil {
+			pool.fail(d, session, err)
+			continue
+		}
+		last = append(last, lines[len(lines)-1])
+		pool.connect(d)
+	}
+	return last
+}
+
+//Keys held by the healthy boards, sorted
+func (pool *devicePool) Keys() []string {
+	pool.lock.RLock()
+	defer pool.lock.RUnlock()
+	union := make(map[string]bool)
+	for _, d := range pool.devices {
+		if d.healthy {
+			for key := range d.keys {
+				union[key] = true
+			}
+		}
+	}
+	keys := make([]string, 0, len(union))
+	for key := range union {
+		keys = append(keys, key)
+	}
+	sort.Strings(keys)
+	return keys
+}
+
+func (pool *devicePool) Healthy() int {
+	pool.lock.RLock()
+	defer pool.lock.RUnlock()
+	n := 0
+	for _, d := range pool.devices {
+		if d.healthy {
+			n++
+		}
+	}
+	return n
+}
+
+func (pool *devicePool) Close() {
+	pool.lock.Lock()
+	defer pool.lock.Unlock()
+	for _, d := range pool.devices {
+		if d.session != nil {
+			d.session.Close()
+			d.session = nil
+		}
+		d.healthy = false
+	}
+}
@@ -0,0 +1,202 @@
+package main
+
+import (
+	"encoding/json"
+	"errors"
+	"os"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+//Admission control of the signing requests, in front of the boards, like remote-c/scheduler.h
+//A request takes one of the signing tokens, one per board, before it's sent. When they are all taken it waits
+//in the queue of its priority, and a released token goes to the oldest request of the highest priority waiting:
+//blocks, then aggregates and aggregation slots, then attestations and every other type.
+//The queue is bounded and attestations only fill half of it, aggregates three quarters, so that a block always
+//has room. Requests that don't fit are refused at once with a 503. When HSM_GENESIS_TIME gives the genesis time
+//of the chain, a request past the end of its slot is shed with a 503, and one still waiting then gives up
+
+const (
+	priorityBlock = iota
+	priorityAggregate
+	priorityAttestation
+	nPriorities
+)
+
+const defaultSecondsPerSlot = 12
+
+var errOverloaded = errors.New("Too many signing requests waiting")
+var errLate = errors.New("Signing request past the end of its slot")
+
+type signScheduler struct {
+	lock      sync.Mutex
+	tokens    int                          //Free signing tokens, there are none while a request is waiting
+	waiting   [nPriorities][]chan struct{} //Oldest first, a waiter is handed its token through its channel
+	queued    int                          //Waiting requests of every priority
+	maxQueued [nPriorities]int
+	genesis   time.Time //Zero when requests have no deadline
+	slot      time.Duration
+}
+
+// Set in main
+var scheduler *signScheduler
+
+func newScheduler(tokens int, queueSize int, genesis time.Time, slot time.Duration) *signScheduler {
+	s := &signScheduler{tokens: tokens, genesis: genesis, slot: slot}
+	s.maxQueued[priorityBlock] = queueSize
+	s.maxQueued[priorityAggregate] = queueSize - queueSize/4
+	s.maxQueued[priorityAttestation] = queueSize / 2
+	return s
+}
+
+// Reads the settings of the scheduler: HSM_SIGN_QUEUE, the size of the queue (4 per board by default),
+// HSM_GENESIS_TIME in seconds since the Unix epoch and HSM_SECONDS_PER_SLOT (12 by default)
+func openScheduler(boards int) (*signScheduler, error) {
+	queueSize := 4 * boards
+	var genesis time.Time
+	secondsPerSlot := uint64(defaultSecondsPerSlot)
+	if env := os.Getenv("HSM_SIGN_QUEUE"); env != "" {
+		n, err := strconv.Atoi(env)
+		if err != nil || n < 0 {
+			return nil, errors.New("HSM_SIGN_QUEUE isn't a queue size: " + env)
+		}
+		queueSize = n
+	}
+	if env := os.Getenv("HSM_GENESIS_TIME"); env != "" {
+		t, err := strconv.ParseInt(env, 10, 64)
+		if err != nil {
+			return nil, errors.New("HSM_GENESIS_TIME isn't a time: " + env)
+		}
+		genesis = time.Unix(t, 0)
+	}
+	if env := os.Getenv("HSM_SECONDS_PER_SLOT"); env != "" {
+		n, err := strconv.ParseUint(env, 10, 32)
+		if err != nil || n == 0 {
+			return nil, errors.New("HSM_SECONDS_PER_SLOT isn't a slot duration: " + env)
+		}
+		secondsPerSlot = n
+	}
+	return newScheduler(boards, queueSize, genesis, time.Duration(secondsPerSlot)*time.Second), nil
+}
+
+type slotMember struct {
+	Slot string `json:"slot"`
+}
+
+// Returns the priority of the request in body and the end of its slot, zero if it has none
+func (s *signScheduler) classify(body []byte) (int, time.Time) {
+	var req struct {
+		Type              string      `json:"type"`
+		Block             *slotMember `json:"block"`
+		Attestation       *slotMember `json:"attestation"`
+		AggregationSlot   *slotMember `json:"aggregation_slot"`
+		AggregateAndProof *struct {
+			Aggregate struct {
+				Data slotMember `json:"data"`
+			} `json:"aggregate"`
+		} `json:"aggregate_and_proof"`
+	}
+	if json.Unmarshal(body, &req) != nil {
+		return priorityAttestation, time.Time{}
+	}
+
+	priority := priorityAttestation
+	var slot *slotMember
+	switch strings.ToUpper(req.Type) {
+	case "BLOCK":
+		priority = priorityBlock
+		slot = req.Block
+	case "AGGREGATION_SLOT":
+		priority = priorityAggregate
+		slot = req.AggregationSlot
+	case "AGGREGATE_AND_PROOF":
+		priority = priorityAggregate
+		if req.AggregateAndProof != nil {
+			slot = &req.AggregateAndProof.Aggregate.Data
+		}
+	case "ATTESTATION":
+		slot = req.Attestation
+	}
+	if slot == nil || s.genesis.IsZero() {
+		return priority, time.Time{}
+	}
+	n, err := strconv.ParseUint(slot.Slot, 10, 64)
+	//Slots so far in the future that the deadline would overflow never expire
+	if err != nil || n >= uint64(1<<62)/uint64(s.slot) {
+		return priority, time.Time{}
+	}
+	return priority, s.genesis.Add(time.Duration(n+1) * s.slot)
+}
+
+// Hands the free token to the oldest waiter of the highest priority, called with the lock held
+func (s *signScheduler) handOn() {
+	for p := range s.waiting {
+		if s.tokens > 0 && len(s.waiting[p]) > 0 {
+			turn := s.waiting[p][0]
+			s.waiting[p] = s.waiting[p][1:]
+			s.queued--
+			s.tokens--
+			turn <- struct{}{}
+			return
+		}
+	}
+}
+
+// Takes a signing token for a request of priority, waiting for it until deadline (zero for no deadline)
+// On success the token has to be given back with release, otherwise returns errOverloaded or errLate
+func (s *signScheduler) admit(priority int, deadline time.Time) error {
+	if !deadline.IsZero() && !time.Now().Before(deadline) {
+		return errLate
+	}
+
+	s.lock.Lock()
+	if s.tokens > 0 {
+		s.tokens--
+		s.lock.Unlock()
+		return nil
+	}
+	if s.queued >= s.maxQueued[priority] {
+		s.lock.Unlock()
+		return errOverloaded
+	}
+	turn := make(chan struct{}, 1)
+	s.waiting[priority] = append(s.waiting[priority], turn)
+	s.queued++
+	s.lock.Unlock()
+
+	var expired <-chan time.Time
+	if !deadline.IsZero() {
+		timer := time.NewTimer(time.Until(deadline))
+		defer timer.Stop()
+		expired = timer.C
+	}
+	select {
+	case <-turn:
+		return nil
+	case <-expired:
+	}
+
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	for i, c := range s.waiting[priority] {
+		if c == turn {
+			s.waiting[priority] = append(s.waiting[priority][:i], s.waiting[priority][i+1:]...)
+			s.queued--
+			return errLate
+		}
+	}
+	//The token was handed over just before the deadline, it goes to the next waiter
+	<-turn
+	s.tokens++
+	s.handOn()
+	return errLate
+}
+
+func (s *signScheduler) release() {
+	s.lock.Lock()
+	s.tokens++
+	s.handOn()
+	s.lock.Unlock()
+}
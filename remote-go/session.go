@@ -0,0 +1,204 @@
+package main
+
+import (
+	"bufio"
+	"errors"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/tarm/serial"
+)
+
+//Time the board has to finish a response before the request fails
+const responseTimeout = 5 * time.Second
+
+//Pending requests beyond this block the HTTP handlers that send them
+const sessionQueueSize = 64
+
+//A board in the lowpower mode suspends its console after a second without a command, and the byte that wakes
+//it is lost. A session quiet for wakeAfter sends a newline first, and waits wakeDelay for the UART to resume
+const wakeAfter = 500 * time.Millisecond
+const wakeDelay = 5 * time.Millisecond
+
+//Requests of a session closed by the health check fail with it, so that their handlers try another board
+var errSessionClosed = errors.New("Session closed")
+
+//A command for the board. The response is over on the first line for which done returns true
+type serialRequest struct {
+	command string
+	done    func(line string) bool
+	reply   chan serialReply
+}
+
+type serialReply struct {
+	lines []string
+	err   error
+}
+
+//Serial session shared by every HTTP handler
+//The port is opened and the shell is put in raw mode once, then one dispatcher goroutine owns it:
+//requests are queued, written one at a time and each gets back the lines the board answered on its own
+//reply channel. The shell answers strictly in order, so the lines read after a command are its response
+type serialSession struct {
+	port     *serial.Port
+	requests chan *serialRequest
+	lines    chan string
+	readErr  chan error
+	closed   chan struct{}
+	closing  sync.Once
+	err      error //Set once the port fails, every request fails afterwards
+	stale    bool
+	lastUsed time.Time //End of the last exchange, the board may have gone to sleep since
+}
+
+func openSession(com string) (*serialSession, error) {
+	c := &serial.Config{Name: com, Baud: 115200}
+	s, err := serial.OpenPort(c)
+	if err != nil {
+		return nil, err
+	}
+
+	_, err = s.Write([]byte("\n"))
+	if err == nil {
+		time.Sleep(wakeDelay)
+		_, err = s.Write([]byte("shell echo off\nprompt off\n"))
+	}
+	if err != nil {
+		s.Close()
+		return nil, err
+	}
+
+	session := &serialSession{
+		port:     s,
+		requests: make(chan *serialRequest, sessionQueueSize),
+		lines:    make(chan string, sessionQueueSize),
+		readErr:  make(chan error, 1),
+		closed:   make(chan struct{}),
+		lastUsed: time.Now(),
+	}
+	go session.readLoop()
+	go session.dispatch()
+
+	return session, nil
+}
+
+//Sends command and waits for its response
+func (session *serialSession) Do(command string, done func(line string) bool) ([]string, error) {
+	req := &serialRequest{command: command, done: done, reply: make(chan serialReply, 1)}
+	select {
+	case session.requests <- req:
+	case <-session.closed:
+		return nil, errSessionClosed
+	}
+	select {
+	case rep := <-req.reply:
+		return rep.lines, rep.err
+	case <-session.closed:
+		return nil, errSessionClosed
+	}
+}
+
+//Gives the shell back its echo and prompt, requests fail afterwards
+func (session *serialSession) Close() {
+	session.closing.Do(func() {
+		close(session.closed)
+		session.port.Write([]byte("shell echo on\nprompt on\n"))
+		session.port.Close()
+	})
+}
+
+func (session *serialSession) readLoop() {
+	scanner := bufio.NewScanner(session.port)
+	for scanner.Scan() {
+		select {
+		case session.lines <- scanner.Text():
+		case <-session.closed:
+			return
+		}
+	}
+	err := scanner.Err()
+	if err == nil {
+		err = errors.New("Serial port closed")
+	}
+	session.readErr <- err
+}
+
+func (session *serialSession) dispatch() {
+	for {
+		select {
+		case req := <-session.requests:
+			lines, err := session.exchange(req)
+			req.reply <- serialReply{lines: lines, err: err}
+		case <-session.closed:
+			//Nothing reads the queue afterwards, the requests still in it are answered here
+			for {
+				select {
+				case req := <-session.requests:
+					req.reply <- serialReply{err: errSessionClosed}
+				default:
+					return
+				}
+			}
+		}
+	}
+}
+
+func (session *serialSession) exchange(req *serialRequest) ([]string, error) {
+	if session.err != nil {
+		return nil, session.err
+	}
+	if session.stale {
+		session.drain()
+	}
+	defer func() { session.lastUsed = time.Now() }()
+
+	var err error
+	wake := time.Since(session.lastUsed) > wakeAfter
+	if wake {
+		_, err = session.port.Write([]byte("\n"))
+		time.Sleep(wakeDelay)
+	}
+	if err == nil {
+		_, err = session.port.Write([]byte(req.command))
+	}
+	if err != nil {
+		session.err = err
+		return nil, err
+	}
+
+	var lines []string
+	timeout := time.After(responseTimeout)
+	for {
+		select {
+		case line := <-session.lines:
+			//An awake shell answers the wake newline with an empty line
+			if wake && len(lines) == 0 && strings.TrimSpace(line) == "" {
+				continue
+			}
+			lines = append(lines, line)
+			if req.done(line) {
+				return lines, nil
+			}
+		case err := <-session.readErr:
+			session.err = err
+			return nil, err
+		case <-timeout:
+			//The rest of this response would be read as the start of the next one
+			session.stale = true
+			return nil, errors.New("Timed out waiting for the board")
+		}
+	}
+}
+
+//Discards what is left of a timed out response, until the board has been quiet for a while
+func (session *serialSession) drain() {
+	for {
+		select {
+		case <-session.lines:
+		case <-time.After(200 * time.Millisecond):
+			session.stale = false
+			return
+		}
+	}
+}
@@ -0,0 +1,251 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/hex"
+	"encoding/json"
+	"errors"
+	"os"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+)
+
+//Slashing protection of the signer, enabled by naming its database in HSM_SLASHING_DB
+//It's the file of remote-c (see remote-c/slashing.h): for every public key, the highest block slot and the
+//highest attestation source and target epochs signed, mapped in memory. Nothing lower is signed again.
+//Checks don't lock, every watermark is raised with a compare and swap, and only the first request
+//of a key takes the lock to add its record. EIP-3076 files are imported and exported with remote-c
+
+const (
+	slashingMagic      = "SLASHDB1"
+	slashingCapacity   = 65536
+	slashingHeaderSize = 64
+	slashingRecordSize = 72
+	slashingPkSize     = 48
+	slashingRootSize   = 32
+
+	//Offsets in the header and in every record
+	offsetCapacity    = 8
+	offsetGvrSet      = 12
+	offsetGvr         = 16
+	offsetUsed        = 48
+	offsetBlock       = 56
+	offsetAttestation = 64
+)
+
+var errSlashable = errors.New("Refused by the slashing protection")
+
+type slashingDB struct {
+	data     []byte
+	capacity uint32
+	lock     sync.Mutex //Taken to add records and to set the genesis validators root
+}
+
+//Nil unless HSM_SLASHING_DB names a database
+var slashing *slashingDB
+
+//Opens the database in path, it's created if it doesn't exist
+func openSlashingDB(path string) (*slashingDB, error) {
+	f, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	st, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	size := st.Size()
+	if size == 0 {
+		size = slashingHeaderSize + slashingCapacity*slashingRecordSize
+		err = f.Truncate(size)
+		if err != nil {
+			return nil, err
+		}
+	}
+	data, err := syscall.Mmap(int(f.Fd()), 0, int(size), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+	if st.Size() == 0 {
+		copy(data, slashingMagic)
+		binary.LittleEndian.PutUint32(data[offsetCapacity:], slashingCapacity)
+	}
+
+	db := &slashingDB{data: data, capacity: binary.LittleEndian.Uint32(data[offsetCapacity:])}
+	if string(data[:8]) != slashingMagic || db.capacity == 0 || db.capacity&(db.capacity-1) != 0 ||
+		size < slashingHeaderSize+int64(db.capacity)*slashingRecordSize {
+		syscall.Munmap(data)
+		return nil, errors.New("Not a slashing protection database: " + path)
+	}
+	return db, nil
+}
+
+func (db *slashingDB) word32(offset int) *uint32 {
+	return (*uint32)(unsafe.Pointer(&db.data[offset]))
+}
+
+func (db *slashingDB) word64(offset int) *uint64 {
+	return (*uint64)(unsafe.Pointer(&db.data[offset]))
+}
+
+//Returns the offset of the record of pk, which is added if it has none, or -1 if the database is full
+func (db *slashingDB) record(pk []byte) int {
+	mask := db.capacity - 1
+	home := binary.BigEndian.Uint32(pk[slashingPkSize-4:]) & mask
+	pos := home
+
+	//Records are never removed, so the first free one ends the search
+	for {
+		offset := slashingHeaderSize + int(pos)*slashingRecordSize
+		if atomic.LoadUint32(db.word32(offset+offsetUsed)) == 0 {
+			break
+		}
+		if bytes.Equal(db.data[offset:offset+slashingPkSize], pk) {
+			return offset
+		}
+		pos = (pos + 1) & mask
+		if pos == home {
+			return -1
+		}
+	}
+
+	//Another request may be adding the same key, so it's searched again while the lock is held
+	db.lock.Lock()
+	defer db.lock.Unlock()
+	for {
+		offset := slashingHeaderSize + int(pos)*slashingRecordSize
+		if atomic.LoadUint32(db.word32(offset+offsetUsed)) == 0 {
+			copy(db.data[offset:offset+slashingPkSize], pk)
+			atomic.StoreUint32(db.word32(offset+offsetUsed), 1)
+			return offset
+		}
+		if bytes.Equal(db.data[offset:offset+slashingPkSize], pk) {
+			return offset
+		}
+		pos = (pos + 1) & mask
+		if pos == home {
+			return -1
+		}
+	}
+}
+
+//Signatures are only made for a single chain, the first one seen or imported
+func (db *slashingDB) checkRoot(gvr []byte) error {
+	if atomic.LoadUint32(db.word32(offsetGvrSet)) == 0 {
+		db.lock.Lock()
+		if atomic.LoadUint32(db.word32(offsetGvrSet)) == 0 {
+			copy(db.data[offsetGvr:offsetGvr+slashingRootSize], gvr)
+			atomic.StoreUint32(db.word32(offsetGvrSet), 1)
+		}
+		db.lock.Unlock()
+	}
+	if !bytes.Equal(db.data[offsetGvr:offsetGvr+slashingRootSize], gvr) {
+		return errSlashable
+	}
+	return nil
+}
+
+func (db *slashingDB) checkBlock(pk []byte, slot uint64) error {
+	offset := db.record(pk)
+	if offset == -1 || slot >= ^uint64(0)-1 {
+		return errSlashable
+	}
+	watermark := db.word64(offset + offsetBlock)
+	for {
+		last := atomic.LoadUint64(watermark)
+		if last != 0 && slot+1 <= last {
+			return errSlashable
+		}
+		if atomic.CompareAndSwapUint64(watermark, last, slot+1) {
+			return nil
+		}
+	}
+}
+
+//The watermark packs target + 1 and source + 1, so both are raised at once
+func (db *slashingDB) checkAttestation(pk []byte, source uint64, target uint64) error {
+	offset := db.record(pk)
+	if offset == -1 || source > target || target >= 0xffffffff {
+		return errSlashable
+	}
+	watermark := db.word64(offset + offsetAttestation)
+	next := (target+1)<<32 | (source + 1)
+	for {
+		last := atomic.LoadUint64(watermark)
+		//Neither a double vote nor a surrounded vote: the source can't go back and the target must move on
+		if last != 0 && (source+1 < last&0xffffffff || target+1 <= last>>32) {
+			return errSlashable
+		}
+		if atomic.CompareAndSwapUint64(watermark, last, next) {
+			return nil
+		}
+	}
+}
+
+type epochCheckpoint struct {
+	Epoch string `json:"epoch"`
+}
+
+//Checks a signing request of the key pkHex, blocks and attestations raise the watermarks of the key
+func (db *slashingDB) check(pkHex string, body []byte) error {
+	var req struct {
+		Type     string `json:"type"`
+		ForkInfo *struct {
+			GenesisValidatorsRoot string `json:"genesis_validators_root"`
+		} `json:"fork_info"`
+		Block *struct {
+			Slot string `json:"slot"`
+		} `json:"block"`
+		Attestation *struct {
+			Source epochCheckpoint `json:"source"`
+			Target epochCheckpoint `json:"target"`
+		} `json:"attestation"`
+	}
+	err := json.Unmarshal(body, &req)
+	if err != nil {
+		return err
+	}
+	isBlock := strings.EqualFold(req.Type, "block")
+	isAttestation := strings.EqualFold(req.Type, "attestation")
+	if !isBlock && !isAttestation {
+		return nil
+	}
+
+	pk, err := hex.DecodeString(strings.TrimPrefix(pkHex, "0x"))
+	if err != nil || len(pk) != slashingPkSize || req.ForkInfo == nil {
+		return errSlashable
+	}
+	gvr, err := hex.DecodeString(strings.TrimPrefix(req.ForkInfo.GenesisValidatorsRoot, "0x"))
+	if err != nil || len(gvr) != slashingRootSize || db.checkRoot(gvr) != nil {
+		return errSlashable
+	}
+
+	if isBlock {
+		if req.Block == nil {
+			return errSlashable
+		}
+		slot, err := strconv.ParseUint(req.Block.Slot, 10, 64)
+		if err != nil {
+			return errSlashable
+		}
+		return db.checkBlock(pk, slot)
+	}
+	if req.Attestation == nil {
+		return errSlashable
+	}
+	source, err := strconv.ParseUint(req.Attestation.Source.Epoch, 10, 64)
+	if err != nil {
+		return errSlashable
+	}
+	target, err := strconv.ParseUint(req.Attestation.Target.Epoch, 10, 64)
+	if err != nil {
+		return errSlashable
+	}
+	return db.checkAttestation(pk, source, target)
+}
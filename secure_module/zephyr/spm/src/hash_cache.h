@@ -0,0 +1,75 @@
+/*
+ * Cache of hashed messages of the secure module
+ *
+ * Points of the last hashed messages. Every local key signs the same signing
+ * root of an attestation, so hash to curve, the slowest part of a signature,
+ * is done once per message. Direct mapped on the SHA-256 of the message, a
+ * miss replaces the entry.
+ *
+ * Only the secure image and the emulators, which include the secure module,
+ * sign messages, so the cache isn't part of the nonsecure firmware.
+ */
+
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#ifdef EMU
+#include <pthread.h>
+#endif
+
+#ifndef HASH_CACHE_SIZE
+#ifdef EMU
+#define HASH_CACHE_SIZE 256
+#else
+#define HASH_CACHE_SIZE 16 //About 330 bytes each
+#endif
+#endif
+
+struct hash_cache_entry{
+        byte digest[32];
+        uint8_t used;
+        blst_p2 point;
+};
+
+struct hash_cache_entry hash_cache[HASH_CACHE_SIZE];
+
+#ifdef EMU
+pthread_mutex_t hash_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define hash_cache_lock() pthread_mutex_lock(&hash_cache_mutex)
+#define hash_cache_unlock() pthread_mutex_unlock(&hash_cache_mutex)
+#else
+//Secure calls run one at a time on the board
+#define hash_cache_lock()
+#define hash_cache_unlock()
+#endif
+
+void get_point_from_msg(blst_p2* hash, uint8_t* msg_bin, int len){
+        char dst[] = "BLS_SIG_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_"; //IETF BLS Signature V4
+        byte digest[32];
+
+        blst_sha256(digest, msg_bin, len);
+        struct hash_cache_entry* entry = &hash_cache[(digest[0] | (digest[1] << 8)) % HASH_CACHE_SIZE];
+
+        hash_cache_lock();
+        int hit = entry->used && (memcmp(entry->digest, digest, sizeof(digest)) == 0);
+        if(hit){
+            *hash = entry->point;
+        }
+        hash_cache_unlock();
+        if(hit){
+            return;
+        }
+
+        //Obtain the point from a message, out of the lock
+        blst_hash_to_g2(hash, msg_bin, len, dst, sizeof(dst)-1, NULL, 0);
+
+        hash_cache_lock();
+        memcpy(entry->digest, digest, sizeof(digest));
+        entry->point = *hash;
+        entry->used = 1;
+        hash_cache_unlock();
+}
+
+#endif
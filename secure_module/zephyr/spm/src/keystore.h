@@ -0,0 +1,345 @@
+/*
+ * Keystore of the secure module
+ *
+ * Keys live in a pool of slots, the key handle is the slot number. Deleted
+ * slots are chained in a free list and reused before the pool grows. The
+ * firmware uses a fixed pool of KEYSTORE_CAPACITY slots in secure SRAM, the
+ * emulator starts with KEYSTORE_CAPACITY slots and doubles the pool whenever
+ * it is full.
+ *
+ * Every slot also caches the public data of its key, computed once when the
+ * key is generated or imported: the affine point used by verify, the 48 bytes
+ * compressed point and its hex string, served by getkeys. Keys loaded from
+ * flash at boot only have the compressed point, affine_ready tells whether
+ * the affine point has been decompressed yet (see persist.h).
+ *
+ * Public keys are indexed with an open addressing hash table (linear probing)
+ * from compressed public key to slot. Compressed public keys are x
+ * coordinates of random points, so their low bytes are already uniformly
+ * distributed and are used directly as hash.
+ *
+ * Keys can also be derived with EIP-2333 from a seed stored once. Only the
+ * m/12381/3600 node of its tree is kept, and every slot of a derived key
+ * remembers the validator index it was derived for, so deriving it again
+ * finds the slot instead of repeating the derivation. Importing another seed
+ * clears those indices, the keys stay stored as if they had been imported.
+ *
+ * Nothing here locks, callers must hold the keystore lock.
+ */
+
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+#include <stdint.h>
+#include <string.h>
+#ifdef EMU
+#include <stdlib.h>
+#include <pthread.h>
+#endif
+
+#define PK_SIZE 48
+
+#ifndef KEYSTORE_CAPACITY
+#ifdef EMU
+#define KEYSTORE_CAPACITY 16 //Initial number of slots
+#else
+#define KEYSTORE_CAPACITY 64 //Number of slots, about 280 bytes each
+#endif
+#endif
+
+#ifndef EMU
+#ifndef KEYSTORE_INDEX_SIZE
+#define KEYSTORE_INDEX_SIZE 128
+#endif
+_Static_assert(((KEYSTORE_INDEX_SIZE & (KEYSTORE_INDEX_SIZE - 1)) == 0) && (KEYSTORE_INDEX_SIZE >= 2*KEYSTORE_CAPACITY),
+        "KEYSTORE_INDEX_SIZE must be a power of two and at least twice KEYSTORE_CAPACITY");
+#endif
+
+#define INDEX_EMPTY 0 //Index entries store slot + 1
+#define NO_SLOT UINT32_MAX
+
+#define SLOT_FREE 0
+#define SLOT_USED 1
+
+//Public data of a key
+struct key_public{
+        blst_p1_affine pk_affine;
+        uint8_t pk[PK_SIZE];
+        char pk_hex[2*PK_SIZE + 1];
+};
+
+struct key_slot{
+        blst_scalar sk;
+        blst_p1_affine pk_affine;
+        uint8_t pk[PK_SIZE];
+        char pk_hex[2*PK_SIZE];
+        uint8_t affine_ready;
+        uint8_t state;
+        uint32_t next_free;
+        uint64_t derivation; //EIP-2334 validator index + 1 of a derived key, 0 otherwise, wide enough for index 2^32 - 1
+};
+
+#ifdef EMU
+struct key_slot* slots = NULL;
+uint32_t* pk_index = NULL;
+uint32_t slots_capacity = 0;
+uint32_t index_size = 0;
+#else
+struct key_slot slots[KEYSTORE_CAPACITY];
+uint32_t pk_index[KEYSTORE_INDEX_SIZE];
+const uint32_t slots_capacity = KEYSTORE_CAPACITY;
+const uint32_t index_size = KEYSTORE_INDEX_SIZE;
+#endif
+uint32_t slots_used = 0; //Slots taken from the pool so far, free or not
+uint32_t free_head = NO_SLOT;
+
+//Node m/12381/3600 of the EIP-2333 tree of the stored seed
+blst_scalar wallet_node;
+uint8_t wallet_ready = 0;
+
+static inline uint32_t pk_hash(const uint8_t* public_key){
+        return ((uint32_t) public_key[PK_SIZE - 4] << 24) | ((uint32_t) public_key[PK_SIZE - 3] << 16) |
+               ((uint32_t) public_key[PK_SIZE - 2] << 8) | (uint32_t) public_key[PK_SIZE - 1];
+}
+
+//Returns the slot of public_key or -1 if it isn't indexed
+int index_find(const uint8_t* public_key){
+        if(index_size == 0){
+            return -1;
+        }
+
+        uint32_t mask = index_size - 1;
+        uint32_t pos = pk_hash(public_key) & mask;
+
+        while(pk_index[pos] != INDEX_EMPTY){
+            int key = pk_index[pos] - 1;
+            if(memcmp(slots[key].pk, public_key, PK_SIZE) == 0){
+                return key;
+            }
+            pos = (pos + 1) & mask;
+        }
+
+        return -1;
+}
+
+void index_insert(int key){
+        uint32_t mask = index_size - 1;
+        uint32_t pos = pk_hash(slots[key].pk) & mask;
+
+        while(pk_index[pos] != INDEX_EMPTY){
+            pos = (pos + 1) & mask;
+        }
+        pk_index[pos] = key + 1;
+}
+
+void index_remove(int key){
+        uint32_t mask = index_size - 1;
+        uint32_t pos = pk_hash(slots[key].pk) & mask;
+
+        while(pk_index[pos] != (uint32_t) key + 1){
+            if(pk_index[pos] == INDEX_EMPTY){
+                return;
+            }
+            pos = (pos + 1) & mask;
+        }
+
+        //Backward shift deletion: move back the entries of the cluster that can't be reached past the hole
+        pk_index[pos] = INDEX_EMPTY;
+        for(uint32_t next = (pos + 1) & mask; pk_index[next] != INDEX_EMPTY; next = (next + 1) & mask){
+            uint32_t home = pk_hash(slots[pk_index[next] - 1].pk) & mask;
+            if(((next - home) & mask) >= ((next - pos) & mask)){
+                pk_index[pos] = pk_index[next];
+                pk_index[next] = INDEX_EMPTY;
+                pos = next;
+            }
+        }
+}
+
+#ifdef EMU
+//Doubles the pool and rebuilds the index. Returns -1 if memory is exhausted, the keystore is left as it was
+int keystore_grow(){
+        uint32_t capacity = (slots_capacity == 0) ? KEYSTORE_CAPACITY : 2*slots_capacity;
+        uint32_t new_index_size = 2*capacity;
+
+        //Both are allocated before the capacity changes, a pool larger than its index would fill the index up
+        uint32_t* new_index = calloc(new_index_size, sizeof(uint32_t));
+        if(new_index == NULL){
+            return -1;
+        }
+        struct key_slot* new_slots = realloc(slots, capacity * sizeof(struct key_slot));
+        if(new_slots == NULL){
+            free(new_index);
+            return -1;
+        }
+        slots = new_slots;
+        memset(slots + slots_capacity, 0, (capacity - slots_capacity) * sizeof(struct key_slot));
+        slots_capacity = capacity;
+
+        free(pk_index);
+        pk_index = new_index;
+        index_size = new_index_size;
+        for(uint32_t i = 0; i < slots_used; i++){
+            if(slots[i].state == SLOT_USED){
+                index_insert(i);
+            }
+        }
+
+        return 0;
+}
+#endif
+
+#ifdef EMU
+//Fixed-base table of the generator: g1_table[i][j - 1] = j * 2^(8i) * G, so sk * G is the sum of an entry
+//per nonzero byte of sk, 32 additions instead of a scalar multiplication. The table (780 kB) is built on
+//the first key. Its lookups depend on the secret key, which is fine in the emulator only: the firmware
+//keeps the constant time multiplication of blst
+#define G1_TABLE_WINDOWS 32
+#define G1_TABLE_ENTRIES 255
+
+static blst_p1_affine (*g1_table)[G1_TABLE_ENTRIES] = NULL;
+static pthread_once_t g1_table_once = PTHREAD_ONCE_INIT;
+
+static void g1_table_init(){
+        blst_p1* points = malloc(G1_TABLE_WINDOWS * G1_TABLE_ENTRIES * sizeof(blst_p1));
+        blst_p1_affine (*table)[G1_TABLE_ENTRIES] = malloc(G1_TABLE_WINDOWS * sizeof(*table));
+        if(points == NULL || table == NULL){
+            free(points);
+            free(table);
+            return;
+        }
+
+        blst_p1 base = *blst_p1_generator();
+        for(int i = 0; i < G1_TABLE_WINDOWS; i++){
+            blst_p1* row = points + i*G1_TABLE_ENTRIES;
+            row[0] = base;
+            for(int j = 1; j < G1_TABLE_ENTRIES; j++){
+                blst_p1_add_or_double(&row[j], &row[j - 1], &base);
+            }
+            blst_p1_add_or_double(&base, &row[G1_TABLE_ENTRIES - 1], &base); //256 times the base of the row
+        }
+
+        //A single batch inversion for the whole table, points are contiguous after the first one
+        const blst_p1* first[] = {points, NULL};
+        blst_p1s_to_affine(table[0], first, G1_TABLE_WINDOWS * G1_TABLE_ENTRIES);
+        free(points);
+        g1_table = table;
+}
+
+//The bytes of blst_scalar are little endian, byte i selects the row of 2^(8i) * G
+static void sk_to_pk_fixed_base(blst_p1* pk, const blst_scalar* sk){
+        int started = 0;
+
+        for(int i = 0; i < G1_TABLE_WINDOWS; i++){
+            uint8_t digit = sk->b[i];
+            if(digit == 0){
+                continue;
+            }
+            if(started){
+                blst_p1_add_or_double_affine(pk, pk, &g1_table[i][digit - 1]);
+            }else{
+                blst_p1_from_affine(pk, &g1_table[i][digit - 1]);
+                started = 1;
+            }
+        }
+}
+#endif
+
+//Computes the public data of sk. It's the expensive part of storing a key, so it's done without holding the lock
+void key_public_from_sk(struct key_public* pub, const blst_scalar* sk){
+        blst_p1 pk;
+
+#ifdef EMU
+        pthread_once(&g1_table_once, g1_table_init);
+        if(g1_table != NULL){
+            sk_to_pk_fixed_base(&pk, sk);
+        }else{
+            blst_sk_to_pk_in_g1(&pk, sk);
+        }
+#else
+        blst_sk_to_pk_in_g1(&pk, sk);
+#endif
+        blst_p1_to_affine(&pub->pk_affine, &pk);
+        blst_p1_affine_compress(pub->pk, &pub->pk_affine);
+        hex_encode(pub->pk, PK_SIZE, pub->pk_hex);
+}
+
+//Returns a free slot, taken from the free list when possible, or -1 if the keystore is full
+int slot_alloc(){
+        uint32_t key;
+
+        if(free_head != NO_SLOT){
+            key = free_head;
+            free_head = slots[key].next_free;
+        }else{
+            if(slots_used == slots_capacity){
+#ifdef EMU
+                if(keystore_grow() != 0){
+                    return -1;
+                }
+#else
+                return -1;
+#endif
+            }
+            key = slots_used++;
+        }
+
+        return key;
+}
+
+//Stores the key in a free slot and indexes it. Returns the slot or -1 if the keystore is full
+int slot_store(const blst_scalar* sk, const struct key_public* pub){
+        int key = slot_alloc();
+
+        if(key != -1){
+            slots[key].sk = *sk;
+            slots[key].pk_affine = pub->pk_affine;
+            memcpy(slots[key].pk, pub->pk, PK_SIZE);
+            memcpy(slots[key].pk_hex, pub->pk_hex, 2*PK_SIZE);
+            slots[key].affine_ready = 1;
+            slots[key].state = SLOT_USED;
+            index_insert(key);
+        }
+
+        return key;
+}
+
+void slot_free(int key){
+        index_remove(key);
+        memset(&slots[key], 0, sizeof(struct key_slot));
+        slots[key].next_free = free_head;
+        free_head = key;
+}
+
+//Returns the slot of the key derived for the validator index or -1 if it hasn't been derived
+int slot_find_derived(uint32_t index){
+        for(uint32_t key = 0; key < slots_used; key++){
+            if(slots[key].state == SLOT_USED && slots[key].derivation == (uint64_t) index + 1){
+                return key;
+            }
+        }
+        return -1;
+}
+
+//Returns the first used slot from *cursor on and moves the cursor past it, -1 at the end
+int slot_next(int* cursor){
+        while((uint32_t) *cursor < slots_used){
+            int key = (*cursor)++;
+            if(slots[key].state == SLOT_USED){
+                return key;
+            }
+        }
+        return -1;
+}
+
+void keystore_clear(){
+        if(slots_capacity != 0){
+            memset(slots, 0, slots_capacity * sizeof(struct key_slot));
+            memset(pk_index, 0, index_size * sizeof(uint32_t));
+        }
+        slots_used = 0;
+        free_head = NO_SLOT;
+        memset(&wallet_node, 0, sizeof(wallet_node));
+        wallet_ready = 0;
+}
+
+#endif
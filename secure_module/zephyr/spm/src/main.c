@@ -58,169 +58,538 @@
 #include <common.h>
 #endif
 
+#include "keystore.h"
+#include "hash_cache.h"
 
-blst_scalar sk;
-blst_scalar secret_keys_store[10];
-blst_scalar sk_sign;
-char public_keys_hex_store[960];
-int keystore_size = 0;
+
+#ifdef EMU
+#include <pthread.h>
+
+//The emulator serves requests from several threads: lookups and signatures only read
+//the keystore, so they share the lock and any key can be used on any thread at once
+pthread_rwlock_t keystore_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define keystore_rdlock() pthread_rwlock_rdlock(&keystore_lock)
+#define keystore_wrlock() pthread_rwlock_wrlock(&keystore_lock)
+#define keystore_unlock() pthread_rwlock_unlock(&keystore_lock)
+#else
+#define keystore_rdlock()
+#define keystore_wrlock()
+#define keystore_unlock()
+#endif
+
+//Keys are referred to by their slot in the keystore (key handle) instead of
+//being copied into a global, so concurrent requests don't overwrite each other
+int keystore_size = 0; //Number of keys stored
+
+#include "persist.h"
+
+#ifndef EMU
+#include <arch/arm/aarch32/cortex_m/cmse.h>
+#endif
+
+//Buffers passed by the nonsecure firmware must be nonsecure memory, or the nonsecure
+//firmware could make the module read or overwrite its own secrets
+static int ns_buffer_ok(const void* buffer, size_t size, int writable){
+        if(buffer == NULL){
+            return 0;
+        }
+        if(size == 0){
+            return 1;
+        }
+#ifndef EMU
+        return writable ? arm_cmse_addr_nonsecure_range_readwrite_ok((uint32_t) buffer, size, 0)
+                        : arm_cmse_addr_nonsecure_range_read_ok((uint32_t) buffer, size, 0);
+#else
+        return 1;
+#endif
+}
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
 int get_keystore_size(){
-        return keystore_size;
+        keystore_rdlock();
+        int size = keystore_size;
+        keystore_unlock();
+        return size;
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-void store_pk(char* public_key_hex){
-        int cont = keystore_size - 1;
-        for(int i = 0; i < 96; i++){
-            public_keys_hex_store[i+96*cont] = public_key_hex[i];
+int get_pk(int key, char* public_key_hex_ns){
+        //Copies the 96 characters hex public key of the key handle
+        //Returns 0 on success or -1 if the handle isn't a stored key
+        int ret = -1;
+        if(!ns_buffer_ok(public_key_hex_ns, 2*PK_SIZE, 1)){
+            return -1;
         }
+        keystore_rdlock();
+        if(key >= 0 && (uint32_t) key < slots_used && slots[key].state == SLOT_USED){
+            memcpy(public_key_hex_ns, slots[key].pk_hex, 2*PK_SIZE);
+            ret = 0;
+        }
+        keystore_unlock();
+
+        return ret;
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-void getkeys(char* public_keys_hex_store_ns){
-        for(int i = 0; i < keystore_size*96; i++){
-            public_keys_hex_store_ns[i] = public_keys_hex_store[i];
+int pk_in_keystore(byte* public_key_ns){
+        //Returns the key handle of the 48 bytes public key or -1 if it isn't stored
+        byte public_key[PK_SIZE];
+        if(!ns_buffer_ok(public_key_ns, PK_SIZE, 0)){
+            return -1;
         }
+        memcpy(public_key, public_key_ns, PK_SIZE);
+
+        keystore_rdlock();
+        int ret = index_find(public_key);
+        keystore_unlock();
+
+        return ret;
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-int pk_in_keystore(char * public_key_hex, int offset){
+int pk_affine(byte* public_key_ns, blst_p1_affine* pk_ns){
+        //Copies the cached affine point of a stored public key
+        //Returns 0 on success or -1 if it isn't stored
+        byte public_key[PK_SIZE];
+        blst_p1_affine pk;
+        if(!ns_buffer_ok(public_key_ns, PK_SIZE, 0) || !ns_buffer_ok(pk_ns, sizeof(blst_p1_affine), 1)){
+            return -1;
+        }
+        memcpy(public_key, public_key_ns, PK_SIZE);
+
+        keystore_rdlock();
+        int key = index_find(public_key);
+        int ready = 0;
+        if(key != -1){
+            ready = slots[key].affine_ready;
+            pk = slots[key].pk_affine;
+        }
+        keystore_unlock();
+        if(key == -1){
+            return -1;
+        }
+
+        //Keys loaded from flash are decompressed the first time they are used
+        if(!ready){
+            if(blst_p1_uncompress(&pk, public_key) != BLST_SUCCESS){
+                return -1;
+            }
+            keystore_wrlock();
+            if(slots[key].state == SLOT_USED && memcmp(slots[key].pk, public_key, PK_SIZE) == 0){
+                slots[key].pk_affine = pk;
+                slots[key].affine_ready = 1;
+            }
+            keystore_unlock();
+        }
+        *pk_ns = pk;
 
-        int ret = 0;
+        return 0;
+}
 
-        int c = 0;
-        int cont = 0;
+#define KEYGEN_RANDOM_LEN 64 //Random bytes hashed into the IKM of every key of keygen_chunk
+#define EIP2334_PURPOSE 12381
+#define EIP2334_COIN_TYPE 3600
 
-        if(keystore_size == 0){
-                ret = -1;
+//Derives a key from ikm and stores it with its public data
+//Returns the key handle of the new key or -1 if the keystore is full
+static int ikm_store(unsigned char* ikm, char* info){
+        //Secret key (256-bit scalar)
+        blst_scalar sk;
+        blst_keygen(&sk, ikm, 32, info, sizeof(info));
+
+        //The public key is derived once here and cached in the slot
+        struct key_public pub;
+        key_public_from_sk(&pub, &sk);
+
+        keystore_wrlock();
+        int key = slot_store(&sk, &pub);
+        if(key != -1){
+            keystore_size++;
+            persist_store(key);
         }
+        keystore_unlock();
 
-        for(int i = 0; i < keystore_size; i++){
-            for(int x = 0; x < 96; x++){
-                if(public_key_hex[x + offset] != public_keys_hex_store[x + cont]){
-                    c = 1;
-                    break;
-                }
+        return key;
+}
+
+//Generates up to KEYGEN_BATCH_CHUNK keys with a single request to the RNG
+//Writes their key handles to keys and returns how many were generated, fewer than n if the keystore is full
+static int keygen_chunk(const char* info, int* keys, int n){
+        unsigned char ikms[KEYGEN_BATCH_CHUNK][32];
+
+        if(n > KEYGEN_BATCH_CHUNK){
+            n = KEYGEN_BATCH_CHUNK;
+        }
+#ifndef EMU
+        uint8_t random_number[KEYGEN_BATCH_CHUNK * KEYGEN_RANDOM_LEN];
+        size_t olen = n * KEYGEN_RANDOM_LEN;
+
+        // For security, IKM MUST be infeasible to guess, e.g., generated by a trusted
+        // source of randomness. IKM MUST be at least 32 bytes long, but it MAY be longer.
+        nrf_cc3xx_platform_ctr_drbg_get(NULL, random_number, n * KEYGEN_RANDOM_LEN, &olen);
+        for(int i = 0; i < n; i++){
+            ocrypto_sha256(ikms[i], random_number + i * KEYGEN_RANDOM_LEN, KEYGEN_RANDOM_LEN);
+        }
+        memset(random_number, 0, sizeof(random_number));
+#else
+        for(int i = 0; i < n; i++){
+            for(int j = 0; j < 32; j++){
+                ikms[i][j] = rand();
             }
-            if (c == 0){
-                sk_sign = secret_keys_store[i];
-                break;
-            } else {
-                if((i+1) < keystore_size){
-                    cont += 96;
-                    c = 0;
+        }
+#endif
+
+        int generated = 0;
+        while(generated < n && (keys[generated] = ikm_store(ikms[generated], (char*) info)) != -1){
+            generated++;
+        }
+        memset(ikms, 0, sizeof(ikms));
+
+        return generated;
+}
+
+static int pk_out_ok(const struct secure_pk_out* out, uint32_t n){
+        if(out->hex_stride != 0 && (out->hex_stride < 2*PK_SIZE || out->hex_stride > SECURE_CMD_MAX_STRIDE)){
+            return 0;
+        }
+        size_t hex_size = (out->hex_stride == 0) ? n * 2*PK_SIZE : (n - 1) * out->hex_stride + 2*PK_SIZE;
+        return (out->pks == NULL || ns_buffer_ok(out->pks, n * PK_SIZE, 1)) &&
+               (out->pks_hex == NULL || ns_buffer_ok(out->pks_hex, hex_size, 1));
+}
+
+//Writes the public key of a stored key as the i-th key of out, called with the keystore lock held
+static void pk_out_write(const struct secure_pk_out* out, uint32_t i, int key){
+        if(out->pks != NULL){
+            memcpy(out->pks + i * PK_SIZE, slots[key].pk, PK_SIZE);
+        }
+        if(out->pks_hex != NULL){
+            memcpy(out->pks_hex + i * (out->hex_stride ? out->hex_stride : 2*PK_SIZE), slots[key].pk_hex, 2*PK_SIZE);
+        }
+}
+
+static int dispatch_sign(uint32_t n, struct secure_sign_item* items_ns){
+        struct secure_sign_item items[SECURE_CMD_MAX];
+        blst_scalar sks[SECURE_CMD_MAX];
+        int missing = 0;
+
+        //The items are copied before they are checked, so they can't change in between
+        if(!ns_buffer_ok(items_ns, n * sizeof(struct secure_sign_item), 1)){
+            return -2;
+        }
+        memcpy(items, items_ns, n * sizeof(struct secure_sign_item));
+        for(uint32_t i = 0; i < n; i++){
+            if((items[i].pk != NULL && !ns_buffer_ok(items[i].pk, PK_SIZE, 0)) || !ns_buffer_ok(items[i].msg, items[i].len, 0) ||
+               (items[i].sig != NULL && !ns_buffer_ok(items[i].sig, 96, 1)) ||
+               (items[i].sig_hex != NULL && !ns_buffer_ok(items[i].sig_hex, 192, 1))){
+                return -2;
+            }
+        }
+
+        //Every key is looked up and copied under the same lock, so a key deleted meanwhile isn't used
+        keystore_rdlock();
+        for(uint32_t i = 0; i < n; i++){
+            int key = (items[i].pk != NULL) ? index_find(items[i].pk) : items[i].key;
+            if(key < 0 || (uint32_t) key >= slots_used || slots[key].state != SLOT_USED){
+                key = -1;
+                missing = 1;
+            }else{
+                sks[i] = slots[key].sk;
+            }
+            items[i].key = key;
+            items_ns[i].key = key;
+        }
+        keystore_unlock();
+        if(missing){
+            memset(sks, 0, sizeof(sks));
+            return -1;
+        }
+
+        blst_p2 hashes[SIGN_BATCH_CHUNK];
+        blst_p2 sig;
+        byte sig_bin[96];
+        char sig_hex[2*96 + 1];
+        for(uint32_t first = 0; first < n; first += SIGN_BATCH_CHUNK){
+            uint32_t count = (n - first < SIGN_BATCH_CHUNK) ? n - first : SIGN_BATCH_CHUNK;
+            struct secure_sign_item* chunk = items + first;
+
+            PROFILE_BEGIN(hash_to_g2);
+            for(uint32_t i = 0; i < count; i++){
+                //Repeated messages are hashed once, earlier chunks are found in the hash cache
+                uint32_t j = 0;
+                while((j < i) && ((chunk[j].len != chunk[i].len) || (memcmp(chunk[j].msg, chunk[i].msg, chunk[i].len) != 0))){
+                    j++;
+                }
+                if(j < i){
+                    hashes[i] = hashes[j];
                 }else{
-                    ret = -1;
+                    get_point_from_msg(&hashes[i], (uint8_t*) chunk[i].msg, chunk[i].len);
                 }
             }
+            PROFILE_END(hash_to_g2);
+
+            PROFILE_BEGIN(sign_pk);
+            for(uint32_t i = 0; i < count; i++){
+                blst_sign_pk_in_g1(&sig, &hashes[i], &sks[first + i]);
+                blst_p2_compress(sig_bin, &sig);
+                if(chunk[i].sig != NULL){
+                    memcpy(chunk[i].sig, sig_bin, sizeof(sig_bin));
+                }
+                if(chunk[i].sig_hex != NULL){
+                    hex_encode(sig_bin, sizeof(sig_bin), sig_hex);
+                    memcpy(chunk[i].sig_hex, sig_hex, 2*96);
+                }
+            }
+            PROFILE_END(sign_pk);
         }
-        return ret;
+        memset(sks, 0, sizeof(sks));
+
+        return n;
+}
+
+static int dispatch_keygen(uint32_t n, const char* info_ns, int32_t* keys_ns, const struct secure_pk_out* out){
+        char info[32];
+        int keys[KEYGEN_BATCH_CHUNK];
+        uint32_t generated = 0;
+
+        if(!ns_buffer_ok(info_ns, sizeof(info), 0) || (keys_ns != NULL && !ns_buffer_ok(keys_ns, n * sizeof(int32_t), 1)) || !pk_out_ok(out, n)){
+            return -2;
+        }
+        memcpy(info, info_ns, sizeof(info));
+
+        while(generated < n){
+            int chunk = (n - generated < KEYGEN_BATCH_CHUNK) ? n - generated : KEYGEN_BATCH_CHUNK;
+            int got = keygen_chunk(info, keys, chunk);
+
+            keystore_rdlock();
+            for(int i = 0; i < got; i++){
+                if(keys_ns != NULL){
+                    keys_ns[generated + i] = keys[i];
+                }
+                pk_out_write(out, generated + i, keys[i]);
+            }
+            keystore_unlock();
+            generated += got;
+            if(got < chunk){
+                break;
+            }
+        }
+
+        return generated;
+}
+
+static int dispatch_getkeys(uint32_t n, int32_t* cursor_ns, const struct secure_pk_out* out){
+        uint32_t copied = 0;
+        int key;
+
+        if(!ns_buffer_ok(cursor_ns, sizeof(int32_t), 1) || !pk_out_ok(out, n)){
+            return -2;
+        }
+        int cursor = *cursor_ns;
+
+        keystore_rdlock();
+        while((copied < n) && ((key = slot_next(&cursor)) != -1)){
+            pk_out_write(out, copied, key);
+            copied++;
+        }
+        keystore_unlock();
+        *cursor_ns = cursor;
+
+        return copied;
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-void ikm_sk(char* info){
-        // For security, IKM MUST be infeasible to guess, e.g., generated by a trusted
-        // source of randomness. IKM MUST be at least 32 bytes long, but it MAY be longer.
-        unsigned char ikm[32];
-#ifndef EMU
-	    const int random_number_len = 144;     
-        uint8_t random_number[random_number_len];
-        size_t olen = random_number_len;
-        int ret;
+int secure_dispatch(struct secure_cmd* cmd_ns){
+        //Runs a whole command in a single secure call, see secure_cmd.h
+        struct secure_cmd cmd;
 
-        ret = nrf_cc3xx_platform_ctr_drbg_get(NULL, random_number, random_number_len, &olen);
-        
-        ocrypto_sha256(ikm, random_number, random_number_len);
-#else
-        for(int i = 0; i < 32; i++){
-            ikm[i] = rand();
+        if(!ns_buffer_ok(cmd_ns, sizeof(cmd), 0)){
+            return -2;
+        }
+        memcpy(&cmd, cmd_ns, sizeof(cmd));
+        if(cmd.n == 0 || cmd.n > SECURE_CMD_MAX){
+            return -2;
         }
-#endif
 
-        
-        //Secret key (256-bit scalar)
-        blst_keygen(&sk, ikm, sizeof(ikm), info, sizeof(info));
-        secret_keys_store[keystore_size] = sk;
-        keystore_size++;
+        switch(cmd.op){
+            case SECURE_CMD_SIGN:
+                return dispatch_sign(cmd.n, cmd.sign_args.items);
+            case SECURE_CMD_KEYGEN:
+                return dispatch_keygen(cmd.n, cmd.keygen_args.info, cmd.keygen_args.keys, &cmd.keygen_args.out);
+            case SECURE_CMD_GETKEYS:
+                return dispatch_getkeys(cmd.n, cmd.getkeys_args.cursor, &cmd.getkeys_args.out);
+            default:
+                return -2;
+        }
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-void sk_to_pk(blst_p1* pk){
-        blst_sk_to_pk_in_g1(pk, &sk);
+void reset(){
+        keystore_wrlock();
+        persist_clear();
+        keystore_clear();
+        keystore_size = 0;
+        keystore_unlock();
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-void sign_pk(blst_p2* sig, blst_p2* hash){
-        blst_sign_pk_in_g1(sig, hash, &sk_sign);
+int delete_key(byte* public_key_ns){
+        //Returns 0 if the key was deleted or -1 if it isn't stored
+        byte public_key[PK_SIZE];
+        if(!ns_buffer_ok(public_key_ns, PK_SIZE, 0)){
+            return -1;
+        }
+        memcpy(public_key, public_key_ns, PK_SIZE);
+
+        keystore_wrlock();
+        int key = index_find(public_key);
+        if(key != -1){
+            persist_delete(key);
+            slot_free(key);
+            keystore_size--;
+        }
+        keystore_unlock();
+
+        return (key == -1) ? -1 : 0;
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-void reset(){
-        memset(secret_keys_store, 0, sizeof(secret_keys_store));
-        memset(public_keys_hex_store, 0, 960);
-        keystore_size = 0;
+int import_sk(blst_scalar* sk_ns){
+        //Returns the key handle of the imported key, -1 if it was already imported,
+        //-2 if the keystore is full or -3 if sk_ns isn't nonsecure memory
+        int ret;
+        struct key_public pub;
+        blst_scalar sk;
+        if(!ns_buffer_ok(sk_ns, sizeof(blst_scalar), 0)){
+            return -3;
+        }
+        //Copied once, so that the stored key is the one its public key was derived from
+        memcpy(&sk, sk_ns, sizeof(sk));
+        key_public_from_sk(&pub, &sk);
+
+        keystore_wrlock();
+        if(index_find(pub.pk) != -1){
+            ret = -1;
+        }else{
+            ret = slot_store(&sk, &pub);
+            if(ret == -1){
+                ret = -2;
+            }else{
+                keystore_size++;
+                persist_store(ret);
+            }
+        }
+        keystore_unlock();
+        memset(&sk, 0, sizeof(sk));
+
+        return ret;
 }
 
 #ifndef EMU
 __TZ_NONSECURE_ENTRY_FUNC
 #endif
-int import_sk(blst_scalar* sk_imp){
-        int ret = 0;
+int seed_import(byte* seed, int len){
+        //Stores the m/12381/3600 node of the EIP-2333 tree of seed, replacing the previous seed
+        //Returns 0 on success or -1 if the seed is shorter than 32 bytes or isn't nonsecure memory
+        if(len < 32 || !ns_buffer_ok(seed, len, 0)){
+            return -1;
+        }
 
-        int c = 0;
+        blst_scalar master, purpose, node;
+        blst_derive_master_eip2333(&master, seed, len);
+        blst_derive_child_eip2333(&purpose, &master, EIP2334_PURPOSE);
+        blst_derive_child_eip2333(&node, &purpose, EIP2334_COIN_TYPE);
 
-        if(keystore_size == 0){
-                secret_keys_store[keystore_size] = *sk_imp;
-                keystore_size++;
-                sk = *sk_imp;
-        }else{
-            for(int i = 0; i < keystore_size; i++){
-                for(int x = 0; x < 32; x++){
-                    if(secret_keys_store[i].b[x] != (*sk_imp).b[x]){
-                        c = 1;
-                        break;
-                    }
-            }
-                if (c == 0){
-                    ret = -1;
-                    break;
-                } else {
-                    if((i+1) < keystore_size){
-                        c = 0;
-                    }else{
-                        secret_keys_store[keystore_size] = *sk_imp;
-                        keystore_size++;
-                        sk = *sk_imp;
-                        break;
-                    }
+        keystore_wrlock();
+        //Keys derived from the previous seed stay stored, but derive_sk mustn't find them for this one
+        if(!wallet_ready || memcmp(&wallet_node, &node, sizeof(node)) != 0){
+            for(uint32_t key = 0; key < slots_used; key++){
+                if(slots[key].state == SLOT_USED && slots[key].derivation != 0){
+                    slots[key].derivation = 0;
+                    persist_store(key);
                 }
             }
         }
-        return ret;
+        wallet_node = node;
+        wallet_ready = 1;
+        persist_wallet();
+        keystore_unlock();
+
+        memset(&master, 0, sizeof(master));
+        memset(&purpose, 0, sizeof(purpose));
+        memset(&node, 0, sizeof(node));
+        return 0;
+}
+
+#ifndef EMU
+__TZ_NONSECURE_ENTRY_FUNC
+#endif
+int derive_sk(uint32_t index){
+        //Derives the signing key m/12381/3600/index/0/0 of the stored seed and stores it,
+        //a key derived before is found in its slot instead
+        //Returns the key handle of the key, -1 if no seed is stored or -2 if the keystore is full
+        keystore_rdlock();
+        int key = slot_find_derived(index);
+        int ready = wallet_ready;
+        blst_scalar node = wallet_node;
+        keystore_unlock();
+        if(key != -1 || !ready){
+            memset(&node, 0, sizeof(node));
+            return (key != -1) ? key : -1;
+        }
+
+        blst_scalar account, withdrawal, sk;
+        blst_derive_child_eip2333(&account, &node, index);
+        blst_derive_child_eip2333(&withdrawal, &account, 0);
+        blst_derive_child_eip2333(&sk, &withdrawal, 0);
+
+        struct key_public pub;
+        key_public_from_sk(&pub, &sk);
+
+        keystore_wrlock();
+        key = index_find(pub.pk);
+        if(key == -1){
+            key = slot_store(&sk, &pub);
+            if(key == -1){
+                key = -2;
+            }else{
+                keystore_size++;
+            }
+        }
+        if(key >= 0){
+            //The key may have been imported or derived by another request meanwhile
+            slots[key].derivation = (uint64_t) index + 1;
+            persist_store(key);
+        }
+        keystore_unlock();
+
+        memset(&node, 0, sizeof(node));
+        memset(&account, 0, sizeof(account));
+        memset(&withdrawal, 0, sizeof(withdrawal));
+        memset(&sk, 0, sizeof(sk));
+        return key;
 }
 
 #ifndef EMU
 void main(void)
 {
 	spm_config();
+	keystore_load();
 	spm_jump();
 }
 #endif
\ No newline at end of file
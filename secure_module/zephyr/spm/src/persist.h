@@ -0,0 +1,287 @@
+/*
+ * Persistence of the keystore
+ *
+ * Every stored key is written with its compressed public key, every deleted
+ * key is erased, so a reset of the board no longer needs the keys to be
+ * imported again. keystore_load reads them back into the same slots before
+ * the nonsecure firmware starts, so key handles survive too. It only copies
+ * the secret key and the compressed public key: the affine point is
+ * decompressed the first time verify asks for it (see pk_affine).
+ *
+ * The firmware keeps the records in Zephyr NVS, on the spm_storage partition
+ * of the secure flash (pm.yml). NVS only appends to its sectors and erases
+ * the oldest one when they are full, which levels the wear. The record of a
+ * slot is its NVS id, the node of the EIP-2333 seed has its own id.
+ *
+ * The emulator appends the records to the file named by the HSM_KEYSTORE
+ * environment variable, and keeps its keys in memory only without it. The
+ * file is compacted to the live keys when it's loaded, and only its owner can
+ * read it.
+ *
+ * keystore_load runs once before the keystore is used, the other functions
+ * are called with the keystore lock held.
+ */
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+struct key_record{
+        blst_scalar sk;
+        uint8_t pk[PK_SIZE];
+        uint64_t derivation;
+};
+
+//Restores a record into its slot
+static void record_restore(uint32_t key, const struct key_record* record){
+        char pk_hex[2*PK_SIZE + 1];
+
+        hex_encode(record->pk, PK_SIZE, pk_hex);
+        slots[key].sk = record->sk;
+        memcpy(slots[key].pk, record->pk, PK_SIZE);
+        memcpy(slots[key].pk_hex, pk_hex, 2*PK_SIZE);
+        slots[key].derivation = record->derivation;
+        slots[key].affine_ready = 0;
+        slots[key].state = SLOT_USED;
+        index_insert(key);
+}
+
+//Chains the slots below slots_used that no record filled into the free list
+static void slots_rebuild_free(){
+        free_head = NO_SLOT;
+        for(uint32_t key = slots_used; key-- > 0;){
+            if(slots[key].state != SLOT_USED){
+                slots[key].next_free = free_head;
+                free_head = key;
+            }
+        }
+}
+
+#ifndef EMU
+#include <drivers/flash.h>
+#include <fs/nvs.h>
+#include <pm_config.h>
+
+#define WALLET_RECORD 0xFFFE //NVS id of the seed node, slots take the ids from 0 on
+
+static struct nvs_fs keystore_fs;
+static int keystore_fs_ready = 0;
+
+//Returns the number of keys loaded or -1 if the flash can't be used
+int keystore_load(){
+        const struct device* flash = device_get_binding(DT_CHOSEN_ZEPHYR_FLASH_CONTROLLER_LABEL);
+        struct flash_pages_info info;
+
+        if(flash == NULL || flash_get_page_info_by_offs(flash, PM_SPM_STORAGE_ADDRESS, &info)){
+            return -1;
+        }
+        keystore_fs.offset = PM_SPM_STORAGE_ADDRESS;
+        keystore_fs.sector_size = info.size;
+        keystore_fs.sector_count = PM_SPM_STORAGE_SIZE / info.size;
+        if(nvs_init(&keystore_fs, DT_CHOSEN_ZEPHYR_FLASH_CONTROLLER_LABEL)){
+            return -1;
+        }
+        keystore_fs_ready = 1;
+
+        int loaded = 0;
+        struct key_record record;
+        for(uint32_t key = 0; key < slots_capacity; key++){
+            if(nvs_read(&keystore_fs, key, &record, sizeof(record)) == sizeof(record)){
+                record_restore(key, &record);
+                slots_used = key + 1;
+                loaded++;
+            }
+        }
+        if(nvs_read(&keystore_fs, WALLET_RECORD, &record, sizeof(record)) == sizeof(record)){
+            wallet_node = record.sk;
+            wallet_ready = 1;
+        }
+        slots_rebuild_free();
+        keystore_size = loaded;
+        memset(&record, 0, sizeof(record));
+
+        return loaded;
+}
+
+void persist_store(int key){
+        if(!keystore_fs_ready){
+            return;
+        }
+        struct key_record record = {slots[key].sk};
+        memcpy(record.pk, slots[key].pk, PK_SIZE);
+        record.derivation = slots[key].derivation;
+        if(nvs_write(&keystore_fs, key, &record, sizeof(record)) < 0){
+            printk("Keystore: key %d couldn't be written to flash\n", key);
+        }
+        memset(&record, 0, sizeof(record));
+}
+
+void persist_delete(int key){
+        if(keystore_fs_ready){
+            nvs_delete(&keystore_fs, key);
+        }
+}
+
+void persist_wallet(){
+        if(!keystore_fs_ready){
+            return;
+        }
+        struct key_record record = {wallet_node};
+        if(nvs_write(&keystore_fs, WALLET_RECORD, &record, sizeof(record)) < 0){
+            printk("Keystore: the seed couldn't be written to flash\n");
+        }
+        memset(&record, 0, sizeof(record));
+}
+
+void persist_clear(){
+        for(uint32_t key = 0; keystore_fs_ready && key < slots_used; key++){
+            nvs_delete(&keystore_fs, key);
+        }
+        if(keystore_fs_ready){
+            nvs_delete(&keystore_fs, WALLET_RECORD);
+        }
+}
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RECORD_STORE 1
+#define RECORD_DELETE 2
+#define RECORD_CLEAR 3
+#define RECORD_WALLET 4
+
+struct log_record{
+        uint8_t op;
+        uint32_t key;
+        struct key_record data;
+};
+
+static FILE* keystore_file = NULL;
+
+static void log_append(uint8_t op, uint32_t key){
+        struct log_record record = {op, key};
+
+        if(keystore_file == NULL){
+            return;
+        }
+        if(op == RECORD_STORE){
+            record.data.sk = slots[key].sk;
+            memcpy(record.data.pk, slots[key].pk, PK_SIZE);
+            record.data.derivation = slots[key].derivation;
+        }else if(op == RECORD_WALLET){
+            record.data.sk = wallet_node;
+        }
+        fwrite(&record, sizeof(record), 1, keystore_file);
+        fflush(keystore_file);
+}
+
+//The file holds raw secret keys, so only its owner can read it, even if it was left
+//with a wider mode. Returns NULL on error
+static FILE* keystore_open(const char* path, int flags, const char* mode){
+        int fd = open(path, O_CREAT | O_WRONLY | flags, 0600);
+        if(fd < 0){
+            return NULL;
+        }
+        FILE* file = (fchmod(fd, 0600) == 0) ? fdopen(fd, mode) : NULL;
+        if(file == NULL){
+            close(fd);
+        }
+        return file;
+}
+
+//Returns the number of keys loaded or -1 if the file can't be used
+int keystore_load(){
+        const char* path = getenv("HSM_KEYSTORE");
+        if(path == NULL){
+            return 0;
+        }
+
+        //The log is replayed, the last record of every slot wins
+        FILE* file = fopen(path, "rb");
+        struct log_record record;
+        while(file != NULL && fread(&record, sizeof(record), 1, file) == 1){
+            if(record.op == RECORD_CLEAR){
+                keystore_clear();
+                keystore_size = 0;
+                continue;
+            }
+            if(record.op == RECORD_WALLET){
+                wallet_node = record.data.sk;
+                wallet_ready = 1;
+                continue;
+            }
+            while(record.key >= slots_capacity){
+                if(keystore_grow() != 0){
+                    fclose(file);
+                    return -1;
+                }
+            }
+            if(slots[record.key].state == SLOT_USED){
+                index_remove(record.key);
+                memset(&slots[record.key], 0, sizeof(struct key_slot));
+                keystore_size--;
+            }
+            if(record.op == RECORD_STORE){
+                record_restore(record.key, &record.data);
+                keystore_size++;
+                if(record.key >= slots_used){
+                    slots_used = record.key + 1;
+                }
+            }
+        }
+        if(file != NULL){
+            fclose(file);
+        }
+        slots_rebuild_free();
+
+        //Compacted to a record per key, written aside and renamed so that a crash keeps the old log
+        size_t tmp_len = strlen(path) + 5;
+        char* tmp = malloc(tmp_len);
+        if(tmp == NULL){
+            return -1;
+        }
+        snprintf(tmp, tmp_len, "%s.tmp", path);
+        keystore_file = keystore_open(tmp, O_TRUNC, "wb");
+        if(keystore_file == NULL){
+            free(tmp);
+            return -1;
+        }
+        for(uint32_t key = 0; key < slots_used; key++){
+            if(slots[key].state == SLOT_USED){
+                log_append(RECORD_STORE, key);
+            }
+        }
+        if(wallet_ready){
+            log_append(RECORD_WALLET, 0);
+        }
+        fclose(keystore_file);
+        keystore_file = (rename(tmp, path) == 0) ? keystore_open(path, O_APPEND, "ab") : NULL;
+        free(tmp);
+        memset(&record, 0, sizeof(record));
+
+        return (keystore_file == NULL) ? -1 : keystore_size;
+}
+
+void persist_store(int key){
+        log_append(RECORD_STORE, key);
+}
+
+void persist_delete(int key){
+        log_append(RECORD_DELETE, key);
+}
+
+void persist_wallet(){
+        log_append(RECORD_WALLET, 0);
+}
+
+void persist_clear(){
+        log_append(RECORD_CLEAR, 0);
+}
+#endif
+
+#endif
@@ -2,14 +2,17 @@
 chmod +rwx *
 
 usage(){
-  echo "Usage: $0 [-c \"compiler path\"] [-i] -b \"board identifier\"
+  echo "Usage: $0 [-c \"compiler path\"] [-i] [-p profile] -b \"board identifier\"
   -c \"compiler path\": define path of the arm compiler (arm-none-eabi-gcc file)
   -i: check if GNU ARM Embedded Toolchain is installed. Install it otherwise
+  -p profile: build profile of the blst library (see blst_profile.sh), m33 by default
   -b: board identifier"
   exit 1;
 }
 
-while getopts ":c::b::i" opt; do
+profile=m33
+
+while getopts ":c::b::p::i" opt; do
   case $opt in
     c) comp="$OPTARG"
     control=0
@@ -19,6 +22,8 @@ while getopts ":c::b::i" opt; do
     ;;
     b)board="$OPTARG"
     ;;
+    p)profile="$OPTARG"
+    ;;
     *) usage
     ;;
   esac
@@ -36,10 +41,10 @@ comp=`realpath $comp`
 
 echo "Compiler selected: $comp"
 
-./build_blst.sh -c $comp
+./build_blst.sh -c $comp -p $profile || exit 1
 
 ./dependencies.sh
 
-./build.sh -c $comp -b $board
+./build.sh -c $comp -b $board -p $profile
 
 ./flash.sh
\ No newline at end of file
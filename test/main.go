@@ -71,9 +71,9 @@ func main() {
 		}
 
 		if verb {
-			fmt.Println("Attempting to generate extra key...")
+			fmt.Println("Deleting one key...")
 		}
-		keygenext(s, scanner, verb, passed)
+		deletekey(s, scanner, str, verb, passed)
 		if verb {
 			fmt.Printf("\n\n")
 		}
@@ -165,7 +165,7 @@ func main() {
 				color.Red("FAILED")
 			}
 
-			fmt.Printf("Try to generate extra key.....")
+			fmt.Printf("Delete one key................")
 			if passed[4] {
 				color.HiGreen("PASSED")
 			} else {
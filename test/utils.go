@@ -175,30 +175,33 @@ func check(s *serial.Port, scanner *bufio.Scanner, str []string, verb bool, pass
 		}
 	}
 }
-func keygenext(s *serial.Port, scanner *bufio.Scanner, verb bool, passed []bool) {
-	n, err := s.Write([]byte("keygen\n"))
+func deletekey(s *serial.Port, scanner *bufio.Scanner, str []string, verb bool, passed []bool) {
+	n, err := s.Write([]byte("delete " + str[9] + "\n"))
 	if err != nil {
 		log.Fatal(err)
 	}
 	_ = n
 
 	if !verb {
-		fmt.Printf("Try to generate extra key.....")
+		fmt.Printf("Delete one key................")
 	}
 
 	for scanner.Scan() {
 		if verb {
 			fmt.Println(scanner.Text())
 		}
-		if strings.HasSuffix(scanner.Text(), ".") {
+		if strings.Contains(scanner.Text(), "deleted") {
 			passed[4] = true
 			if verb {
 				color.HiGreen("PASSED")
 			}
 			break
 		}
+		if strings.Contains(scanner.Text(), "stored") || strings.Contains(scanner.Text(), "Incorrect") {
+			break
+		}
 	}
-	if !strings.HasSuffix(scanner.Text(), ".") {
+	if !strings.Contains(scanner.Text(), "deleted") {
 		passed[4] = false
 		if verb {
 			color.Red("FAILED")